@@ -29,19 +29,78 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "ratchet.h"
 #include "misc.h"
 #include "libdns/dns.h"
 
-#define DNS_GET_POLL_TIMEOUT(n) (pow (2.0, (double) n))
-#define DNS_GET_MULTI_POLL_TIMEOUT 2.0
+#define DNS_DEFAULT_EXPIRE_TIMEOUT 10.0
+#define DNS_ENGINE_RECV_SIZE 4096
+#define DNS_ENGINE_BIND_TRIES 16
+#define DNS_ENGINE_PORT_QUERIES 1000
+#define DNS_TIMED_OUT "Timed out."
+#define DNS_SERVER_FAILED "Server failure."
+#define DNS_ABANDONED "Lookup abandoned by its thread."
 
 #define DNS_TXT_SIZE_REGISTRY_KEY "ratchet_dns_txt_size"
+#define DNS_CACHE_REGISTRY_KEY "ratchet_dns_cache"
+#define DNS_ENGINE_REGISTRY_KEY "ratchet_dns_engines"
+#define DNS_CONFIG_REGISTRY_KEY "ratchet_dns_config"
+
+#define DNS_CONFIG_CHECK_INTERVAL 1.0
+#define DNS_RESOLV_CONF_PATH "/etc/resolv.conf"
+#define DNS_HOSTS_PATH "/etc/hosts"
+
+#define DNS_LOOKUP_SINGLE 0x1
+#define DNS_LOOKUP_CACHEABLE 0x2
+#define DNS_LOOKUP_MANY 0x4
+#define DNS_LOOKUP_COMPACT 0x8
+#define DNS_QUERY_MANY_CONCURRENCY 64
+#define DNS_VERIFY_PTR_MAX_NAMES 10
+#define DNS_VERIFY_PTR_KIND "FCRDNS"
+
+/* Stack slots of a thread driving lookups through the engine. */
+#define LOOKUP_FLAGS 1
+#define LOOKUP_DATA 2
+#define LOOKUP_QUERIES 3
+#define LOOKUP_ANSWERS 4
+#define LOOKUP_ERRORS 5
+#define LOOKUP_RESCONF 6
+#define LOOKUP_HOSTS 7
+#define LOOKUP_TIMEOUT 8
+#define LOOKUP_WAITER 9
+#define LOOKUP_RATCHET 10
+#define LOOKUP_ENGINE 11
+#define LOOKUP_LOOKUPS 12
 
 #define raise_dns_error(L, s, c, e) raise_dns_error_ln (L, s, c, e, __FILE__, __LINE__)
 #define get_dns_res(L, i) (*(struct dns_resolver **) luaL_checkudata (L, i, "ratchet_dns_meta"))
+#define get_dns_engine(L, i) ((struct dns_engine *) luaL_checkudata (L, i, "ratchet_dns_engine_meta"))
+#define get_dns_lookup(L, i) ((struct dns_lookup *) luaL_checkudata (L, i, "ratchet_dns_lookup_meta"))
+#define get_dns_compact(L, i) ((struct dns_compact *) luaL_checkudata (L, i, "ratchet_dns_compact_meta"))
+
+/* {{{ enum dns_reason */
+enum dns_reason
+{
+	/* Why a query has no answer, apart from the message text. */
+	DNS_REASON_NONE = 0,
+	DNS_REASON_NODATA,
+	DNS_REASON_NXDOMAIN,
+	DNS_REASON_SERVFAIL,
+	DNS_REASON_TIMEOUT
+};
+/* }}} */
+
+static const char *dns_reason_names[] = {NULL, "nodata", "nxdomain", "servfail", "timeout"};
 
 size_t dns_ptr_qname(void *dst, size_t lim, int af, void *addr);
 
@@ -69,11 +128,14 @@ static int raise_dns_error_ln (lua_State *L, const char *subj, const char *call,
 }
 /* }}} */
 
+static void refresh_default_config (lua_State *L);
+
 /* {{{ arg_or_registry() */
 static void *arg_or_registry (lua_State *L, int index, const char *reg_default, const char *checkudata)
 {
 	if (lua_isnoneornil (L, index))
 	{
+		refresh_default_config (L);
 		lua_getfield (L, LUA_REGISTRYINDEX, reg_default);
 		lua_replace (L, index);
 	}
@@ -621,355 +683,3132 @@ static const char *ensure_arpa_string (lua_State *L, int index)
 }
 /* }}} */
 
-/* {{{ push_dns_resolver_table() */
-static int push_dns_resolver_table (lua_State *L, size_t num, int resconf_idx, int hosts_idx, int timeout_idx)
-{
-	lua_createtable (L, (int) num, 0);
-
-	size_t i;
-	for (i=1; i<=num; i++)
-	{
-		/* Construct a new ratchet.dns object. */
-		lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_dns_class");
-		lua_getfield (L, -1, "new");
-		lua_pushvalue (L, resconf_idx);
-		lua_pushvalue (L, hosts_idx);
-		lua_pushvalue (L, timeout_idx);
-		lua_call (L, 3, 1);
+/* ---- Answer Cache Functions ---------------------------------------------- */
 
-		lua_rawseti (L, -3, i);
-		lua_pop (L, 1);
-	}
+/* {{{ struct dns_answer_cache */
+struct dns_answer_cache
+{
+	int enabled;
+	double min_ttl;
+	double max_ttl;
+	double negative_ttl;
+	size_t max_entries;
+	size_t entries;
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long misses;
+	unsigned long expired;
+	unsigned long inserts;
+};
+/* }}} */
 
-	return 1;
+/* {{{ cache_now() */
+static double cache_now (void)
+{
+	struct timespec ts;
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+	return fromtimespec (&ts);
 }
 /* }}} */
 
-/* {{{ submit_dns_queries() */
-static int submit_dns_queries (lua_State *L, size_t num, int res_idx, int data_idx, int types_idx)
+/* {{{ push_answer_cache() */
+static struct dns_answer_cache *push_answer_cache (lua_State *L)
 {
-	size_t i;
-
-	for (i=1; i<=num; i++)
-	{
-		lua_rawgeti (L, res_idx, i);
-
-		lua_getfield (L, -1, "submit_query");
-		lua_pushvalue (L, -2);
-		lua_pushvalue (L, data_idx);
-		lua_rawgeti (L, types_idx, i);
-		lua_call (L, 3, 0);
-
-		lua_pop (L, 1);
-	}
+	/* Pushes the entries table, the cache state is its owning userdata. */
+	lua_getfield (L, LUA_REGISTRYINDEX, DNS_CACHE_REGISTRY_KEY);
+	struct dns_answer_cache *cache = (struct dns_answer_cache *) lua_touserdata (L, -1);
+	lua_getuservalue (L, -1);
+	lua_remove (L, -2);
 
-	return 0;
+	return cache;
 }
 /* }}} */
 
-/* ---- Member Functions ---------------------------------------------------- */
-
-/* {{{ mydns_new() */
-static int mydns_new (lua_State *L)
+/* {{{ clear_answer_cache() */
+static void clear_answer_cache (lua_State *L)
 {
-	lua_settop (L, 3);
-	struct dns_resolv_conf *resconf = *(struct dns_resolv_conf **) arg_or_registry (L, 1, "ratchet_dns_resolv_conf_default", "ratchet_dns_resolv_conf_meta");
-	struct dns_hosts *hosts = *(struct dns_hosts **) arg_or_registry (L, 2, "ratchet_dns_hosts_default", "ratchet_dns_hosts_meta");
-	lua_Number expire_timeout = luaL_optnumber (L, 3, (lua_Number) 10.0);
-
-	struct dns_resolver **new = (struct dns_resolver **) lua_newuserdata (L, sizeof (struct dns_resolver *));
-	int error = 0;
-
-	*new = dns_res_open (resconf, hosts, dns_hints_mortal (dns_hints_local (resconf, &error)), NULL, dns_opts (), &error);
-	if (!*new)
-		return raise_dns_error (L, "ratchet.dns.new()", "dns_res_open", error);
-
-	luaL_getmetatable (L, "ratchet_dns_meta");
-	lua_setmetatable (L, -2);
-
-	lua_createtable (L, 0, 2);
-	lua_pushinteger (L, 0);
-	lua_setfield (L, -2, "tries");
-	lua_pushnumber (L, expire_timeout);
-	lua_setfield (L, -2, "expire_timeout");
+	lua_getfield (L, LUA_REGISTRYINDEX, DNS_CACHE_REGISTRY_KEY);
+	struct dns_answer_cache *cache = (struct dns_answer_cache *) lua_touserdata (L, -1);
+	lua_newtable (L);
 	lua_setuservalue (L, -2);
-
-	return 1;
+	lua_pop (L, 1);
+	cache->entries = 0;
 }
 /* }}} */
 
-/* {{{ mydns_mx_get_i() */
-static int mydns_mx_get_i (lua_State *L)
+/* {{{ push_cache_key_kind() */
+static void push_cache_key_kind (lua_State *L, const char *data, const char *kind)
 {
-	luaL_checktype (L, 1, LUA_TTABLE);
-	int n = luaL_checkint (L, 2);
+	luaL_Buffer b;
+	luaL_buffinit (L, &b);
+	for (; *data; data++)
+		luaL_addchar (&b, (char) tolower ((unsigned char) *data));
+	luaL_addchar (&b, '/');
+	luaL_addstring (&b, kind);
+	luaL_pushresult (&b);
+}
+/* }}} */
 
-	lua_getfield (L, 1, "n");
-	int max_n = lua_tonumber (L, -1);
-	lua_pop (L, 1);
-	if (n <= 0)
-		return 0;
-	if (n > max_n)
-		n = n % max_n;
+/* {{{ push_cache_key() */
+static void push_cache_key (lua_State *L, const char *data, enum dns_type type)
+{
+	push_cache_key_kind (L, data, query_name (type));
+}
+/* }}} */
 
-	int i, j, k=1;
-	lua_getfield (L, 1, "priorities");
-	for (i=1; ; i++)
+/* {{{ push_answer_copy() */
+static void push_answer_copy (lua_State *L, int index)
+{
+	/* Callers own their answers, so the cache never hands out or keeps a
+	 * table that someone else can modify. Record userdata are immutable
+	 * and stay shared. */
+	index = lua_absindex (L, index);
+	if (!lua_istable (L, index))
 	{
-		lua_rawgeti (L, -1, i);
-		if (lua_isnil (L, -1))
-			break;
-
-		int p = lua_tonumber (L, -1);
-		lua_pop (L, 1);
-		lua_rawgeti (L, 1, p);
-		for (j=1; ; j++)
-		{
-			lua_rawgeti (L, -1, j);
-			if (lua_isnil (L, -1))
-				break;
-			if (k++ == n)
-				return 1;
-			lua_pop (L, 1);
-		}
-		lua_pop (L, 2);
+		lua_pushvalue (L, index);
+		return;
 	}
-	lua_pop (L, 2);
 
-	return 0;
+	luaL_checkstack (L, 4, "answer too deeply nested");
+	lua_createtable (L, (int) lua_rawlen (L, index), 0);
+	lua_pushnil (L);
+	while (lua_next (L, index))
+	{
+		push_answer_copy (L, -1);
+		lua_remove (L, -2);
+		lua_pushvalue (L, -2);
+		lua_insert (L, -2);
+		lua_rawset (L, -4);
+	}
+	if (lua_getmetatable (L, index))
+		lua_setmetatable (L, -2);
 }
 /* }}} */
 
-/* {{{ mydns_close() */
-static int mydns_close (lua_State *L)
+/* {{{ cache_lookup_kind() */
+static int cache_lookup_kind (lua_State *L, const char *data, const char *kind, enum dns_reason *reason)
 {
-	struct dns_resolver **res = (struct dns_resolver **) luaL_checkudata (L, 1, "ratchet_dns_meta");
-	if (*res)
+	int base = lua_gettop (L);
+	struct dns_answer_cache *cache = push_answer_cache (L);
+	if (!cache->enabled)
 	{
-		dns_res_close (*res);
-		*res = NULL;
+		lua_pop (L, 1);
+		return 0;
 	}
 
-	return 0;
-}
-/* }}} */
+	push_cache_key_kind (L, data, kind);
+	lua_pushvalue (L, -1);
+	lua_rawget (L, -3);
+	if (lua_isnil (L, -1))
+	{
+		cache->misses++;
+		lua_pop (L, 3);
+		return 0;
+	}
 
-/* {{{ mydns_get_fd() */
-static int mydns_get_fd (lua_State *L)
-{
-	struct dns_resolver *res = get_dns_res (L, 1);
-	lua_pushinteger (L, dns_res_pollfd (res));
+	lua_getfield (L, -1, "expires");
+	double expires = (double) lua_tonumber (L, -1);
+	lua_pop (L, 1);
+	if (expires <= cache_now ())
+	{
+		cache->expired++;
+		cache->misses++;
+		cache->entries--;
+		lua_pop (L, 1);
+		lua_pushnil (L);
+		lua_rawset (L, -3);
+		lua_pop (L, 1);
+		return 0;
+	}
+
+	lua_getfield (L, -1, "answer");
+	push_answer_copy (L, -1);
+	lua_replace (L, -2);
+	lua_getfield (L, -2, "error");
+	if (lua_isnil (L, -2))
+		cache->negative_hits++;
+	else
+		cache->hits++;
+	if (reason)
+	{
+		lua_getfield (L, -3, "reason");
+		*reason = (enum dns_reason) lua_tointeger (L, -1);
+		lua_pop (L, 1);
+	}
+
+	lua_replace (L, base+2);
+	lua_replace (L, base+1);
+	lua_pop (L, 1);
 
 	return 1;
 }
 /* }}} */
 
-/* {{{ mydns_get_timeout() */
-static int mydns_get_timeout (lua_State *L)
+/* {{{ cache_lookup() */
+static int cache_lookup (lua_State *L, const char *data, enum dns_type type, enum dns_reason *reason)
 {
-	(void) get_dns_res (L, 1);
-
-	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "tries");
-	int tries = (int) lua_tointeger (L, -1);
-	lua_pop (L, 2);
-	lua_pushnumber (L, (lua_Number) (DNS_GET_POLL_TIMEOUT (tries)));
-
-	return 1;
+	return cache_lookup_kind (L, data, query_name (type), reason);
 }
 /* }}} */
 
-/* {{{ mydns_query_collect_results() */
-static int mydns_query_collect_results (lua_State *L)
+/* {{{ cache_expires() */
+static double cache_expires (lua_State *L, const char *data, enum dns_type type)
 {
-	lua_getfield (L, 1, "is_query_done");
-	lua_pushvalue (L, 1);
-	lua_call (L, 1, 1);
-	
-	if (lua_toboolean (L, -1))
+	/* Peeks at when a cached answer expires, without counting a hit. */
+	(void) push_answer_cache (L);
+	push_cache_key (L, data, type);
+	lua_rawget (L, -2);
+	double expires = 0.0;
+	if (lua_istable (L, -1))
 	{
+		lua_getfield (L, -1, "expires");
+		expires = (double) lua_tonumber (L, -1);
 		lua_pop (L, 1);
-
-		lua_getfield (L, 1, "parse_answer");
-		lua_pushvalue (L, 1);
-		lua_pushvalue (L, 2);
-		lua_pushvalue (L, 3);
-		lua_call (L, 3, 2);
-
-		lua_getfield (L, 1, "close");
-		lua_pushvalue (L, 1);
-		lua_call (L, 1, 0);
-
-		return 2;
 	}
-	else
-	{
-		lua_pop (L, 1);
+	lua_pop (L, 2);
 
-		lua_pushlightuserdata (L, RATCHET_YIELD_READ);
-		lua_pushvalue (L, 1);
-		return lua_yieldk (L, 2, 0, mydns_query_collect_results);
-	}
+	return expires;
 }
 /* }}} */
 
-/* {{{ mydns_query() */
-static int mydns_query (lua_State *L)
+/* {{{ cache_sweep() */
+static void cache_sweep (lua_State *L, struct dns_answer_cache *cache, int index)
 {
-	int nargs = lua_gettop (L);
-
-	/* Construct a new ratchet.dns object. */
-	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_dns_class");
-	lua_getfield (L, -1, "new");
-	lua_insert (L, 3);
-	lua_pop (L, 1);
-	lua_call (L, nargs - 2, 1);
-	lua_insert (L, 1);
-
-	/* Call dns:submit_query(data, type). */
-	lua_getfield (L, 1, "submit_query");
-	lua_pushvalue (L, 1);
-	lua_pushvalue (L, 2);
-	lua_pushvalue (L, 3);
-	lua_call (L, 3, 0);
+	double now = cache_now ();
 
-	return mydns_query_collect_results (L);
+	lua_pushnil (L);
+	while (lua_next (L, index))
+	{
+		lua_getfield (L, -1, "expires");
+		double expires = (double) lua_tonumber (L, -1);
+		lua_pop (L, 2);
+		if (expires <= now)
+		{
+			/* Clearing fields of existing keys is safe during traversal. */
+			lua_pushvalue (L, -1);
+			lua_pushnil (L);
+			lua_rawset (L, index);
+			cache->expired++;
+			cache->entries--;
+		}
+	}
 }
 /* }}} */
 
-/* {{{ mydns_query_all_collect_results() */
-static int mydns_query_all_collect_results (lua_State *L)
+/* {{{ cache_store_kind() */
+static void cache_store_kind (lua_State *L, const char *data, const char *kind, int answer, const char *error, enum dns_reason reason, double ttl)
 {
-	size_t num = lua_rawlen (L, 1);
-	size_t i;
+	answer = lua_absindex (L, answer);
+	struct dns_answer_cache *cache = push_answer_cache (L);
+	int entries = lua_gettop (L);
+
+	if (!error)
+	{
+		if (ttl > cache->max_ttl)
+			ttl = cache->max_ttl;
+		if (ttl < cache->min_ttl)
+			ttl = cache->min_ttl;
+	}
+	else if (ttl > cache->negative_ttl)
+		ttl = cache->negative_ttl;
 
-	int tries = 0, not_done = 0;
-	if (lua_getctx (L, &tries) == LUA_YIELD)
+	if (!cache->enabled || ttl <= 0.0)
+	{
 		lua_pop (L, 1);
+		return;
+	}
 
-	lua_pushlightuserdata (L, RATCHET_YIELD_MULTIRW);
-	lua_newtable (L);
+	push_cache_key_kind (L, data, kind);
+	lua_pushvalue (L, -1);
+	lua_rawget (L, entries);
+	int replacing = !lua_isnil (L, -1);
+	lua_pop (L, 1);
 
-	for (i=1; i<=num; i++)
+	if (!replacing && cache->entries >= cache->max_entries)
 	{
-		lua_rawgeti (L, 1, i);
-		if (!lua_toboolean (L, -1))
+		cache_sweep (L, cache, entries);
+		if (cache->entries >= cache->max_entries)
 		{
-			lua_pop (L, 1);
-			continue;
+			lua_pop (L, 2);
+			return;
 		}
+	}
 
-		lua_getfield (L, -1, "is_query_done");
-		lua_pushvalue (L, -2);
-		lua_call (L, 1, 2);
-		int is_query_done = lua_toboolean (L, -2);
-		int query_timeout = lua_toboolean (L, -1);
-		lua_pop (L, 2);
-
-		if (is_query_done)
+	lua_createtable (L, 0, 3);
+	if (error)
+	{
+		lua_pushstring (L, error);
+		lua_setfield (L, -2, "error");
+		if (reason)
 		{
-			lua_getfield (L, -1, "parse_answer");
-			lua_pushvalue (L, -2);
-			lua_pushvalue (L, 2);
-			lua_rawgeti (L, 3, i);
-			lua_pushboolean (L, query_timeout);
-			lua_call (L, 4, 2);
-
-			/* Set the error to answers[type.."_error"]. */
-			lua_rawgeti (L, 3, i);
-			lua_pushliteral (L, "_error");
-			lua_concat (L, 2);
-			lua_pushvalue (L, -2);
-			lua_rawset (L, 4);
-
-			/* Set the result to answers[type]. */
-			lua_rawgeti (L, 3, i);
-			lua_pushvalue (L, -3);
-			lua_rawset (L, 4);
-
-			lua_pop (L, 2);
-			
-			/* Close the dns query session. */
-			lua_getfield (L, -1, "close");
-			lua_pushvalue (L, -2);
-			lua_call (L, 1, 0);
-			lua_pop (L, 1);
-			
-			lua_pushboolean (L, 0);
-			lua_rawseti (L, 1, i);
+			lua_pushinteger (L, (lua_Integer) reason);
+			lua_setfield (L, -2, "reason");
 		}
-		else
-			lua_rawseti (L, -2, ++not_done);
 	}
-
-	lua_pushnil (L);
-	lua_pushnumber (L, (lua_Number) DNS_GET_MULTI_POLL_TIMEOUT);
-
-	if (not_done > 0)
-		return lua_yieldk (L, 4, tries+1, mydns_query_all_collect_results);
 	else
 	{
-		lua_pop (L, 4);
-		return 1;
+		push_answer_copy (L, answer);
+		lua_setfield (L, -2, "answer");
 	}
+	lua_pushnumber (L, (lua_Number) (cache_now () + ttl));
+	lua_setfield (L, -2, "expires");
+	lua_rawset (L, entries);
+
+	if (!replacing)
+		cache->entries++;
+	cache->inserts++;
+
+	lua_pop (L, 1);
 }
 /* }}} */
 
-/* {{{ mydns_query_all() */
-static int mydns_query_all (lua_State *L)
+/* {{{ cache_store() */
+static void cache_store (lua_State *L, const char *data, enum dns_type type, int answer, const char *error, enum dns_reason reason, double ttl)
 {
-	luaL_checkstring (L, 1);	/* Query data. */
-	luaL_checktype (L, 2, LUA_TTABLE);
-	lua_settop (L, 5);
-
-	size_t num_types = lua_rawlen (L, 2);
+	cache_store_kind (L, data, query_name (type), lua_absindex (L, answer), error, reason, ttl);
+}
+/* }}} */
 
-	push_dns_resolver_table (L, num_types, 3, 4, 5);
-	lua_insert (L, 1);
-	lua_settop (L, 3);
-	lua_createtable (L, 0, num_types);	/* Answer table. */
+/* {{{ answer_ttl() */
+static double answer_ttl (struct dns_packet *answer)
+{
+	double ttl = -1.0;
+	struct dns_rr rr;
 
-	submit_dns_queries (L, num_types, 1, 2, 3);
+	dns_rr_foreach (&rr, answer, .section = DNS_S_ANSWER)
+	{
+		if (ttl < 0.0 || (double) rr.ttl < ttl)
+			ttl = (double) rr.ttl;
+	}
 
-	return mydns_query_all_collect_results (L);
+	return (ttl < 0.0 ? 0.0 : ttl);
 }
 /* }}} */
 
-/* {{{ mydns_submit_query() */
-static int mydns_submit_query (lua_State *L)
+/* {{{ negative_ttl() */
+static double negative_ttl (struct dns_packet *answer, double def)
 {
-	struct dns_resolver *res = get_dns_res (L, 1);
-	const char *data = luaL_checkstring (L, 2);
-	enum dns_type type = get_query_type (L, 3);
+	struct dns_rr rr;
 
-	if (type == DNS_T_PTR)
-		data = ensure_arpa_string (L, 2);
+	/* RFC 2308: the SOA record's TTL, capped by its minimum field. */
+	dns_rr_foreach (&rr, answer, .section = DNS_S_AUTHORITY, .type = DNS_T_SOA)
+	{
+		struct dns_soa soa;
+		memset (&soa, 0, sizeof (soa));
+		if (0 == dns_soa_parse (&soa, &rr, answer))
+			return (double) (rr.ttl < soa.minimum ? rr.ttl : soa.minimum);
+	}
 
-	int error = dns_res_submit (res, data, type, DNS_C_IN);
-	if (error)
-		return raise_dns_error (L, data, "dns_res_submit", error);
+	return def;
+}
+/* }}} */
 
-	return 0;
+/* {{{ push_no_record_error() */
+static void push_no_record_error (lua_State *L, const char *data, enum dns_type type)
+{
+	lua_pushnil (L);
+	lua_pushstring (L, data);
+	lua_pushliteral (L, " has no ");
+	lua_pushstring (L, query_name (type));
+	lua_pushliteral (L, " record");
+	lua_concat (L, 4);
 }
 /* }}} */
 
-/* {{{ mydns_is_query_done() */
-static int mydns_is_query_done (lua_State *L)
+/* {{{ answer_failed() */
+static int answer_failed (struct dns_packet *answer)
 {
-	struct dns_resolver *res = get_dns_res (L, 1);
+	/* Anything but a name error or an empty answer says nothing about the
+	 * records, e.g. SERVFAIL or REFUSED, and is worth asking again. */
+	return (answer && DNS_RC_NOERROR != dns_header (answer)->rcode && DNS_RC_NXDOMAIN != dns_header (answer)->rcode);
+}
+/* }}} */
 
-	int error = dns_res_check (res);
-	if (error != EAGAIN)
-		lua_pushboolean (L, 1);
-	else
+/* {{{ push_lookup_error() */
+static enum dns_reason push_lookup_error (lua_State *L, const char *data, enum dns_type type, struct dns_packet *answer)
+{
+	if (answer_failed (answer))
 	{
-		lua_getuservalue (L, 1);
-		lua_getfield (L, -1, "tries");
-		int tries = (int) lua_tointeger (L, -1);
-		lua_getfield (L, -2, "expire_timeout");
-		double et = (double) lua_tonumber (L, -1);
-		lua_pop (L, 2);
-
+		lua_pushnil (L);
+		lua_pushliteral (L, DNS_SERVER_FAILED);
+		return DNS_REASON_SERVFAIL;
+	}
+	else if (answer && DNS_RC_NXDOMAIN == dns_header (answer)->rcode)
+	{
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s does not exist", data);
+		return DNS_REASON_NXDOMAIN;
+	}
+
+	push_no_record_error (L, data, type);
+	return DNS_REASON_NODATA;
+}
+/* }}} */
+
+/* {{{ get_reason() */
+static enum dns_reason get_reason (lua_State *L, int index)
+{
+	/* Maps a reason string from query_many() back to its value. */
+	const char *name = lua_tostring (L, index);
+	int i;
+
+	for (i=DNS_REASON_NODATA; name && i<=DNS_REASON_TIMEOUT; i++)
+		if (0 == strcmp (name, dns_reason_names[i]))
+			return (enum dns_reason) i;
+
+	return DNS_REASON_NONE;
+}
+/* }}} */
+
+/* {{{ push_answer_results() */
+static int push_answer_results (lua_State *L, const char *data, enum dns_type type, struct dns_packet *answer, int cacheable, enum dns_reason *reason)
+{
+	/* Record parsers report errors against the query data at index 2. */
+	lua_newtable (L);
+
+	int found = 0;
+	struct dns_rr rr;
+	if (answer)
+	{
+		dns_rr_foreach (&rr, answer, .sort = &dns_rr_i_packet)
+		{
+			if (DNS_S_ANSWER == rr.section && type == rr.type)
+				parse_rr (L, &rr, answer, ++found);
+		}
+	}
+
+	if (!found)
+	{
+		/* Check for specials. */
+		if (check_special (L, data, type))
+			lua_rawseti (L, -2, 1);
+		else
+		{
+			/* Query failed. */
+			enum dns_reason failed = push_lookup_error (L, data, type, answer);
+			if (reason)
+				*reason = failed;
+
+			if (cacheable && answer && !answer_failed (answer))
+			{
+				struct dns_answer_cache *cache = push_answer_cache (L);
+				double ttl = negative_ttl (answer, cache->negative_ttl);
+				lua_pop (L, 1);
+				cache_store (L, data, type, -2, lua_tostring (L, -1), failed, ttl);
+			}
+			return 2;
+		}
+	}
+	else if (cacheable)
+		cache_store (L, data, type, -1, NULL, DNS_REASON_NONE, answer_ttl (answer));
+
+	return 1;
+}
+/* }}} */
+
+/* ---- Config Reload Functions --------------------------------------------- */
+
+/* {{{ struct dns_config_stamp */
+struct dns_config_stamp
+{
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+/* }}} */
+
+/* {{{ struct dns_config_watch */
+struct dns_config_watch
+{
+	double checked;
+	struct dns_config_stamp resolv_conf;
+	struct dns_config_stamp hosts;
+	unsigned long reloads;
+	unsigned long failures;
+};
+/* }}} */
+
+/* {{{ stamp_config_file() */
+static int stamp_config_file (const char *path, struct dns_config_stamp *stamp)
+{
+	/* Returns true if the file was replaced or modified since the last stamp. */
+	struct stat st;
+	if (stat (path, &st) < 0)
+		return 0;	/* Keep the current config while the file is missing. */
+
+	int changed = (st.st_dev != stamp->dev || st.st_ino != stamp->ino || st.st_size != stamp->size
+			|| st.st_mtim.tv_sec != stamp->mtime.tv_sec || st.st_mtim.tv_nsec != stamp->mtime.tv_nsec);
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtim;
+
+	return changed;
+}
+/* }}} */
+
+/* {{{ reload_default_config() */
+static int reload_default_config (lua_State *L, const char *module, const char *reg_default)
+{
+	/* Swaps in a freshly parsed default object. Lookups and resolvers still
+	 * holding the old one keep using it until they are done. */
+	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_dns_class");
+	lua_getfield (L, -1, module);
+	lua_getfield (L, -1, "new");
+	if (LUA_OK != lua_pcall (L, 0, 1, 0))
+	{
+		lua_pop (L, 3);
+		return 0;
+	}
+	lua_setfield (L, LUA_REGISTRYINDEX, reg_default);
+	lua_pop (L, 2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ refresh_default_config() */
+static void refresh_default_config (lua_State *L)
+{
+	lua_getfield (L, LUA_REGISTRYINDEX, DNS_CONFIG_REGISTRY_KEY);
+	struct dns_config_watch *watch = (struct dns_config_watch *) lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	if (!watch)
+		return;
+
+	/* A stat() of each file at most once per interval, on the lookup path. */
+	double now = cache_now ();
+	if (now - watch->checked < DNS_CONFIG_CHECK_INTERVAL)
+		return;
+	watch->checked = now;
+
+	int changed = 0, reloaded = 0;
+	if (stamp_config_file (DNS_RESOLV_CONF_PATH, &watch->resolv_conf))
+	{
+		changed++;
+		reloaded += reload_default_config (L, "resolv_conf", "ratchet_dns_resolv_conf_default");
+	}
+	if (stamp_config_file (DNS_HOSTS_PATH, &watch->hosts))
+	{
+		changed++;
+		reloaded += reload_default_config (L, "hosts", "ratchet_dns_hosts_default");
+	}
+
+	watch->failures += (unsigned long) (changed - reloaded);
+	if (reloaded > 0)
+	{
+		/* Cached answers came from the old config. */
+		watch->reloads++;
+		clear_answer_cache (L);
+	}
+}
+/* }}} */
+
+/* ---- Resolver Engine Functions ------------------------------------------- */
+
+/* {{{ struct dns_engine */
+struct dns_engine
+{
+	int fd;
+	int family;
+	unsigned short port;
+	unsigned long port_queries;
+	int pumping;
+	double wake_at;
+	double next_timeout;
+	size_t in_flight;
+	unsigned long lookups;
+	unsigned long sent;
+	unsigned long retransmits;
+	unsigned long responses;
+	unsigned long mismatched;
+	unsigned long truncated;
+	unsigned long server_failures;
+	unsigned long timeouts;
+	unsigned long hosts_answers;
+	unsigned long coalesced;
+	unsigned long port_changes;
+	unsigned long handoffs;
+	unsigned long abandoned;
+};
+/* }}} */
+
+/* {{{ struct dns_lookup */
+struct dns_lookup
+{
+	lua_State *owner;
+	struct dns_resolv_conf *resconf;
+	struct dns_hosts *hosts;
+	enum dns_type type;
+	size_t source;
+	dns_resconf_i_t search;
+	struct dns_packet *query;
+	struct dns_packet *answer;
+	struct sockaddr_storage to;
+	unsigned short port;
+	unsigned short qid;
+	int pending;
+	int delivered;
+	int finished;
+	int shared;
+	int truncated;
+	int timed_out;
+	int first_server;
+	int failed_servers;
+	int sent;
+	int max_sends;
+	double deadline;
+	double expire;
+};
+/* }}} */
+
+/* {{{ struct dns_waiter */
+struct dns_waiter
+{
+	int outstanding;
+	int paused;
+	int eager;
+	size_t active;
+	size_t next;
+	size_t concurrency;
+};
+/* }}} */
+
+/* {{{ struct dns_compact */
+struct dns_compact_addr
+{
+	int family;
+	unsigned int ttl;
+	unsigned int preference;
+	union
+	{
+		struct in_addr a;
+		struct in6_addr a6;
+	} addr;
+};
+
+struct dns_compact
+{
+	size_t n;
+	struct dns_compact_addr addrs[];
+};
+/* }}} */
+
+static int mydns_engine_pump (lua_State *L);
+static int mydns_engine_lookup (lua_State *L);
+
+/* {{{ engine_bind() */
+static int engine_bind (struct dns_engine *engine)
+{
+	/* Answers are only accepted on the port a query went out from, so the
+	 * port is picked at random rather than left to the kernel. */
+	struct sockaddr_storage local;
+	socklen_t locallen = (engine->family == AF_INET6 ? sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in));
+	int i;
+
+	for (i=0; i<=DNS_ENGINE_BIND_TRIES; i++)
+	{
+		unsigned short port = (i < DNS_ENGINE_BIND_TRIES ? (unsigned short) (1025 + (dns_random () % 64510)) : 0);
+		memset (&local, 0, sizeof (local));
+		if (engine->family == AF_INET6)
+		{
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &local;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr = in6addr_any;
+			sin6->sin6_port = htons (port);
+		}
+		else
+		{
+			struct sockaddr_in *sin = (struct sockaddr_in *) &local;
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = htonl (INADDR_ANY);
+			sin->sin_port = htons (port);
+		}
+
+		if (0 == bind (engine->fd, (struct sockaddr *) &local, locallen))
+			break;
+		else if (errno != EADDRINUSE && errno != EACCES)
+			return -1;
+	}
+
+	locallen = sizeof (local);
+	if (getsockname (engine->fd, (struct sockaddr *) &local, &locallen) < 0)
+		return -1;
+	if (local.ss_family == AF_INET6)
+		engine->port = ntohs (((struct sockaddr_in6 *) &local)->sin6_port);
+	else
+		engine->port = ntohs (((struct sockaddr_in *) &local)->sin_port);
+	engine->port_queries = 0;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ engine_open() */
+static const char *engine_open (struct dns_engine *engine)
+{
+	/* Opens the engine socket, returning the name of any call that failed. */
+	int extra_flags = 0;
+#ifdef SOCK_NONBLOCK
+	extra_flags |= SOCK_NONBLOCK;
+#endif
+#ifdef SOCK_CLOEXEC
+	extra_flags |= SOCK_CLOEXEC;
+#endif
+
+	/* Prefer a dual-stack socket, so it can reach nameservers of either family. */
+	int off = 0;
+	engine->family = AF_INET6;
+	engine->fd = socket (AF_INET6, SOCK_DGRAM | extra_flags, 0);
+	if (engine->fd >= 0 && setsockopt (engine->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off)) < 0)
+	{
+		close (engine->fd);
+		engine->fd = -1;
+	}
+	if (engine->fd < 0)
+	{
+		engine->family = AF_INET;
+		engine->fd = socket (AF_INET, SOCK_DGRAM | extra_flags, 0);
+	}
+	if (engine->fd < 0)
+		return "socket";
+
+#ifndef SOCK_NONBLOCK
+	if (set_nonblocking (engine->fd) < 0)
+		return "fcntl";
+#endif
+#ifndef SOCK_CLOEXEC
+	if (set_closeonexec (engine->fd) < 0)
+		return "fcntl";
+#endif
+
+	if (engine_bind (engine) < 0)
+		return "bind";
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ push_dns_engine() */
+static struct dns_engine *push_dns_engine (lua_State *L, int ratchet)
+{
+	/* One engine, and one socket, is shared by every query on an event loop. */
+	lua_getfield (L, LUA_REGISTRYINDEX, DNS_ENGINE_REGISTRY_KEY);
+	lua_pushvalue (L, ratchet);
+	lua_rawget (L, -2);
+	if (!lua_isnil (L, -1))
+	{
+		lua_remove (L, -2);
+		return (struct dns_engine *) lua_touserdata (L, -1);
+	}
+	lua_pop (L, 1);
+
+	struct dns_engine *engine = (struct dns_engine *) lua_newuserdata (L, sizeof (struct dns_engine));
+	memset (engine, 0, sizeof (struct dns_engine));
+	engine->fd = -1;
+	luaL_getmetatable (L, "ratchet_dns_engine_meta");
+	lua_setmetatable (L, -2);
+
+	/* Queries in flight keyed on query ID, and lookups open to joiners. */
+	lua_createtable (L, 0, 2);
+	lua_newtable (L);
+	lua_setfield (L, -2, "pending");
+	lua_newtable (L);
+	lua_setfield (L, -2, "flights");
+	lua_setuservalue (L, -2);
+
+	const char *failed = engine_open (engine);
+	if (failed)
+	{
+		ratchet_error_errno (L, "ratchet.dns.query()", failed);
+		return NULL;
+	}
+
+	lua_pushvalue (L, ratchet);
+	lua_pushvalue (L, -2);
+	lua_rawset (L, -4);
+	lua_remove (L, -2);
+
+	return engine;
+}
+/* }}} */
+
+/* {{{ engine_nameserver() */
+static int engine_nameserver (struct dns_engine *engine, struct dns_resolv_conf *resconf, int n, struct sockaddr_storage *to)
+{
+	/* Finds the n-th nameserver the engine socket can reach, as the socket addresses it. */
+	size_t i;
+	for (i=0; i<sizeof (resconf->nameserver) / sizeof (resconf->nameserver[0]); i++)
+	{
+		struct sockaddr_storage *ns = &resconf->nameserver[i];
+		if (ns->ss_family == AF_INET6 && engine->family != AF_INET6)
+			continue;
+		else if (ns->ss_family != AF_INET && ns->ss_family != AF_INET6)
+			continue;
+		if (n-- > 0)
+			continue;
+
+		memset (to, 0, sizeof (struct sockaddr_storage));
+		if (ns->ss_family == AF_INET && engine->family == AF_INET6)
+		{
+			/* IPv4-mapped address for the dual-stack socket. */
+			struct sockaddr_in *sin = (struct sockaddr_in *) ns;
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) to;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = sin->sin_port;
+			sin6->sin6_addr.s6_addr[10] = 0xff;
+			sin6->sin6_addr.s6_addr[11] = 0xff;
+			memcpy (&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+		}
+		else
+			memcpy (to, ns, sizeof (struct sockaddr_storage));
+
+		return 1;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ engine_count_nameservers() */
+static int engine_count_nameservers (struct dns_engine *engine, struct dns_resolv_conf *resconf)
+{
+	struct sockaddr_storage to;
+	int n = 0;
+	while (engine_nameserver (engine, resconf, n, &to))
+		n++;
+	return n;
+}
+/* }}} */
+
+/* {{{ sockaddr_matches() */
+static int sockaddr_matches (struct sockaddr_storage *a, struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+
+	if (a->ss_family == AF_INET)
+	{
+		struct sockaddr_in *a4 = (struct sockaddr_in *) a, *b4 = (struct sockaddr_in *) b;
+		return (a4->sin_port == b4->sin_port && 0 == memcmp (&a4->sin_addr, &b4->sin_addr, sizeof (struct in_addr)));
+	}
+	else if (a->ss_family == AF_INET6)
+	{
+		struct sockaddr_in6 *a6 = (struct sockaddr_in6 *) a, *b6 = (struct sockaddr_in6 *) b;
+		return (a6->sin6_port == b6->sin6_port && 0 == memcmp (&a6->sin6_addr, &b6->sin6_addr, sizeof (struct in6_addr)));
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ engine_send() */
+static void engine_send (struct dns_engine *engine, struct dns_lookup *lookup)
+{
+	int count = engine_count_nameservers (engine, lookup->resconf);
+	int timeout = (lookup->resconf->options.timeout > 0 ? (int) lookup->resconf->options.timeout : 1);
+
+	/* Each retransmit moves on to the next nameserver. */
+	if (count > 0 && engine_nameserver (engine, lookup->resconf, (lookup->first_server + lookup->sent) % count, &lookup->to))
+	{
+		socklen_t tolen = (lookup->to.ss_family == AF_INET6 ? sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in));
+		if (sendto (engine->fd, lookup->query->data, lookup->query->end, 0, (struct sockaddr *) &lookup->to, tolen) >= 0)
+			engine->sent++;
+	}
+
+	if (lookup->sent++ > 0)
+		engine->retransmits++;
+	lookup->deadline = cache_now () + (double) timeout;
+}
+/* }}} */
+
+/* {{{ engine_kick() */
+static void engine_kick (struct dns_engine *engine)
+{
+	/* The pump is armed for a later deadline, an empty datagram to the
+	 * engine socket wakes it up to re-arm without another descriptor. */
+	struct sockaddr_storage self;
+	socklen_t selflen = sizeof (self);
+	memset (&self, 0, sizeof (self));
+	if (getsockname (engine->fd, (struct sockaddr *) &self, &selflen) < 0)
+		return;
+
+	if (self.ss_family == AF_INET6)
+		memcpy (&((struct sockaddr_in6 *) &self)->sin6_addr, &in6addr_loopback, sizeof (struct in6_addr));
+	else if (self.ss_family == AF_INET)
+		((struct sockaddr_in *) &self)->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	else
+		return;
+
+	(void) sendto (engine->fd, "", 0, 0, (struct sockaddr *) &self, selflen);
+}
+/* }}} */
+
+/* {{{ make_query_packet() */
+static struct dns_packet *make_query_packet (const char *qname, size_t qlen, enum dns_type type, int *error)
+{
+	struct dns_packet *Q = dns_p_make (DNS_P_QBUFSIZ, error);
+	if (!Q)
+		return NULL;
+
+	dns_header (Q)->rd = 1;
+	if ((*error = dns_p_push (Q, DNS_S_QD, qname, qlen, type, DNS_C_IN, 0, NULL)))
+	{
+		free (Q);
+		return NULL;
+	}
+
+	return Q;
+}
+/* }}} */
+
+/* {{{ push_hosts_index() */
+static void push_hosts_index (lua_State *L, int lookup_idx)
+{
+	/* Pushes the index of records in the lookup's hosts object, or nil. */
+	lua_getuservalue (L, lookup_idx);
+	lua_getfield (L, -1, "hosts");
+	lua_getuservalue (L, -1);
+	if (lua_istable (L, -1))
+		lua_getfield (L, -1, "index");
+	else
+		lua_pushnil (L);
+	lua_replace (L, -4);
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ lookup_hosts() */
+static int lookup_hosts (lua_State *L, struct dns_lookup *lookup, const char *qname, size_t qlen)
+{
+	/* Expects the hosts index on top, and answers from the records it holds. */
+	char key[DNS_D_MAXNAME + 1];
+	size_t i, num;
+	int error = 0;
+	if (!lua_istable (L, -1))
+		return 0;
+
+	for (i=0; i<qlen; i++)
+		key[i] = (char) tolower ((unsigned char) qname[i]);
+	lua_pushlstring (L, key, qlen);
+	lua_rawget (L, -2);
+	if (lua_istable (L, -1))
+		lua_rawgeti (L, -1, (int) lookup->type);
+	else
+		lua_pushnil (L);
+	num = (lua_istable (L, -1) ? lua_rawlen (L, -1) : 0);
+	if (num == 0)
+	{
+		lua_pop (L, 2);
+		return 0;
+	}
+
+	/* Room for the question and every record, without compression. */
+	struct dns_packet *A = dns_p_make (12 + (num + 1) * (qlen + 1 + 10 + sizeof (struct dns_ptr)), &error);
+	if (A && (error = dns_p_push (A, DNS_S_QD, qname, qlen, lookup->type, DNS_C_IN, 0, NULL)))
+	{
+		free (A);
+		A = NULL;
+	}
+
+	for (i=1; A && i<=num; i++)
+	{
+		union
+		{
+			struct dns_a a;
+			struct dns_aaaa aaaa;
+			struct dns_ptr ptr;
+		} rec;
+		size_t len;
+		lua_rawgeti (L, -1, (int) i);
+		const char *data = lua_tolstring (L, -1, &len);
+		memset (&rec, 0, sizeof (rec));
+		if (lookup->type == DNS_T_PTR)
+			memcpy (rec.ptr.host, data, (len < sizeof (rec.ptr.host) ? len : sizeof (rec.ptr.host) - 1));
+		else if (lookup->type == DNS_T_AAAA)
+			memcpy (&rec.aaaa.addr, data, sizeof (rec.aaaa.addr));
+		else
+			memcpy (&rec.a.addr, data, sizeof (rec.a.addr));
+		lua_pop (L, 1);
+
+		if ((error = dns_p_push (A, DNS_S_AN, qname, qlen, lookup->type, DNS_C_IN, 0, &rec)))
+		{
+			free (A);
+			A = NULL;
+		}
+	}
+	lua_pop (L, 2);
+	if (!A)
+		return 0;
+
+	free (lookup->answer);
+	lookup->answer = A;
+	return 1;
+}
+/* }}} */
+
+/* {{{ lookup_submit() */
+static int lookup_submit (lua_State *L, struct dns_engine *engine, int engine_idx, int lookup_idx, const char *qname, size_t qlen)
+{
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+	int count = engine_count_nameservers (engine, lookup->resconf);
+	int error = 0;
+
+	if (count <= 0)
+		return 0;
+
+	/* Move to a new random port now and then, while nothing is in flight
+	 * and the pump is not waiting on the socket. */
+	if (!engine->pumping && engine->in_flight == 0 && engine->port_queries >= DNS_ENGINE_PORT_QUERIES)
+	{
+		close (engine->fd);
+		engine->fd = -1;
+		if (engine_open (engine))
+			return 0;
+		engine->port_changes++;
+	}
+
+	struct dns_packet *Q = make_query_packet (qname, qlen, lookup->type, &error);
+	if (!Q)
+		return 0;
+	free (lookup->query);
+	lookup->query = Q;
+
+	/* Pick a query ID not already in flight on the engine socket. */
+	lua_getuservalue (L, engine_idx);
+	lua_getfield (L, -1, "pending");
+	lua_remove (L, -2);
+	unsigned short qid;
+	do
+	{
+		qid = (unsigned short) (dns_random () & 0xffff);
+		lua_rawgeti (L, -1, (int) qid);
+		error = !lua_isnil (L, -1);
+		lua_pop (L, 1);
+	} while (error);
+
+	dns_header (Q)->qid = qid;
+	lookup->qid = qid;
+	lua_pushvalue (L, lookup_idx);
+	lua_rawseti (L, -2, (int) qid);
+	lua_pop (L, 1);
+
+	int attempts = (lookup->resconf->options.attempts > 0 ? (int) lookup->resconf->options.attempts : 1);
+	lookup->first_server = (lookup->resconf->options.rotate ? (int) (dns_random () % (unsigned) count) : 0);
+	lookup->max_sends = attempts * count;
+	lookup->sent = 0;
+	lookup->failed_servers = 0;
+	lookup->pending = 1;
+	lookup->port = engine->port;
+	engine->in_flight++;
+	engine->port_queries++;
+
+	engine_send (engine, lookup);
+
+	double due = (lookup->deadline < lookup->expire ? lookup->deadline : lookup->expire);
+	if (engine->pumping && due < engine->wake_at)
+		engine_kick (engine);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ lookup_advance() */
+static int lookup_advance (lua_State *L, struct dns_engine *engine, int engine_idx, int lookup_idx, const char *name)
+{
+	/* Walks the resolv.conf lookup order until an answer is found, or a query is in flight. */
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+	char qname[DNS_D_MAXNAME + 1];
+	size_t qlen, name_len = strlen (name);
+
+	while (lookup->source < sizeof (lookup->resconf->lookup))
+	{
+		char which = lookup->resconf->lookup[lookup->source];
+
+		if (which == 'f' || which == 'F')
+		{
+			dns_resconf_i_t search = 0;
+			lookup->source++;
+			push_hosts_index (L, lookup_idx);
+			while ((qlen = dns_resconf_search (qname, sizeof (qname), name, name_len, lookup->resconf, &search)))
+			{
+				if (qlen < sizeof (qname) && lookup_hosts (L, lookup, qname, qlen))
+				{
+					lua_pop (L, 1);
+					engine->hosts_answers++;
+					return 0;
+				}
+			}
+			lua_pop (L, 1);
+		}
+		else if (which == 'b' || which == 'B')
+		{
+			qlen = dns_resconf_search (qname, sizeof (qname), name, name_len, lookup->resconf, &lookup->search);
+			if (qlen > 0 && qlen < sizeof (qname) && lookup_submit (L, engine, engine_idx, lookup_idx, qname, qlen))
+				return 1;
+			lookup->source++;
+			lookup->search = 0;
+		}
+		else
+			lookup->source++;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ lookup_delivered() */
+static void lookup_delivered (struct dns_lookup *lookup)
+{
+	/* Decides where a lookup goes after the engine is done with its query. */
+	lookup->delivered = 0;
+	if (lookup->truncated)
+		return;
+
+	if (lookup->timed_out)
+	{
+		/* An answer for an earlier search domain must not hide the timeout. */
+		free (lookup->answer);
+		lookup->answer = NULL;
+	}
+
+	if (!lookup->timed_out && lookup->answer && DNS_RC_NXDOMAIN == dns_header (lookup->answer)->rcode)
+		return;		/* Try the next search domain. */
+	else if (!lookup->timed_out && lookup->answer && dns_p_count (lookup->answer, DNS_S_AN) > 0)
+		lookup->source = sizeof (lookup->resconf->lookup);
+	else
+	{
+		lookup->source++;
+		lookup->search = 0;
+	}
+}
+/* }}} */
+
+/* {{{ lookup_matches() */
+static int lookup_matches (struct dns_engine *engine, struct dns_lookup *lookup, struct dns_packet *P, struct sockaddr_storage *from)
+{
+	if (!lookup->pending || !dns_header (P)->qr || lookup->port != engine->port || !sockaddr_matches (&lookup->to, from))
+		return 0;
+
+	/* The question must be echoed back exactly, modulo case. */
+	struct dns_packet *Q = lookup->query;
+	size_t i;
+	if (dns_p_count (P, DNS_S_QD) != 1 || P->end < Q->end)
+		return 0;
+	for (i=12; i<Q->end; i++)
+		if (tolower (Q->data[i]) != tolower (P->data[i]))
+			return 0;
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ waiter_gone() */
+static int waiter_gone (lua_State *L, int index)
+{
+	/* Checks if the thread in the table at index was killed. */
+	lua_getfield (L, index, "thread");
+	int gone = (!lua_isthread (L, -1) || ratchet_thread_ended (L, -1));
+	lua_pop (L, 1);
+
+	return gone;
+}
+/* }}} */
+
+/* {{{ lookup_owner_gone() */
+static int lookup_owner_gone (lua_State *L, int lookup_idx)
+{
+	lua_getuservalue (L, lookup_idx);
+	int gone = waiter_gone (L, lua_gettop (L));
+	lua_pop (L, 1);
+
+	return gone;
+}
+/* }}} */
+
+/* {{{ wake_waiter() */
+static int wake_waiter (lua_State *L, int index)
+{
+	/* Wakes the thread in the table at index once all of its lookups are
+	 * done, or as each one is done if it has more lookups to start. Returns
+	 * zero if the thread was killed and will never see the result. */
+	if (waiter_gone (L, index))
+		return 0;
+
+	lua_getfield (L, index, "waiter");
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	if (!waiter)
+		return 1;
+	waiter->outstanding--;
+	if (!waiter->paused || (!waiter->eager && waiter->outstanding > 0))
+		return 1;
+	waiter->paused = 0;
+
+	lua_getfield (L, index, "thread");
+	lua_State *L1 = lua_tothread (L, -1);
+	if (LUA_YIELD == lua_status (L1))
+	{
+		lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_thread_class");
+		lua_getfield (L, -1, "unpause");
+		lua_pushvalue (L, -3);
+		lua_call (L, 1, 0);
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ lookup_abandon() */
+static void lookup_abandon (lua_State *L, struct dns_engine *engine, int engine_idx, int lookup_idx)
+{
+	/* The owner of the lookup was killed, so nobody will move it along.
+	 * Threads that joined it get an error instead of waiting forever. */
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+	size_t i, num;
+	lookup->finished = 1;
+	engine->abandoned++;
+
+	lua_getuservalue (L, lookup_idx);
+	lua_pushnil (L);
+	lua_setfield (L, -2, "result");
+	lua_pushliteral (L, DNS_ABANDONED);
+	lua_setfield (L, -2, "error");
+
+	/* Stop taking new joiners. */
+	lua_getuservalue (L, engine_idx);
+	lua_getfield (L, -1, "flights");
+	lua_getfield (L, -3, "flight");
+	lua_pushvalue (L, -1);
+	lua_rawget (L, -3);
+	if (lua_touserdata (L, -1) == lookup)
+	{
+		lua_pop (L, 1);
+		lua_pushnil (L);
+		lua_rawset (L, -3);
+	}
+	else
+		lua_pop (L, 2);
+	lua_pop (L, 2);
+
+	lua_getfield (L, -1, "joiners");
+	num = lua_rawlen (L, -1);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, -1, (int) i);
+		(void) wake_waiter (L, lua_gettop (L));
+		lua_pop (L, 1);
+	}
+
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ lookup_handoff() */
+static int lookup_handoff (lua_State *L, int lookup_idx)
+{
+	/* The owner of the lookup was killed, so the first joined thread still
+	 * alive takes it over. Returns zero if there is none. */
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+	size_t i, j, num;
+
+	lua_getuservalue (L, lookup_idx);
+	lua_getfield (L, -1, "joiners");
+	num = lua_rawlen (L, -1);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, -1, (int) i);
+		if (lua_istable (L, -1) && !waiter_gone (L, lua_gettop (L)))
+			break;
+		lua_pop (L, 1);
+	}
+	if (i > num)
+	{
+		lua_pop (L, 2);
+		return 0;
+	}
+
+	/* Its outstanding count for the lookup now waits on it as the owner. */
+	for (j=i; j<num; j++)
+	{
+		lua_rawgeti (L, -2, (int) j+1);
+		lua_rawseti (L, -3, (int) j);
+	}
+	lua_pushnil (L);
+	lua_rawseti (L, -3, (int) num);
+
+	lua_getfield (L, -1, "thread");
+	lookup->owner = lua_tothread (L, -1);
+	lua_setfield (L, -4, "thread");
+	lua_getfield (L, -1, "waiter");
+	lua_setfield (L, -4, "waiter");
+	lua_getfield (L, -1, "expire");
+	lookup->expire = (double) lua_tonumber (L, -1);
+	lua_pop (L, 4);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ lookup_unwanted() */
+static int lookup_unwanted (lua_State *L, int lookup_idx)
+{
+	/* A lookup is still wanted while its owner or any joiner is alive. */
+	lua_getuservalue (L, lookup_idx);
+	int unwanted = waiter_gone (L, lua_gettop (L));
+	if (unwanted)
+	{
+		size_t i, num;
+		lua_getfield (L, -1, "joiners");
+		num = lua_rawlen (L, -1);
+		for (i=1; i<=num && unwanted; i++)
+		{
+			lua_rawgeti (L, -1, (int) i);
+			unwanted = waiter_gone (L, lua_gettop (L));
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+
+	return unwanted;
+}
+/* }}} */
+
+/* {{{ engine_deliver() */
+static void engine_deliver (lua_State *L, struct dns_engine *engine, int engine_idx, int pending, int lookup_idx)
+{
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+
+	lua_pushnil (L);
+	lua_rawseti (L, pending, (int) lookup->qid);
+	lookup->pending = 0;
+	lookup->delivered = 1;
+	engine->in_flight--;
+
+	lua_getuservalue (L, lookup_idx);
+	while (!wake_waiter (L, lua_gettop (L)))
+	{
+		if (!lookup_handoff (L, lookup_idx))
+		{
+			lookup_abandon (L, engine, engine_idx, lookup_idx);
+			break;
+		}
+		engine->handoffs++;
+	}
+	lua_pop (L, 1);
+}
+/* }}} */
+
+/* {{{ engine_receive() */
+static void engine_receive (lua_State *L, struct dns_engine *engine, int engine_idx, int pending)
+{
+	unsigned char buf[DNS_ENGINE_RECV_SIZE];
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	ssize_t n;
+	int error = 0;
+
+	while (1)
+	{
+		fromlen = sizeof (from);
+		memset (&from, 0, sizeof (from));
+		n = recvfrom (engine->fd, buf, sizeof (buf), 0, (struct sockaddr *) &from, &fromlen);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			break;
+		else if (n == 0)
+			continue;	/* Woken by engine_kick(). */
+
+		engine->responses++;
+		if (n < 12)
+		{
+			engine->mismatched++;
+			continue;
+		}
+
+		struct dns_packet *P = dns_p_make ((size_t) n, &error);
+		if (!P)
+			break;
+		memcpy (P->data, buf, (size_t) n);
+		P->end = (size_t) n;
+
+		lua_rawgeti (L, pending, (int) dns_header (P)->qid);
+		struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, -1);
+		if (!lookup || !lookup_matches (engine, lookup, P, &from))
+		{
+			engine->mismatched++;
+			free (P);
+			lua_pop (L, 1);
+			continue;
+		}
+
+		/* Truncated answers are retried over TCP by the waiting thread. */
+		if (dns_header (P)->tc || (size_t) n >= sizeof (buf) || dns_p_study (P))
+		{
+			lookup->truncated = 1;
+			engine->truncated++;
+			free (P);
+		}
+		else
+		{
+			free (lookup->answer);
+			lookup->answer = P;
+
+			/* A failing nameserver does not speak for the others, so ask
+			 * the next one right away, as long as one is left. */
+			if (answer_failed (P) && ++lookup->failed_servers < engine_count_nameservers (engine, lookup->resconf) && lookup->sent < lookup->max_sends)
+			{
+				engine->server_failures++;
+				engine_send (engine, lookup);
+				lua_pop (L, 1);
+				continue;
+			}
+		}
+
+		engine_deliver (L, engine, engine_idx, pending, lua_gettop (L));
+		lua_pop (L, 1);
+	}
+}
+/* }}} */
+
+/* {{{ engine_check_deadlines() */
+static double engine_check_deadlines (lua_State *L, struct dns_engine *engine, int engine_idx, int pending)
+{
+	double now = cache_now (), next = -1.0;
+
+	lua_pushnil (L);
+	while (lua_next (L, pending))
+	{
+		struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, -1);
+		if (lookup_unwanted (L, lua_gettop (L)))
+		{
+			/* Stop retransmitting for a thread that was killed. */
+			lookup->timed_out = 1;
+			engine_deliver (L, engine, engine_idx, pending, lua_gettop (L));
+		}
+		else if (now >= lookup->expire || (now >= lookup->deadline && lookup->sent >= lookup->max_sends))
+		{
+			/* Clearing fields of existing keys is safe during traversal. */
+			lookup->timed_out = 1;
+			engine->timeouts++;
+			engine_deliver (L, engine, engine_idx, pending, lua_gettop (L));
+		}
+		else
+		{
+			if (now >= lookup->deadline)
+				engine_send (engine, lookup);
+
+			double due = (lookup->deadline < lookup->expire ? lookup->deadline : lookup->expire);
+			if (next < 0.0 || due < next)
+				next = due;
+		}
+		lua_pop (L, 1);
+	}
+
+	return next;
+}
+/* }}} */
+
+/* {{{ new_lookup() */
+static struct dns_lookup *new_lookup (lua_State *L, enum dns_type type, double expire)
+{
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_newuserdata (L, sizeof (struct dns_lookup));
+	memset (lookup, 0, sizeof (struct dns_lookup));
+	lookup->owner = L;
+	lookup->resconf = *(struct dns_resolv_conf **) lua_touserdata (L, LOOKUP_RESCONF);
+	lookup->hosts = *(struct dns_hosts **) lua_touserdata (L, LOOKUP_HOSTS);
+	lookup->type = type;
+	lookup->expire = expire;
+	luaL_getmetatable (L, "ratchet_dns_lookup_meta");
+	lua_setmetatable (L, -2);
+
+	/* The engine may still retransmit after the waiting thread is killed. */
+	lua_createtable (L, 0, 4);
+	lua_pushthread (L);
+	lua_setfield (L, -2, "thread");
+	lua_pushvalue (L, LOOKUP_WAITER);
+	lua_setfield (L, -2, "waiter");
+	lua_pushvalue (L, LOOKUP_RESCONF);
+	lua_setfield (L, -2, "resolv_conf");
+	lua_pushvalue (L, LOOKUP_HOSTS);
+	lua_setfield (L, -2, "hosts");
+	lua_setuservalue (L, -2);
+
+	return lookup;
+}
+/* }}} */
+
+/* {{{ push_flight_key() */
+static void push_flight_key (lua_State *L, enum dns_type type)
+{
+	/* Identical lookups share the name, type and config objects. */
+	push_cache_key (L, lua_tostring (L, LOOKUP_DATA), type);
+	lua_pushfstring (L, " %p %p", lua_touserdata (L, LOOKUP_RESCONF), lua_touserdata (L, LOOKUP_HOSTS));
+	lua_concat (L, 2);
+}
+/* }}} */
+
+/* {{{ push_lookup_name() */
+static const char *push_lookup_name (lua_State *L, enum dns_type type)
+{
+	lua_pushvalue (L, LOOKUP_DATA);
+	if (type == DNS_T_PTR)
+		(void) ensure_arpa_string (L, lua_gettop (L));
+
+	return lua_tostring (L, -1);
+}
+/* }}} */
+
+/* {{{ select_query() */
+static enum dns_type select_query (lua_State *L, size_t i)
+{
+	/* Pushes the i-th query type, and moves its data into place for the
+	 * record parsers, which report errors against LOOKUP_DATA. */
+	int flags = (int) lua_tointeger (L, LOOKUP_FLAGS);
+
+	lua_rawgeti (L, LOOKUP_QUERIES, (int) i);
+	if (flags & DNS_LOOKUP_MANY)
+	{
+		if (!lua_istable (L, -1))
+			luaL_error (L, "query %d must be a {data, type} table", (int) i);
+		lua_rawgeti (L, -1, 1);
+		if (!lua_isstring (L, -1))
+			luaL_error (L, "query %d has no data string", (int) i);
+		lua_replace (L, LOOKUP_DATA);
+		lua_rawgeti (L, -1, 2);
+		lua_replace (L, -2);
+	}
+
+	return get_query_type (L, -1);
+}
+/* }}} */
+
+/* {{{ compact_answer_size() */
+static size_t compact_answer_size (lua_State *L, int index, enum dns_type type)
+{
+	/* An answer is either a lookup holding its packet, or a result table. */
+	struct dns_lookup *lookup = (struct dns_lookup *) luaL_testudata (L, index, "ratchet_dns_lookup_meta");
+	size_t n = 0;
+	struct dns_rr rr;
+
+	if (lookup && lookup->answer)
+	{
+		dns_rr_foreach (&rr, lookup->answer, .section = DNS_S_ANSWER, .type = type)
+			n++;
+	}
+	else if (lua_istable (L, index))
+		n = lua_rawlen (L, index);
+
+	return n;
+}
+/* }}} */
+
+/* {{{ fill_compact_answer() */
+static size_t fill_compact_answer (lua_State *L, int index, enum dns_type type, unsigned int preference, struct dns_compact_addr *addrs)
+{
+	struct dns_lookup *lookup = (struct dns_lookup *) luaL_testudata (L, index, "ratchet_dns_lookup_meta");
+	int family = (type == DNS_T_AAAA ? AF_INET6 : AF_INET);
+	size_t addrlen = (type == DNS_T_AAAA ? sizeof (struct in6_addr) : sizeof (struct in_addr));
+	size_t n = 0;
+
+	if (lookup && lookup->answer)
+	{
+		struct dns_rr rr;
+		dns_rr_foreach (&rr, lookup->answer, .sort = &dns_rr_i_packet)
+		{
+			if (DNS_S_ANSWER != rr.section || type != rr.type)
+				continue;
+
+			union { struct dns_a a; struct dns_aaaa a6; } rec;
+			int error = (type == DNS_T_AAAA ? dns_aaaa_parse (&rec.a6, &rr, lookup->answer) : dns_a_parse (&rec.a, &rr, lookup->answer));
+			if (error)
+				return raise_dns_error (L, lua_tostring (L, LOOKUP_DATA), (type == DNS_T_AAAA ? "dns_aaaa_parse" : "dns_a_parse"), error);
+
+			addrs[n].family = family;
+			addrs[n].ttl = (unsigned int) rr.ttl;
+			addrs[n].preference = preference;
+			memcpy (&addrs[n].addr, (type == DNS_T_AAAA ? (void *) &rec.a6.addr : (void *) &rec.a.addr), addrlen);
+			n++;
+		}
+	}
+	else if (lua_istable (L, index))
+	{
+		/* Cached answers keep counting down their TTL. */
+		double ttl = 0.0;
+		if ((int) lua_tointeger (L, LOOKUP_FLAGS) & DNS_LOOKUP_CACHEABLE)
+			ttl = cache_expires (L, lua_tostring (L, LOOKUP_DATA), type) - cache_now ();
+
+		size_t i, num = lua_rawlen (L, index);
+		for (i=1; i<=num; i++)
+		{
+			lua_rawgeti (L, index, (int) i);
+			void *addr = lua_touserdata (L, -1);
+			if (addr)
+			{
+				addrs[n].family = family;
+				addrs[n].ttl = (unsigned int) (ttl > 0.0 ? ttl : 0.0);
+				addrs[n].preference = preference;
+				memcpy (&addrs[n].addr, addr, addrlen);
+				n++;
+			}
+			lua_pop (L, 1);
+		}
+	}
+
+	return n;
+}
+/* }}} */
+
+/* {{{ lookup_join() */
+static void lookup_join (lua_State *L, int lookup_idx, double expire)
+{
+	lua_getuservalue (L, lookup_idx);
+	lua_getfield (L, -1, "joiners");
+	if (lua_isnil (L, -1))
+	{
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -3, "joiners");
+	}
+
+	lua_createtable (L, 0, 3);
+	lua_pushthread (L);
+	lua_setfield (L, -2, "thread");
+	lua_pushvalue (L, LOOKUP_WAITER);
+	lua_setfield (L, -2, "waiter");
+	lua_pushnumber (L, (lua_Number) expire);
+	lua_setfield (L, -2, "expire");
+	lua_rawseti (L, -2, (int) lua_rawlen (L, -2) + 1);
+
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ lookup_joined_expire() */
+static double lookup_joined_expire (lua_State *L, int lookup_idx, int detach)
+{
+	/* Finds when this thread stops waiting on a lookup it joined, and
+	 * optionally stops waiting on it. Returns -1 if it never joined. */
+	double expire = -1.0;
+	size_t i, num;
+
+	lua_getuservalue (L, lookup_idx);
+	lua_getfield (L, -1, "joiners");
+	num = lua_rawlen (L, -1);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, -1, (int) i);
+		lua_getfield (L, -1, "thread");
+		if (lua_tothread (L, -1) == L)
+		{
+			lua_getfield (L, -2, "expire");
+			expire = (double) lua_tonumber (L, -1);
+			lua_pop (L, 3);
+			break;
+		}
+		lua_pop (L, 2);
+	}
+
+	if (detach && i <= num)
+	{
+		for (; i<num; i++)
+		{
+			lua_rawgeti (L, -1, (int) i+1);
+			lua_rawseti (L, -2, (int) i);
+		}
+		lua_pushnil (L);
+		lua_rawseti (L, -2, (int) num);
+	}
+	lua_pop (L, 2);
+
+	return expire;
+}
+/* }}} */
+
+/* {{{ lookup_notify_joiners() */
+static void lookup_notify_joiners (lua_State *L, int lookup_idx, enum dns_reason reason)
+{
+	/* Expects the result and error on top, shares them with joined threads. */
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+	size_t i, num;
+	lookup->finished = 1;
+
+	lua_getuservalue (L, lookup_idx);
+	lua_pushvalue (L, -3);
+	lua_setfield (L, -2, "result");
+	lua_pushvalue (L, -2);
+	lua_setfield (L, -2, "error");
+	lua_pushinteger (L, (lua_Integer) reason);
+	lua_setfield (L, -2, "reason");
+
+	/* Stop taking new joiners. */
+	lua_getuservalue (L, LOOKUP_ENGINE);
+	lua_getfield (L, -1, "flights");
+	lua_getfield (L, -3, "flight");
+	lua_pushvalue (L, -1);
+	lua_rawget (L, -3);
+	if (lua_touserdata (L, -1) == lookup)
+	{
+		lua_pop (L, 1);
+		lua_pushnil (L);
+		lua_rawset (L, -3);
+	}
+	else
+		lua_pop (L, 2);
+	lua_pop (L, 2);
+
+	lua_getfield (L, -1, "joiners");
+	num = lua_rawlen (L, -1);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, -1, (int) i);
+		wake_waiter (L, lua_gettop (L));
+		lua_pop (L, 1);
+	}
+
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ lookup_store() */
+static void lookup_store (lua_State *L, size_t i, int type_idx, enum dns_reason reason)
+{
+	/* Pops the result and error of the i-th query into the answers. */
+	int flags = (int) lua_tointeger (L, LOOKUP_FLAGS);
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+
+	if (flags & DNS_LOOKUP_MANY)
+	{
+		lua_rawseti (L, LOOKUP_ERRORS, (int) i);
+		lua_rawseti (L, LOOKUP_ANSWERS, (int) i);
+		if (reason)
+		{
+			/* The reasons table is the waiter's uservalue. */
+			lua_getuservalue (L, LOOKUP_WAITER);
+			lua_pushstring (L, dns_reason_names[reason]);
+			lua_rawseti (L, -2, (int) i);
+			lua_pop (L, 1);
+		}
+	}
+	else
+	{
+		/* Set the result to answers[type] and the error to answers[type.."_error"]. */
+		lua_pushvalue (L, type_idx);
+		lua_pushliteral (L, "_error");
+		lua_concat (L, 2);
+		lua_insert (L, -2);
+		lua_rawset (L, LOOKUP_ANSWERS);
+		lua_pushvalue (L, type_idx);
+		lua_insert (L, -2);
+		lua_rawset (L, LOOKUP_ANSWERS);
+	}
+
+	/* Done with the lookup, let it be collected. */
+	lua_pushboolean (L, 0);
+	lua_rawseti (L, LOOKUP_LOOKUPS, (int) i);
+	waiter->active--;
+}
+/* }}} */
+
+/* {{{ lookup_complete() */
+static void lookup_complete (lua_State *L, size_t i, int type_idx, int lookup_idx)
+{
+	int flags = (int) lua_tointeger (L, LOOKUP_FLAGS);
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, lookup_idx);
+	enum dns_reason reason = DNS_REASON_NONE;
+
+	if (lookup->owner != L)
+	{
+		/* Joined another thread's lookup, share its results. */
+		lua_getuservalue (L, lookup_idx);
+		lua_getfield (L, -1, "reason");
+		reason = (enum dns_reason) lua_tointeger (L, -1);
+		lua_pop (L, 1);
+		lua_getfield (L, -1, "result");
+		lua_getfield (L, -2, "error");
+		lua_remove (L, -3);
+	}
+	else if ((flags & DNS_LOOKUP_COMPACT) && !lookup->shared)
+	{
+		/* Keep the answer packet, its records are copied out when finished. */
+		lookup->finished = 1;
+		if (!lookup->answer && lookup->timed_out)
+		{
+			lua_pushnil (L);
+			lua_pushliteral (L, DNS_TIMED_OUT);
+			reason = DNS_REASON_TIMEOUT;
+		}
+		else if (compact_answer_size (L, lookup_idx, lookup->type) > 0)
+		{
+			lua_pushvalue (L, lookup_idx);
+			lua_pushnil (L);
+		}
+		else
+			reason = push_lookup_error (L, lua_tostring (L, LOOKUP_DATA), lookup->type, lookup->answer);
+	}
+	else
+	{
+		if (!lookup->answer && lookup->timed_out)
+		{
+			lua_pushnil (L);
+			lua_pushliteral (L, DNS_TIMED_OUT);
+			reason = DNS_REASON_TIMEOUT;
+		}
+		else if (1 == push_answer_results (L, lua_tostring (L, LOOKUP_DATA), lookup->type, lookup->answer, (flags & DNS_LOOKUP_CACHEABLE), &reason))
+			lua_pushnil (L);
+
+		lookup_notify_joiners (L, lookup_idx, reason);
+	}
+
+	lookup_store (L, i, type_idx, reason);
+}
+/* }}} */
+
+/* {{{ lookup_start() */
+static void lookup_start (lua_State *L, size_t i, double expire)
+{
+	struct dns_engine *engine = (struct dns_engine *) lua_touserdata (L, LOOKUP_ENGINE);
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+	int flags = (int) lua_tointeger (L, LOOKUP_FLAGS);
+	int top = lua_gettop (L);
+
+	enum dns_type type = select_query (L, i);
+	const char *data = lua_tostring (L, LOOKUP_DATA);
+	waiter->active++;
+
+	/* Answers are only shared between queries using the default config. */
+	enum dns_reason reason = DNS_REASON_NONE;
+	if ((flags & DNS_LOOKUP_CACHEABLE) && cache_lookup (L, data, type, &reason))
+	{
+		lookup_store (L, i, top+1, reason);
+		lua_settop (L, top);
+		return;
+	}
+
+	if (check_special (L, data, type))
+	{
+		lua_createtable (L, 1, 0);
+		lua_insert (L, -2);
+		lua_rawseti (L, -2, 1);
+		lua_pushnil (L);
+		lookup_store (L, i, top+1, DNS_REASON_NONE);
+		lua_settop (L, top);
+		return;
+	}
+
+	/* Join an identical lookup another thread has in flight. If that thread
+	 * was killed, the lookup is taken over when its answer arrives. */
+	push_flight_key (L, type);
+	lua_getuservalue (L, LOOKUP_ENGINE);
+	lua_getfield (L, -1, "flights");
+	lua_replace (L, -2);
+	lua_pushvalue (L, top+2);
+	lua_rawget (L, top+3);
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, top+4);
+	if (lookup && lookup->owner != L && !lookup->finished && (lookup->pending || !lookup_owner_gone (L, top+4)))
+	{
+		lookup_join (L, top+4, expire);
+		lua_rawseti (L, LOOKUP_LOOKUPS, (int) i);
+		waiter->outstanding++;
+		engine->coalesced++;
+		lua_settop (L, top);
+		return;
+	}
+	lua_settop (L, top+3);
+
+	new_lookup (L, type, expire);
+	if (!(flags & DNS_LOOKUP_COMPACT))
+	{
+		/* Compact lookups never parse their answer, so cannot share it. */
+		lookup->shared = 1;
+		lua_pushvalue (L, top+2);
+		lua_pushvalue (L, top+4);
+		lua_rawset (L, top+3);
+		lua_getuservalue (L, top+4);
+		lua_pushvalue (L, top+2);
+		lua_setfield (L, -2, "flight");
+		lua_pop (L, 1);
+	}
+	lua_pushvalue (L, top+4);
+	lua_rawseti (L, LOOKUP_LOOKUPS, (int) i);
+	engine->lookups++;
+
+	if (lookup_advance (L, engine, LOOKUP_ENGINE, top+4, push_lookup_name (L, type)))
+		waiter->outstanding++;
+	else
+		lookup_complete (L, i, top+1, top+4);
+
+	lua_settop (L, top);
+}
+/* }}} */
+
+/* {{{ lookup_start_more() */
+static void lookup_start_more (lua_State *L)
+{
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+	size_t num = lua_rawlen (L, LOOKUP_QUERIES);
+	double timeout = (double) luaL_optnumber (L, LOOKUP_TIMEOUT, (lua_Number) DNS_DEFAULT_EXPIRE_TIMEOUT);
+
+	while (waiter->next <= num && (!waiter->concurrency || waiter->active < waiter->concurrency))
+		lookup_start (L, waiter->next++, cache_now () + timeout);
+}
+/* }}} */
+
+/* {{{ lookup_progress() */
+static void lookup_progress (lua_State *L)
+{
+	/* Moves along lookups the engine or another thread has woken us for. */
+	struct dns_engine *engine = (struct dns_engine *) lua_touserdata (L, LOOKUP_ENGINE);
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+	double now = cache_now ();
+	size_t i;
+
+	for (i=1; i<waiter->next; i++)
+	{
+		lua_settop (L, LOOKUP_LOOKUPS);
+		lua_rawgeti (L, LOOKUP_LOOKUPS, (int) i);
+		struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, LOOKUP_LOOKUPS+1);
+		if (!lookup)
+			continue;
+
+		if (lookup->owner != L)
+		{
+			double joined = lookup_joined_expire (L, LOOKUP_LOOKUPS+1, 0);
+			if (lookup->finished)
+			{
+				(void) select_query (L, i);
+				lookup_complete (L, i, LOOKUP_LOOKUPS+2, LOOKUP_LOOKUPS+1);
+			}
+			else if (joined >= 0.0 && now >= joined)
+			{
+				/* Gave up on the joined lookup before its owner did. */
+				(void) lookup_joined_expire (L, LOOKUP_LOOKUPS+1, 1);
+				(void) select_query (L, i);
+				lua_pushnil (L);
+				lua_pushliteral (L, DNS_TIMED_OUT);
+				lookup_store (L, i, LOOKUP_LOOKUPS+2, DNS_REASON_TIMEOUT);
+				waiter->outstanding--;
+			}
+		}
+		else if (lookup->delivered)
+		{
+			lookup_delivered (lookup);
+			if (lookup->truncated)
+				continue;
+
+			(void) select_query (L, i);
+			if (lookup_advance (L, engine, LOOKUP_ENGINE, LOOKUP_LOOKUPS+1, push_lookup_name (L, lookup->type)))
+				waiter->outstanding++;
+			else
+			{
+				lua_settop (L, LOOKUP_LOOKUPS+2);
+				lookup_complete (L, i, LOOKUP_LOOKUPS+2, LOOKUP_LOOKUPS+1);
+			}
+		}
+	}
+
+	lua_settop (L, LOOKUP_LOOKUPS);
+}
+/* }}} */
+
+/* {{{ lookup_wait() */
+static int lookup_wait (lua_State *L)
+{
+	/* Make sure the engine is pumping answers, then wait to be woken by it. */
+	struct dns_engine *engine = (struct dns_engine *) lua_touserdata (L, LOOKUP_ENGINE);
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+
+	if (engine->pumping)
+	{
+		lua_getuservalue (L, LOOKUP_ENGINE);
+		lua_getfield (L, -1, "pump");
+		if (lua_isthread (L, -1) && ratchet_thread_ended (L, -1))
+			engine->pumping = 0;
+		lua_pop (L, 2);
+	}
+
+	if (!engine->pumping)
+	{
+		engine->pumping = 1;
+		lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_thread_class");
+		lua_getfield (L, -1, "attach");
+		lua_remove (L, -2);
+		lua_pushcfunction (L, mydns_engine_pump);
+		lua_pushvalue (L, LOOKUP_ENGINE);
+		lua_callk (L, 2, 0, 2, mydns_engine_lookup);
+	}
+
+	/* Lookups joined from other threads are only waited on until our own
+	 * timeout, their owner may have a longer one. */
+	double expire = -1.0;
+	size_t i;
+	for (i=1; i<waiter->next; i++)
+	{
+		lua_rawgeti (L, LOOKUP_LOOKUPS, (int) i);
+		struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, -1);
+		if (lookup && lookup->owner != L && !lookup->finished)
+		{
+			double joined = lookup_joined_expire (L, lua_gettop (L), 0);
+			if (joined >= 0.0 && (expire < 0.0 || joined < expire))
+				expire = joined;
+		}
+		lua_pop (L, 1);
+	}
+
+	waiter->paused = 1;
+	if (expire >= 0.0)
+	{
+		double wait = expire - cache_now ();
+		lua_pushlightuserdata (L, RATCHET_YIELD_TIMEOUT);
+		lua_pushnumber (L, (lua_Number) (wait > 0.0 ? wait : 0.0));
+		return lua_yieldk (L, 2, 3, mydns_engine_lookup);
+	}
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 3, mydns_engine_lookup);
+}
+/* }}} */
+
+/* {{{ lookup_fallback() */
+static int lookup_fallback (lua_State *L, size_t i)
+{
+	/* Runs a truncated lookup again with a dedicated resolver, which can use TCP. */
+	struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, -1);
+	lookup->truncated = 0;
+	lua_settop (L, LOOKUP_LOOKUPS);
+
+	lua_pushinteger (L, (lua_Integer) i);
+	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_dns_class");
+	lua_getfield (L, -1, "new");
+	lua_remove (L, -2);
+	lua_pushvalue (L, LOOKUP_RESCONF);
+	lua_pushvalue (L, LOOKUP_HOSTS);
+	lua_pushvalue (L, LOOKUP_TIMEOUT);
+	lua_call (L, 3, 1);
+
+	lua_getfield (L, -1, "submit_query");
+	lua_pushvalue (L, -2);
+	(void) select_query (L, i);
+	lua_pushvalue (L, LOOKUP_DATA);
+	lua_insert (L, -2);
+	lua_call (L, 3, 0);
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+	lua_pushvalue (L, LOOKUP_LOOKUPS+2);
+	return lua_yieldk (L, 2, 4, mydns_engine_lookup);
+}
+/* }}} */
+
+/* {{{ push_compact_results() */
+static int push_compact_results (lua_State *L)
+{
+	/* Packs the addresses of every query into one flat array, preferring the
+	 * earlier query types, or returns the error of the first failed query. */
+	size_t i, n = 0, num = lua_rawlen (L, LOOKUP_QUERIES);
+
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, LOOKUP_QUERIES, (int) i);
+		enum dns_type type = get_query_type (L, -1);
+		lua_rawget (L, LOOKUP_ANSWERS);
+		n += compact_answer_size (L, -1, type);
+		lua_pop (L, 1);
+	}
+
+	if (n == 0)
+	{
+		lua_pushnil (L);
+		for (i=1; i<=num; i++)
+		{
+			lua_rawgeti (L, LOOKUP_QUERIES, (int) i);
+			lua_pushliteral (L, "_error");
+			lua_concat (L, 2);
+			lua_rawget (L, LOOKUP_ANSWERS);
+			if (!lua_isnil (L, -1))
+				return 2;
+			lua_pop (L, 1);
+		}
+		lua_pushliteral (L, "no addresses found");
+		return 2;
+	}
+
+	struct dns_compact *compact = (struct dns_compact *) lua_newuserdata (L, sizeof (struct dns_compact) + n * sizeof (struct dns_compact_addr));
+	luaL_getmetatable (L, "ratchet_dns_compact_meta");
+	lua_setmetatable (L, -2);
+	compact->n = 0;
+
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, LOOKUP_QUERIES, (int) i);
+		enum dns_type type = get_query_type (L, -1);
+		lua_rawget (L, LOOKUP_ANSWERS);
+		compact->n += fill_compact_answer (L, lua_gettop (L), type, (unsigned int) (i-1), compact->addrs + compact->n);
+		lua_pop (L, 1);
+	}
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ lookup_finish() */
+static int lookup_finish (lua_State *L)
+{
+	int flags = (int) lua_tointeger (L, LOOKUP_FLAGS);
+	lua_settop (L, LOOKUP_LOOKUPS);
+
+	if (flags & DNS_LOOKUP_SINGLE)
+	{
+		lua_rawgeti (L, LOOKUP_QUERIES, 1);
+		lua_rawget (L, LOOKUP_ANSWERS);
+		lua_rawgeti (L, LOOKUP_QUERIES, 1);
+		lua_pushliteral (L, "_error");
+		lua_concat (L, 2);
+		lua_rawget (L, LOOKUP_ANSWERS);
+		return 2;
+	}
+	else if (flags & DNS_LOOKUP_MANY)
+	{
+		lua_pushvalue (L, LOOKUP_ANSWERS);
+		lua_pushvalue (L, LOOKUP_ERRORS);
+		lua_getuservalue (L, LOOKUP_WAITER);
+		return 3;
+	}
+	else if (flags & DNS_LOOKUP_COMPACT)
+		return push_compact_results (L);
+
+	lua_pushvalue (L, LOOKUP_ANSWERS);
+	return 1;
+}
+/* }}} */
+
+/* {{{ lookup_settle() */
+static int lookup_settle (lua_State *L)
+{
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+	size_t i;
+
+	lookup_start_more (L);
+	if (waiter->outstanding > 0)
+		return lookup_wait (L);
+
+	for (i=1; i<waiter->next; i++)
+	{
+		lua_rawgeti (L, LOOKUP_LOOKUPS, (int) i);
+		struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, -1);
+		if (lookup && lookup->owner == L && lookup->truncated)
+			return lookup_fallback (L, i);
+		lua_pop (L, 1);
+	}
+
+	return lookup_finish (L);
+}
+/* }}} */
+
+/* {{{ begin_lookup() */
+static int begin_lookup (lua_State *L, int flags, size_t concurrency)
+{
+	/* Expects data, queries, resolv_conf, hosts and timeout. */
+	lua_settop (L, 5);
+	if (lua_isnil (L, 3) && lua_isnil (L, 4))
+		flags |= DNS_LOOKUP_CACHEABLE;
+	(void) arg_or_registry (L, 3, "ratchet_dns_resolv_conf_default", "ratchet_dns_resolv_conf_meta");
+	(void) arg_or_registry (L, 4, "ratchet_dns_hosts_default", "ratchet_dns_hosts_meta");
+
+	lua_pushinteger (L, flags);
+	lua_insert (L, LOOKUP_FLAGS);
+	lua_newtable (L);
+	lua_insert (L, LOOKUP_ANSWERS);
+	if (flags & DNS_LOOKUP_MANY)
+		lua_newtable (L);
+	else
+		lua_pushnil (L);
+	lua_insert (L, LOOKUP_ERRORS);
+
+	struct dns_waiter *waiter = (struct dns_waiter *) lua_newuserdata (L, sizeof (struct dns_waiter));
+	memset (waiter, 0, sizeof (struct dns_waiter));
+	waiter->eager = (flags & DNS_LOOKUP_MANY);
+	waiter->concurrency = concurrency;
+	waiter->next = 1;
+	if (flags & DNS_LOOKUP_MANY)
+	{
+		lua_newtable (L);
+		lua_setuservalue (L, -2);
+	}
+
+	return mydns_engine_lookup (L);
+}
+/* }}} */
+
+/* {{{ push_mx_hosts() */
+static int push_mx_hosts (lua_State *L, int answer_idx)
+{
+	/* Flattens an MX answer into a list of {host, priority}, in priority order. */
+	size_t i, j, n = 0;
+	lua_newtable (L);
+
+	lua_getfield (L, answer_idx, "priorities");
+	for (i=1; ; i++)
+	{
+		lua_rawgeti (L, -1, (int) i);
+		if (lua_isnil (L, -1))
+			break;
+		lua_rawget (L, answer_idx);
+		for (j=1; ; j++)
+		{
+			lua_rawgeti (L, -1, (int) j);
+			if (lua_isnil (L, -1))
+				break;
+			lua_createtable (L, 2, 0);
+			lua_insert (L, -2);
+			lua_rawseti (L, -2, 1);
+			lua_rawgeti (L, -3, (int) i);
+			lua_rawseti (L, -2, 2);
+			lua_rawseti (L, -4, (int) ++n);
+		}
+		lua_pop (L, 2);
+	}
+	lua_pop (L, 2);
+
+	return (int) n;
+}
+/* }}} */
+
+/* {{{ push_mx_target() */
+static void push_mx_target (lua_State *L, int host_idx, int addr_idx, int family, int port)
+{
+	/* Appends a prepare_tcp() style record for the address to the table on top. */
+	lua_createtable (L, 0, 6);
+	lua_pushinteger (L, family);
+	lua_setfield (L, -2, "family");
+	lua_pushinteger (L, SOCK_STREAM);
+	lua_setfield (L, -2, "socktype");
+	lua_pushinteger (L, 0);
+	lua_setfield (L, -2, "protocol");
+	lua_rawgeti (L, host_idx, 1);
+	lua_setfield (L, -2, "host");
+	lua_rawgeti (L, host_idx, 2);
+	lua_setfield (L, -2, "priority");
+
+	if (family == AF_INET6)
+	{
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) lua_newuserdata (L, sizeof (struct sockaddr_in6));
+		memset (addr, 0, sizeof (struct sockaddr_in6));
+		addr->sin6_family = AF_INET6;
+		addr->sin6_port = htons (port);
+		memcpy (&addr->sin6_addr, lua_touserdata (L, addr_idx), sizeof (struct in6_addr));
+	}
+	else
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *) lua_newuserdata (L, sizeof (struct sockaddr_in));
+		memset (addr, 0, sizeof (struct sockaddr_in));
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons (port);
+		memcpy (&addr->sin_addr, lua_touserdata (L, addr_idx), sizeof (struct in_addr));
+	}
+	luaL_getmetatable (L, "ratchet_socket_sockaddr_meta");
+	lua_setmetatable (L, -2);
+	lua_setfield (L, -2, "addr");
+
+	lua_rawseti (L, -2, (int) lua_rawlen (L, -2) + 1);
+}
+/* }}} */
+
+/* {{{ push_mx_targets() */
+static int push_mx_targets (lua_State *L, int hosts_idx, int answers_idx, int errors_idx, int first)
+{
+	/* Each host has its AAAA and then A answers from index first onward. */
+	int port = (int) lua_tointeger (L, 2);
+	size_t i, j, num = lua_rawlen (L, hosts_idx);
+	int k, top = lua_gettop (L);
+	static const int families[2] = {AF_INET6, AF_INET};
+
+	lua_newtable (L);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, hosts_idx, (int) i);
+		for (k=0; k<2; k++)
+		{
+			lua_rawgeti (L, answers_idx, first + 2*((int) i-1) + k);
+			if (lua_istable (L, -1))
+			{
+				for (j=1; ; j++)
+				{
+					lua_rawgeti (L, -1, (int) j);
+					if (lua_isnil (L, -1))
+						break;
+					lua_pushvalue (L, top+1);
+					push_mx_target (L, top+2, lua_gettop (L)-1, families[k], port);
+					lua_pop (L, 2);
+				}
+				lua_pop (L, 1);
+			}
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 1);
+	}
+
+	if (lua_rawlen (L, top+1) > 0)
+		return 1;
+
+	/* No addresses for any exchanger, report the first failure. */
+	lua_pushnil (L);
+	for (i=0; i<2*num; i++)
+	{
+		lua_rawgeti (L, errors_idx, first + (int) i);
+		if (!lua_isnil (L, -1))
+			return 2;
+		lua_pop (L, 1);
+	}
+	lua_pushfstring (L, "%s has no usable mail exchanger", lua_tostring (L, 1));
+	return 2;
+}
+/* }}} */
+
+/* {{{ push_mx_queries() */
+static void push_mx_queries (lua_State *L, int hosts_idx)
+{
+	size_t i, num = lua_rawlen (L, hosts_idx);
+
+	lua_createtable (L, (int) (2*num), 0);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, hosts_idx, (int) i);
+		lua_createtable (L, 2, 0);
+		lua_rawgeti (L, -2, 1);
+		lua_rawseti (L, -2, 1);
+		lua_pushliteral (L, "aaaa");
+		lua_rawseti (L, -2, 2);
+		lua_rawseti (L, -3, (int) (2*i-1));
+		lua_createtable (L, 2, 0);
+		lua_rawgeti (L, -2, 1);
+		lua_rawseti (L, -2, 1);
+		lua_pushliteral (L, "a");
+		lua_rawseti (L, -2, 2);
+		lua_rawseti (L, -3, (int) (2*i));
+		lua_pop (L, 1);
+	}
+}
+/* }}} */
+
+/* {{{ push_verify_addr() */
+static int push_verify_addr (lua_State *L, int index)
+{
+	/* Replaces the address at index with its string form, and pushes its raw bytes. */
+	char buf[INET6_ADDRSTRLEN];
+	struct in_addr a4;
+	struct in6_addr a6;
+	int family = 0;
+
+	struct sockaddr *sa = (struct sockaddr *) luaL_testudata (L, index, "ratchet_socket_sockaddr_meta");
+	if (sa && sa->sa_family == AF_INET)
+	{
+		memcpy (&a4, &((struct sockaddr_in *) sa)->sin_addr, sizeof (struct in_addr));
+		family = AF_INET;
+	}
+	else if (sa && sa->sa_family == AF_INET6)
+	{
+		memcpy (&a6, &((struct sockaddr_in6 *) sa)->sin6_addr, sizeof (struct in6_addr));
+		family = AF_INET6;
+	}
+	else if (!sa)
+	{
+		const char *str = luaL_checkstring (L, index);
+		if (inet_pton (AF_INET, str, &a4) > 0)
+			family = AF_INET;
+		else if (inet_pton (AF_INET6, str, &a6) > 0)
+			family = AF_INET6;
+	}
+
+	/* Clients on a dual-stack listener show up as IPv4-mapped addresses. */
+	if (family == AF_INET6 && IN6_IS_ADDR_V4MAPPED (&a6))
+	{
+		memcpy (&a4, &a6.s6_addr[12], sizeof (struct in_addr));
+		family = AF_INET;
+	}
+	if (!family)
+		return luaL_argerror (L, index, "IP address expected");
+
+	if (family == AF_INET)
+	{
+		inet_ntop (AF_INET, &a4, buf, sizeof (buf));
+		lua_pushstring (L, buf);
+		lua_replace (L, index);
+		lua_pushlstring (L, (const char *) &a4, sizeof (struct in_addr));
+	}
+	else
+	{
+		inet_ntop (AF_INET6, &a6, buf, sizeof (buf));
+		lua_pushstring (L, buf);
+		lua_replace (L, index);
+		lua_pushlstring (L, (const char *) &a6, sizeof (struct in6_addr));
+	}
+
+	return family;
+}
+/* }}} */
+
+/* {{{ verify_cacheable() */
+static int verify_cacheable (lua_State *L, int options_idx)
+{
+	/* Like answers, results are only shared when using the default config. */
+	if (!lua_istable (L, options_idx))
+		return 1;
+
+	lua_getfield (L, options_idx, "resolv_conf");
+	lua_getfield (L, options_idx, "hosts");
+	int cacheable = (lua_isnil (L, -1) && lua_isnil (L, -2));
+	lua_pop (L, 2);
+
+	return cacheable;
+}
+/* }}} */
+
+/* {{{ verify_finish() */
+static int verify_finish (lua_State *L, double expires)
+{
+	/* Expects the name and error on top, remembers them until the first of
+	 * the answers they were based on expires. */
+	double now = cache_now ();
+	if (expires > now && verify_cacheable (L, 2))
+		cache_store_kind (L, lua_tostring (L, 1), DNS_VERIFY_PTR_KIND, lua_gettop (L)-1, lua_tostring (L, -1), DNS_REASON_NONE, expires - now);
+
+	return 2;
+}
+/* }}} */
+
+/* {{{ min_expires() */
+static double min_expires (double a, double b)
+{
+	if (a <= 0.0)
+		return b;
+	if (b <= 0.0)
+		return a;
+	return (a < b ? a : b);
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ mydns_new() */
+static int mydns_new (lua_State *L)
+{
+	lua_settop (L, 3);
+	int cacheable = (lua_isnil (L, 1) && lua_isnil (L, 2));
+	struct dns_resolv_conf *resconf = *(struct dns_resolv_conf **) arg_or_registry (L, 1, "ratchet_dns_resolv_conf_default", "ratchet_dns_resolv_conf_meta");
+	struct dns_hosts *hosts = *(struct dns_hosts **) arg_or_registry (L, 2, "ratchet_dns_hosts_default", "ratchet_dns_hosts_meta");
+	lua_Number expire_timeout = luaL_optnumber (L, 3, (lua_Number) DNS_DEFAULT_EXPIRE_TIMEOUT);
+
+	struct dns_resolver **new = (struct dns_resolver **) lua_newuserdata (L, sizeof (struct dns_resolver *));
+	int error = 0;
+
+	*new = dns_res_open (resconf, hosts, dns_hints_mortal (dns_hints_local (resconf, &error)), NULL, dns_opts (), &error);
+	if (!*new)
+		return raise_dns_error (L, "ratchet.dns.new()", "dns_res_open", error);
+
+	luaL_getmetatable (L, "ratchet_dns_meta");
+	lua_setmetatable (L, -2);
+
+	lua_createtable (L, 0, 3);
+	lua_pushinteger (L, (lua_Integer) (resconf->options.timeout > 0 ? resconf->options.timeout : 1));
+	lua_setfield (L, -2, "retry_timeout");
+	lua_pushnumber (L, expire_timeout);
+	lua_setfield (L, -2, "expire_timeout");
+	lua_pushboolean (L, cacheable);
+	lua_setfield (L, -2, "cacheable");
+	lua_setuservalue (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_mx_get_i() */
+static int mydns_mx_get_i (lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTABLE);
+	int n = luaL_checkint (L, 2);
+
+	lua_getfield (L, 1, "n");
+	int max_n = lua_tonumber (L, -1);
+	lua_pop (L, 1);
+	if (n <= 0)
+		return 0;
+	if (n > max_n)
+		n = n % max_n;
+
+	int i, j, k=1;
+	lua_getfield (L, 1, "priorities");
+	for (i=1; ; i++)
+	{
+		lua_rawgeti (L, -1, i);
+		if (lua_isnil (L, -1))
+			break;
+
+		int p = lua_tonumber (L, -1);
+		lua_pop (L, 1);
+		lua_rawgeti (L, 1, p);
+		for (j=1; ; j++)
+		{
+			lua_rawgeti (L, -1, j);
+			if (lua_isnil (L, -1))
+				break;
+			if (k++ == n)
+				return 1;
+			lua_pop (L, 1);
+		}
+		lua_pop (L, 2);
+	}
+	lua_pop (L, 2);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ check_compact_addr() */
+static struct dns_compact_addr *check_compact_addr (lua_State *L)
+{
+	struct dns_compact *compact = get_dns_compact (L, 1);
+	lua_Integer i = luaL_checkinteger (L, 2);
+	luaL_argcheck (L, i >= 1 && (size_t) i <= compact->n, 2, "index out of range");
+
+	return &compact->addrs[i-1];
+}
+/* }}} */
+
+/* {{{ mydns_compact_index() */
+static int mydns_compact_index (lua_State *L)
+{
+	struct dns_compact *compact = get_dns_compact (L, 1);
+	if (lua_type (L, 2) != LUA_TNUMBER)
+	{
+		lua_settop (L, 2);
+		lua_rawget (L, lua_upvalueindex (1));
+		return 1;
+	}
+
+	/* Address objects are only created as they are indexed. */
+	lua_Integer i = lua_tointeger (L, 2);
+	if (i < 1 || (size_t) i > compact->n)
+		return 0;
+
+	struct dns_compact_addr *ca = &compact->addrs[i-1];
+	if (ca->family == AF_INET6)
+	{
+		struct in6_addr *addr = (struct in6_addr *) lua_newuserdata (L, sizeof (struct in6_addr));
+		memcpy (addr, &ca->addr.a6, sizeof (struct in6_addr));
+		luaL_getmetatable (L, "ratchet_dns_aaaa_meta");
+	}
+	else
+	{
+		struct in_addr *addr = (struct in_addr *) lua_newuserdata (L, sizeof (struct in_addr));
+		memcpy (addr, &ca->addr.a, sizeof (struct in_addr));
+		luaL_getmetatable (L, "ratchet_dns_a_meta");
+	}
+	lua_setmetatable (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_compact_len() */
+static int mydns_compact_len (lua_State *L)
+{
+	struct dns_compact *compact = get_dns_compact (L, 1);
+	lua_pushinteger (L, (lua_Integer) compact->n);
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_compact_get_family() */
+static int mydns_compact_get_family (lua_State *L)
+{
+	struct dns_compact_addr *ca = check_compact_addr (L);
+	lua_pushinteger (L, ca->family);
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_compact_get_ttl() */
+static int mydns_compact_get_ttl (lua_State *L)
+{
+	struct dns_compact_addr *ca = check_compact_addr (L);
+	lua_pushinteger (L, (lua_Integer) ca->ttl);
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_compact_get_preference() */
+static int mydns_compact_get_preference (lua_State *L)
+{
+	struct dns_compact_addr *ca = check_compact_addr (L);
+	lua_pushinteger (L, (lua_Integer) ca->preference);
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_compact_get_sockaddr() */
+static int mydns_compact_get_sockaddr (lua_State *L)
+{
+	struct dns_compact_addr *ca = check_compact_addr (L);
+	int port = luaL_optint (L, 3, 0);
+
+	if (ca->family == AF_INET6)
+	{
+		struct sockaddr_in6 *addr = (struct sockaddr_in6 *) lua_newuserdata (L, sizeof (struct sockaddr_in6));
+		memset (addr, 0, sizeof (struct sockaddr_in6));
+		addr->sin6_family = AF_INET6;
+		addr->sin6_port = htons (port);
+		memcpy (&addr->sin6_addr, &ca->addr.a6, sizeof (struct in6_addr));
+	}
+	else
+	{
+		struct sockaddr_in *addr = (struct sockaddr_in *) lua_newuserdata (L, sizeof (struct sockaddr_in));
+		memset (addr, 0, sizeof (struct sockaddr_in));
+		addr->sin_family = AF_INET;
+		addr->sin_port = htons (port);
+		memcpy (&addr->sin_addr, &ca->addr.a, sizeof (struct in_addr));
+	}
+	luaL_getmetatable (L, "ratchet_socket_sockaddr_meta");
+	lua_setmetatable (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_close() */
+static int mydns_close (lua_State *L)
+{
+	struct dns_resolver **res = (struct dns_resolver **) luaL_checkudata (L, 1, "ratchet_dns_meta");
+	if (*res)
+	{
+		dns_res_close (*res);
+		*res = NULL;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ mydns_get_fd() */
+static int mydns_get_fd (lua_State *L)
+{
+	struct dns_resolver *res = get_dns_res (L, 1);
+	lua_pushinteger (L, dns_res_pollfd (res));
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_get_timeout() */
+static int mydns_get_timeout (lua_State *L)
+{
+	struct dns_resolver *res = get_dns_res (L, 1);
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "retry_timeout");
+	long retry = (long) lua_tointeger (L, -1);
+	lua_getfield (L, -2, "expire_timeout");
+	double et = (double) lua_tonumber (L, -1);
+	lua_pop (L, 3);
+
+	/* libdns counts retransmit and expire deadlines in whole seconds of
+	 * time(), so wake up just as its clock reaches the nearest one. */
+	long elapsed = (long) dns_res_elapsed (res);
+	long next = (retry > 0 ? retry - (elapsed % retry) : 1);
+	long expire = (long) ceil (et) - elapsed;
+	if (expire < next)
+		next = (expire > 0 ? expire : 1);
+
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	double to_tick = 1.0 - ((double) tv.tv_usec / 1000000.0);
+	lua_pushnumber (L, (lua_Number) ((double) (next - 1) + to_tick));
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_engine_gc() */
+static int mydns_engine_gc (lua_State *L)
+{
+	struct dns_engine *engine = get_dns_engine (L, 1);
+	if (engine->fd >= 0)
+	{
+		close (engine->fd);
+		engine->fd = -1;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ mydns_engine_get_fd() */
+static int mydns_engine_get_fd (lua_State *L)
+{
+	struct dns_engine *engine = get_dns_engine (L, 1);
+	lua_pushinteger (L, engine->fd);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_engine_get_timeout() */
+static int mydns_engine_get_timeout (lua_State *L)
+{
+	struct dns_engine *engine = get_dns_engine (L, 1);
+	lua_pushnumber (L, (lua_Number) engine->next_timeout);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_engine_pump() */
+static int mydns_engine_pump (lua_State *L)
+{
+	struct dns_engine *engine = get_dns_engine (L, 1);
+	int ctx = 0;
+	lua_settop (L, 1);
+	lua_getuservalue (L, 1);
+	if (LUA_OK == lua_getctx (L, &ctx))
+	{
+		/* Lookups check on the pump, in case it gets killed. */
+		lua_pushthread (L);
+		lua_setfield (L, -2, "pump");
+	}
+	lua_getfield (L, -1, "pending");
+	lua_replace (L, 2);
+
+	engine_receive (L, engine, 1, 2);
+	double next = engine_check_deadlines (L, engine, 1, 2);
+	if (next < 0.0)
+	{
+		/* Nothing left in flight, the next lookup starts a new pump. */
+		engine->pumping = 0;
+		lua_getuservalue (L, 1);
+		lua_pushnil (L);
+		lua_setfield (L, -2, "pump");
+		return 0;
+	}
+
+	engine->wake_at = next;
+	engine->next_timeout = next - cache_now ();
+	if (engine->next_timeout < 0.0)
+		engine->next_timeout = 0.0;
+
+	lua_settop (L, 1);
+	lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+	lua_pushvalue (L, 1);
+	return lua_yieldk (L, 2, 1, mydns_engine_pump);
+}
+/* }}} */
+
+/* {{{ mydns_lookup_gc() */
+static int mydns_lookup_gc (lua_State *L)
+{
+	struct dns_lookup *lookup = get_dns_lookup (L, 1);
+	free (lookup->query);
+	free (lookup->answer);
+	lookup->query = NULL;
+	lookup->answer = NULL;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ mydns_engine_lookup() */
+static int mydns_engine_lookup (lua_State *L)
+{
+	/* Stack: flags, data, queries, answers, errors, resolv_conf, hosts,
+	 * timeout and waiter, then the ratchet object, engine and lookups table. */
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		lua_settop (L, LOOKUP_WAITER);
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, mydns_engine_lookup);
+	}
+	else if (ctx == 1)
+	{
+		lua_settop (L, LOOKUP_RATCHET);
+		(void) push_dns_engine (L, LOOKUP_RATCHET);
+		lua_createtable (L, (int) lua_rawlen (L, LOOKUP_QUERIES), 0);
+
+		return lookup_settle (L);
+	}
+	else if (ctx == 2 || ctx == 3)
+	{
+		/* Woken by the engine, by another thread's lookup we joined, or
+		 * by giving up on a joined lookup. */
+		struct dns_waiter *waiter = (struct dns_waiter *) lua_touserdata (L, LOOKUP_WAITER);
+		waiter->paused = 0;
+		lua_settop (L, LOOKUP_LOOKUPS);
+		lookup_progress (L);
+
+		return lookup_settle (L);
+	}
+	else
+	{
+		/* Waiting on the resolver retrying a truncated lookup. */
+		int resolver = LOOKUP_LOOKUPS+2;
+		lua_settop (L, resolver);
+		lua_getfield (L, resolver, "is_query_done");
+		lua_pushvalue (L, resolver);
+		lua_call (L, 1, 2);
+		if (!lua_toboolean (L, -2))
+		{
+			lua_settop (L, resolver);
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_pushvalue (L, resolver);
+			return lua_yieldk (L, 2, 4, mydns_engine_lookup);
+		}
+		int query_timeout = lua_toboolean (L, -1);
+		lua_pop (L, 2);
+
+		size_t i = (size_t) lua_tointeger (L, LOOKUP_LOOKUPS+1);
+		(void) select_query (L, i);
+		lua_rawgeti (L, LOOKUP_LOOKUPS, (int) i);
+		struct dns_lookup *lookup = (struct dns_lookup *) lua_touserdata (L, -1);
+		if (query_timeout)
+			lookup->timed_out = 1;
+		else
+		{
+			int error = 0;
+			struct dns_packet *answer = dns_res_fetch (get_dns_res (L, resolver), &error);
+			if (answer)
+			{
+				free (lookup->answer);
+				lookup->answer = answer;
+			}
+		}
+
+		lua_getfield (L, resolver, "close");
+		lua_pushvalue (L, resolver);
+		lua_call (L, 1, 0);
+
+		lookup_complete (L, i, resolver+1, resolver+2);
+		lua_settop (L, LOOKUP_LOOKUPS);
+		return lookup_settle (L);
+	}
+}
+/* }}} */
+
+/* {{{ mydns_query() */
+static int mydns_query (lua_State *L)
+{
+	const char *data = luaL_checkstring (L, 1);
+	enum dns_type type = get_query_type (L, 2);
+	lua_settop (L, 5);
+
+	/* Skip the event loop entirely for cached answers. */
+	if (lua_isnil (L, 3) && lua_isnil (L, 4) && cache_lookup (L, data, type, NULL))
+		return 2;
+
+	/* Rearrange into a query_all() of one type. */
+	lua_createtable (L, 1, 0);
+	lua_pushvalue (L, 2);
+	lua_rawseti (L, -2, 1);
+	lua_replace (L, 2);
+
+	return begin_lookup (L, DNS_LOOKUP_SINGLE, 0);
+}
+/* }}} */
+
+/* {{{ mydns_query_all() */
+static int mydns_query_all (lua_State *L)
+{
+	luaL_checkstring (L, 1);	/* Query data. */
+	luaL_checktype (L, 2, LUA_TTABLE);
+	int flags = 0;
+
+	lua_getfield (L, 2, "compact");
+	if (lua_toboolean (L, -1))
+	{
+		size_t i, num = lua_rawlen (L, 2);
+		for (i=1; i<=num; i++)
+		{
+			lua_rawgeti (L, 2, (int) i);
+			enum dns_type type = get_query_type (L, -1);
+			luaL_argcheck (L, type == DNS_T_A || type == DNS_T_AAAA, 2, "compact results only hold a and aaaa queries");
+			lua_pop (L, 1);
+		}
+		flags |= DNS_LOOKUP_COMPACT;
+	}
+	lua_pop (L, 1);
+
+	return begin_lookup (L, flags, 0);
+}
+/* }}} */
+
+/* {{{ mydns_query_many() */
+static int mydns_query_many (lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 2);
+
+	size_t concurrency = DNS_QUERY_MANY_CONCURRENCY;
+	lua_pushnil (L);
+	lua_pushvalue (L, 1);
+	if (lua_istable (L, 2))
+	{
+		lua_getfield (L, 2, "resolv_conf");
+		lua_getfield (L, 2, "hosts");
+		lua_getfield (L, 2, "timeout");
+		lua_getfield (L, 2, "concurrency");
+		if (!lua_isnil (L, -1))
+		{
+			lua_Integer n = luaL_checkinteger (L, -1);
+			concurrency = (size_t) (n > 0 ? n : 0);
+		}
+		lua_pop (L, 1);
+	}
+	else
+	{
+		lua_pushnil (L);
+		lua_pushnil (L);
+		lua_pushnil (L);
+	}
+	lua_remove (L, 1);
+	lua_remove (L, 1);
+
+	return begin_lookup (L, DNS_LOOKUP_MANY, concurrency);
+}
+/* }}} */
+
+/* {{{ mydns_resolve_mx_targets() */
+static int mydns_resolve_mx_targets (lua_State *L)
+{
+	/* Stack: domain, port, options, then the answers and errors of the MX
+	 * lookup, the exchangers list and the answers and errors of theirs. */
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		const char *domain = luaL_checkstring (L, 1);
+		lua_settop (L, 3);
+		lua_pushinteger (L, (lua_Integer) luaL_optint (L, 2, 25));
+		lua_replace (L, 2);
+
+		/* Ask for the domain's own addresses too, in case there is no MX. */
+		lua_pushcfunction (L, mydns_query_many);
+		lua_createtable (L, 3, 0);
+		lua_createtable (L, 2, 0);
+		lua_pushstring (L, domain);
+		lua_rawseti (L, -2, 1);
+		lua_pushliteral (L, "mx");
+		lua_rawseti (L, -2, 2);
+		lua_rawseti (L, -2, 1);
+		lua_createtable (L, 2, 0);
+		lua_pushstring (L, domain);
+		lua_rawseti (L, -2, 1);
+		lua_pushliteral (L, "aaaa");
+		lua_rawseti (L, -2, 2);
+		lua_rawseti (L, -2, 2);
+		lua_createtable (L, 2, 0);
+		lua_pushstring (L, domain);
+		lua_rawseti (L, -2, 1);
+		lua_pushliteral (L, "a");
+		lua_rawseti (L, -2, 2);
+		lua_rawseti (L, -2, 3);
+		lua_pushvalue (L, 3);
+		lua_callk (L, 2, 3, 1, mydns_resolve_mx_targets);
+		ctx = 1;
+	}
+
+	if (ctx == 1)
+	{
+		lua_rawgeti (L, 6, 1);
+		enum dns_reason reason = get_reason (L, -1);
+		lua_settop (L, 5);
+		lua_rawgeti (L, 4, 1);
+		lua_rawgeti (L, 5, 1);
+		if (lua_isnil (L, 6))
+		{
+			/* Without any MX records, the domain is its own exchanger (RFC 5321).
+			 * That only holds for an empty answer, a nonexistent domain or a
+			 * failed lookup is reported as is. */
+			if (reason != DNS_REASON_NODATA)
+			{
+				lua_pushstring (L, dns_reason_names[reason]);
+				return 3;
+			}
+
+			lua_settop (L, 5);
+			lua_createtable (L, 1, 0);
+			lua_createtable (L, 2, 0);
+			lua_pushvalue (L, 1);
+			lua_rawseti (L, -2, 1);
+			lua_pushinteger (L, 0);
+			lua_rawseti (L, -2, 2);
+			lua_rawseti (L, -2, 1);
+			return push_mx_targets (L, 6, 4, 5, 2);
+		}
+		lua_settop (L, 6);
+		int num = push_mx_hosts (L, 6);
+		lua_replace (L, 6);
+
+		/* A lone "." exchanger means the domain accepts no mail (RFC 7505). */
+		lua_rawgeti (L, 6, 1);
+		lua_rawgeti (L, -1, 1);
+		const char *first = lua_tostring (L, -1);
+		if (num == 1 && first && (0 == strcmp (first, ".") || 0 == strcmp (first, "")))
+		{
+			lua_pushnil (L);
+			lua_pushfstring (L, "%s does not accept mail", lua_tostring (L, 1));
+			return 2;
+		}
+		lua_settop (L, 6);
+
+		lua_pushcfunction (L, mydns_query_many);
+		push_mx_queries (L, 6);
+		lua_pushvalue (L, 3);
+		lua_callk (L, 2, 2, 2, mydns_resolve_mx_targets);
+	}
+
+	lua_settop (L, 8);
+	return push_mx_targets (L, 6, 7, 8, 1);
+}
+/* }}} */
+
+/* {{{ mydns_verify_ptr() */
+static int mydns_verify_ptr (lua_State *L)
+{
+	/* Stack: address, options, raw address, the answers and errors of the
+	 * PTR lookup, its names, then the answers and errors of theirs. */
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 2);
+		(void) push_verify_addr (L, 1);
+
+		if (verify_cacheable (L, 2) && cache_lookup_kind (L, lua_tostring (L, 1), DNS_VERIFY_PTR_KIND, NULL))
+			return 2;
+
+		lua_pushcfunction (L, mydns_query_many);
+		lua_createtable (L, 1, 0);
+		lua_createtable (L, 2, 0);
+		lua_pushvalue (L, 1);
+		lua_rawseti (L, -2, 1);
+		lua_pushliteral (L, "ptr");
+		lua_rawseti (L, -2, 2);
+		lua_rawseti (L, -2, 1);
+		lua_pushvalue (L, 2);
+		lua_callk (L, 2, 2, 1, mydns_verify_ptr);
+		ctx = 1;
+	}
+
+	const char *ip = lua_tostring (L, 1);
+	int family = (lua_rawlen (L, 3) == sizeof (struct in_addr) ? AF_INET : AF_INET6);
+	enum dns_type forward = (family == AF_INET ? DNS_T_A : DNS_T_AAAA);
+	size_t i, j, num;
+
+	if (ctx == 1)
+	{
+		lua_settop (L, 5);
+		lua_rawgeti (L, 4, 1);
+		if (lua_isnil (L, 6))
+		{
+			lua_rawgeti (L, 5, 1);
+			return verify_finish (L, cache_expires (L, ip, DNS_T_PTR));
+		}
+
+		/* Forward-confirm every name at once, each has to lead back to the address. */
+		num = lua_rawlen (L, 6);
+		if (num > DNS_VERIFY_PTR_MAX_NAMES)
+			num = DNS_VERIFY_PTR_MAX_NAMES;
+		lua_pushcfunction (L, mydns_query_many);
+		lua_createtable (L, (int) num, 0);
+		for (i=1; i<=num; i++)
+		{
+			lua_createtable (L, 2, 0);
+			lua_rawgeti (L, 6, (int) i);
+			lua_rawseti (L, -2, 1);
+			lua_pushstring (L, query_name (forward));
+			lua_rawseti (L, -2, 2);
+			lua_rawseti (L, -2, (int) i);
+		}
+		lua_pushvalue (L, 2);
+		lua_callk (L, 2, 2, 2, mydns_verify_ptr);
+	}
+
+	lua_settop (L, 8);
+	double expires = cache_expires (L, ip, DNS_T_PTR), all_expires = expires;
+	num = lua_rawlen (L, 6);
+	if (num > DNS_VERIFY_PTR_MAX_NAMES)
+		num = DNS_VERIFY_PTR_MAX_NAMES;
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, 6, (int) i);
+		double name_expires = cache_expires (L, lua_tostring (L, -1), forward);
+		all_expires = min_expires (all_expires, name_expires);
+
+		lua_rawgeti (L, 7, (int) i);
+		for (j=1; lua_istable (L, -1); j++)
+		{
+			lua_rawgeti (L, -1, (int) j);
+			void *addr = lua_touserdata (L, -1);
+			lua_pop (L, 1);
+			if (!addr)
+				break;
+			else if (0 == memcmp (addr, lua_tostring (L, 3), lua_rawlen (L, 3)))
+			{
+				lua_pop (L, 1);
+				lua_pushnil (L);
+				return verify_finish (L, min_expires (expires, name_expires));
+			}
+		}
+		lua_pop (L, 2);
+	}
+
+	lua_pushnil (L);
+	lua_pushfstring (L, "%s does not forward-confirm", ip);
+	return verify_finish (L, all_expires);
+}
+/* }}} */
+
+/* {{{ mydns_submit_query() */
+static int mydns_submit_query (lua_State *L)
+{
+	struct dns_resolver *res = get_dns_res (L, 1);
+	const char *data = luaL_checkstring (L, 2);
+	enum dns_type type = get_query_type (L, 3);
+
+	if (type == DNS_T_PTR)
+		data = ensure_arpa_string (L, 2);
+
+	int error = dns_res_submit (res, data, type, DNS_C_IN);
+	if (error)
+		return raise_dns_error (L, data, "dns_res_submit", error);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ mydns_is_query_done() */
+static int mydns_is_query_done (lua_State *L)
+{
+	struct dns_resolver *res = get_dns_res (L, 1);
+
+	int error = dns_res_check (res);
+	if (error != EAGAIN)
+		lua_pushboolean (L, 1);
+	else
+	{
+		lua_getuservalue (L, 1);
+		lua_getfield (L, -1, "expire_timeout");
+		double et = (double) lua_tonumber (L, -1);
+		lua_pop (L, 2);
+
 		double elapsed = (double) dns_res_elapsed (res);
 		if (elapsed >= et)
 		{
@@ -978,12 +3817,7 @@ static int mydns_is_query_done (lua_State *L)
 			return 2;
 		}
 		else
-		{
-			lua_pushinteger (L, tries+1);
-			lua_setfield (L, -2, "tries");
-			
 			lua_pushboolean (L, 0);
-		}
 	}
 
 	return 1;
@@ -1004,7 +3838,7 @@ static int mydns_parse_answer (lua_State *L)
 	if (query_timeout)
 	{
 		lua_pushnil (L);
-		lua_pushliteral (L, "Timed out.");
+		lua_pushliteral (L, DNS_TIMED_OUT);
 		return 2;
 	}
 
@@ -1016,34 +3850,313 @@ static int mydns_parse_answer (lua_State *L)
 		return 2;
 	}
 
-	lua_newtable (L);
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "cacheable");
+	int cacheable = lua_toboolean (L, -1);
+	lua_pop (L, 2);
 
-	int found = 0;
-	struct dns_rr rr;
-	dns_rr_foreach (&rr, answer, .sort = &dns_rr_i_packet)
+	int nret = push_answer_results (L, data, type, answer, cacheable, NULL);
+	free (answer);
+	return nret;
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ mydns_cache_stats() */
+static int mydns_cache_stats (lua_State *L)
+{
+	struct dns_answer_cache *cache = push_answer_cache (L);
+	lua_pop (L, 1);
+
+	lua_createtable (L, 0, 8);
+	lua_pushnumber (L, (lua_Number) cache->hits);
+	lua_setfield (L, -2, "hits");
+	lua_pushnumber (L, (lua_Number) cache->negative_hits);
+	lua_setfield (L, -2, "negative_hits");
+	lua_pushnumber (L, (lua_Number) cache->misses);
+	lua_setfield (L, -2, "misses");
+	lua_pushnumber (L, (lua_Number) cache->expired);
+	lua_setfield (L, -2, "expired");
+	lua_pushnumber (L, (lua_Number) cache->inserts);
+	lua_setfield (L, -2, "inserts");
+	lua_pushnumber (L, (lua_Number) cache->entries);
+	lua_setfield (L, -2, "entries");
+
+	lua_getfield (L, LUA_REGISTRYINDEX, DNS_CONFIG_REGISTRY_KEY);
+	struct dns_config_watch *watch = (struct dns_config_watch *) lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	lua_pushnumber (L, (lua_Number) (watch ? watch->reloads : 0));
+	lua_setfield (L, -2, "config_reloads");
+	lua_pushnumber (L, (lua_Number) (watch ? watch->failures : 0));
+	lua_setfield (L, -2, "config_reload_failures");
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ mydns_flush_cache() */
+static int mydns_flush_cache (lua_State *L)
+{
+	const char *name = luaL_optstring (L, 1, NULL);
+	lua_settop (L, 1);
+
+	if (!name)
 	{
-		if (DNS_S_ANSWER == rr.section && type == rr.type)
-			parse_rr (L, &rr, answer, ++found);
+		clear_answer_cache (L);
+		return 0;
 	}
 
-	if (!found)
+	struct dns_answer_cache *cache = push_answer_cache (L);
+
+	/* Drop every type cached for the name, keys are "name/TYPE". */
+	push_cache_key (L, name, DNS_T_A);
+	size_t prefix_len = lua_rawlen (L, -1) - strlen (query_name (DNS_T_A));
+	const char *prefix = lua_tostring (L, -1);
+
+	lua_pushnil (L);
+	while (lua_next (L, 2))
 	{
-		/* Check for specials. */
-		if (check_special (L, data, type))
-			lua_rawseti (L, -2, 1);
-		else
+		lua_pop (L, 1);
+		size_t len;
+		const char *key = lua_tolstring (L, -1, &len);
+		if (len > prefix_len && 0 == memcmp (key, prefix, prefix_len) && !strchr (key+prefix_len, '/'))
 		{
-			/* Query failed. */
+			lua_pushvalue (L, -1);
 			lua_pushnil (L);
-			lua_pushvalue (L, 2);
-			lua_pushliteral (L, " has no ");
-			lua_pushstring (L, query_name (type));
-			lua_pushliteral (L, " record");
-			lua_concat (L, 4);
-			return 2;
+			lua_rawset (L, 2);
+			cache->entries--;
 		}
 	}
-	
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ mydns_set_cache_options() */
+static int mydns_set_cache_options (lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTABLE);
+	struct dns_answer_cache *cache = push_answer_cache (L);
+	lua_pop (L, 1);
+
+	lua_getfield (L, 1, "enabled");
+	if (!lua_isnil (L, -1))
+		cache->enabled = lua_toboolean (L, -1);
+	lua_getfield (L, 1, "min_ttl");
+	cache->min_ttl = (double) luaL_optnumber (L, -1, (lua_Number) cache->min_ttl);
+	lua_getfield (L, 1, "max_ttl");
+	cache->max_ttl = (double) luaL_optnumber (L, -1, (lua_Number) cache->max_ttl);
+	lua_getfield (L, 1, "negative_ttl");
+	cache->negative_ttl = (double) luaL_optnumber (L, -1, (lua_Number) cache->negative_ttl);
+	lua_getfield (L, 1, "max_entries");
+	cache->max_entries = (size_t) luaL_optunsigned (L, -1, (lua_Unsigned) cache->max_entries);
+	lua_pop (L, 5);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ mydns_engine_stats() */
+static int mydns_engine_stats (lua_State *L)
+{
+	int ctx = 0;
+	if (LUA_OK == lua_getctx (L, &ctx))
+	{
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, mydns_engine_stats);
+	}
+
+	struct dns_engine none;
+	memset (&none, 0, sizeof (none));
+	none.fd = -1;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, DNS_ENGINE_REGISTRY_KEY);
+	lua_pushvalue (L, -2);
+	lua_rawget (L, -2);
+	struct dns_engine *engine = (struct dns_engine *) lua_touserdata (L, -1);
+	if (!engine)
+		engine = &none;
+
+	lua_createtable (L, 0, 15);
+	lua_pushinteger (L, (engine->fd >= 0 ? 1 : 0));
+	lua_setfield (L, -2, "sockets");
+	lua_pushnumber (L, (lua_Number) engine->in_flight);
+	lua_setfield (L, -2, "in_flight");
+	lua_pushnumber (L, (lua_Number) engine->lookups);
+	lua_setfield (L, -2, "lookups");
+	lua_pushnumber (L, (lua_Number) engine->sent);
+	lua_setfield (L, -2, "sent");
+	lua_pushnumber (L, (lua_Number) engine->retransmits);
+	lua_setfield (L, -2, "retransmits");
+	lua_pushnumber (L, (lua_Number) engine->responses);
+	lua_setfield (L, -2, "responses");
+	lua_pushnumber (L, (lua_Number) engine->mismatched);
+	lua_setfield (L, -2, "mismatched");
+	lua_pushnumber (L, (lua_Number) engine->truncated);
+	lua_setfield (L, -2, "truncated");
+	lua_pushnumber (L, (lua_Number) engine->server_failures);
+	lua_setfield (L, -2, "server_failures");
+	lua_pushnumber (L, (lua_Number) engine->timeouts);
+	lua_setfield (L, -2, "timeouts");
+	lua_pushnumber (L, (lua_Number) engine->hosts_answers);
+	lua_setfield (L, -2, "hosts_answers");
+	lua_pushnumber (L, (lua_Number) engine->coalesced);
+	lua_setfield (L, -2, "coalesced");
+	lua_pushnumber (L, (lua_Number) engine->port_changes);
+	lua_setfield (L, -2, "port_changes");
+	lua_pushnumber (L, (lua_Number) engine->handoffs);
+	lua_setfield (L, -2, "handoffs");
+	lua_pushnumber (L, (lua_Number) engine->abandoned);
+	lua_setfield (L, -2, "abandoned");
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ push_stub_records() */
+static int push_stub_records (lua_State *L, int index, const char *qname)
+{
+	/* Finds the addresses for a name, with or without its trailing dot. */
+	char key[DNS_D_MAXNAME + 1];
+	size_t i, len = strlen (qname);
+	for (i=0; i<len && i<DNS_D_MAXNAME; i++)
+		key[i] = (char) tolower ((unsigned char) qname[i]);
+	len = i;
+
+	lua_pushlstring (L, key, len);
+	lua_rawget (L, index);
+	if (lua_isnil (L, -1) && len > 1 && key[len-1] == '.')
+	{
+		lua_pop (L, 1);
+		lua_pushlstring (L, key, len-1);
+		lua_rawget (L, index);
+	}
+
+	return lua_istable (L, -1);
+}
+/* }}} */
+
+/* {{{ mydns_build_stub_answer() */
+static int mydns_build_stub_answer (lua_State *L)
+{
+	/* Answers a raw query from a table of name to address lists, for stub
+	 * servers in tests and benchmarks. */
+	size_t qlen, i;
+	const char *query = luaL_checklstring (L, 1, &qlen);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	lua_settop (L, 3);
+	int error = 0;
+
+	unsigned ttl = 60;
+	int truncate = 0;
+	int rcode = DNS_RC_NOERROR;
+	if (lua_istable (L, 3))
+	{
+		lua_getfield (L, 3, "ttl");
+		ttl = (unsigned) luaL_optinteger (L, -1, 60);
+		lua_getfield (L, 3, "truncate");
+		truncate = lua_toboolean (L, -1);
+		lua_getfield (L, 3, "rcode");
+		rcode = (int) luaL_optinteger (L, -1, DNS_RC_NOERROR);
+		lua_pop (L, 3);
+	}
+
+	if (qlen < 12 || qlen > DNS_ENGINE_RECV_SIZE)
+		return luaL_argerror (L, 1, "not a DNS query");
+	struct dns_packet *Q = dns_p_make (qlen, &error);
+	if (!Q)
+		return raise_dns_error (L, "ratchet.dns.stub.build_answer()", "dns_p_make", error);
+	memcpy (Q->data, query, qlen);
+	Q->end = qlen;
+
+	struct dns_rr rr;
+	char qname[DNS_D_MAXNAME + 1];
+	size_t qname_len = 0;
+	int found = 0;
+	dns_rr_foreach (&rr, Q, .section = DNS_S_QD)
+	{
+		qname_len = dns_d_expand (qname, sizeof (qname), rr.dn.p, Q, &error);
+		found = (qname_len > 0 && qname_len < sizeof (qname));
+		break;
+	}
+	if (!found)
+	{
+		free (Q);
+		return luaL_argerror (L, 1, "query has no question");
+	}
+
+	struct dns_packet *A = dns_p_make (DNS_ENGINE_RECV_SIZE, &error);
+	if (!A)
+	{
+		free (Q);
+		return raise_dns_error (L, "ratchet.dns.stub.build_answer()", "dns_p_make", error);
+	}
+	if ((error = dns_p_push (A, DNS_S_QD, qname, qname_len, rr.type, rr.class, 0, NULL)))
+	{
+		free (Q);
+		free (A);
+		return raise_dns_error (L, "ratchet.dns.stub.build_answer()", "dns_p_push", error);
+	}
+	dns_header (A)->qid = dns_header (Q)->qid;
+	dns_header (A)->rd = dns_header (Q)->rd;
+	dns_header (A)->qr = 1;
+	dns_header (A)->aa = 1;
+	dns_header (A)->ra = 1;
+	free (Q);
+
+	if (rcode != DNS_RC_NOERROR)
+		dns_header (A)->rcode = rcode;
+	else if (!push_stub_records (L, 2, qname))
+		dns_header (A)->rcode = DNS_RC_NXDOMAIN;
+	else if (truncate)
+		dns_header (A)->tc = 1;
+	else
+	{
+		for (i=1; ; i++)
+		{
+			lua_rawgeti (L, -1, (int) i);
+			const char *addr = lua_tostring (L, -1);
+			lua_pop (L, 1);
+			if (!addr)
+				break;
+
+			union dns_any any;
+			memset (&any, 0, sizeof (any));
+			if (rr.type == DNS_T_A && inet_pton (AF_INET, addr, &any.a.addr) > 0)
+				error = dns_p_push (A, DNS_S_AN, qname, qname_len, DNS_T_A, DNS_C_IN, ttl, &any);
+			else if (rr.type == DNS_T_AAAA && inet_pton (AF_INET6, addr, &any.aaaa.addr) > 0)
+				error = dns_p_push (A, DNS_S_AN, qname, qname_len, DNS_T_AAAA, DNS_C_IN, ttl, &any);
+			else
+				continue;
+
+			if (error)
+			{
+				/* Out of room, the client has to ask again over TCP. */
+				dns_header (A)->tc = 1;
+				break;
+			}
+		}
+	}
+
+	lua_pushlstring (L, (const char *) A->data, A->end);
+	free (A);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ luaopen_ratchet_dns_stub() */
+static int luaopen_ratchet_dns_stub (lua_State *L)
+{
+	/* Only tests and benchmarks load this, with require "ratchet.dns.stub". */
+	const luaL_Reg funcs[] = {
+		{"build_answer", mydns_build_stub_answer},
+		{NULL}
+	};
+
+	luaL_newlib (L, funcs);
+
 	return 1;
 }
 /* }}} */
@@ -1061,11 +4174,37 @@ int luaopen_ratchet_dns (lua_State *L)
 	lua_setfield (L, -2, "__index");
 	lua_pop (L, 1);
 
+	/* Methods of packed query_all() results. */
+	const luaL_Reg compact_meths[] = {
+		{"get_family", mydns_compact_get_family},
+		{"get_ttl", mydns_compact_get_ttl},
+		{"get_preference", mydns_compact_get_preference},
+		{"get_sockaddr", mydns_compact_get_sockaddr},
+		{NULL}
+	};
+
+	/* Set up metatable for packed query_all() results. */
+	luaL_newmetatable (L, "ratchet_dns_compact_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, compact_meths, 0);
+	lua_pushcclosure (L, mydns_compact_index, 1);
+	lua_setfield (L, -2, "__index");
+	lua_pushcfunction (L, mydns_compact_len);
+	lua_setfield (L, -2, "__len");
+	lua_pop (L, 1);
+
 	/* Static functions in the ratchet.dns namespace. */
 	const luaL_Reg funcs[] = {
 		/* Documented methods. */
 		{"query", mydns_query},
 		{"query_all", mydns_query_all},
+		{"query_many", mydns_query_many},
+		{"resolve_mx_targets", mydns_resolve_mx_targets},
+		{"verify_ptr", mydns_verify_ptr},
+		{"cache_stats", mydns_cache_stats},
+		{"flush_cache", mydns_flush_cache},
+		{"set_cache_options", mydns_set_cache_options},
+		{"engine_stats", mydns_engine_stats},
 		/* Undocumented, helper methods. */
 		{"new", mydns_new},
 		{NULL}
@@ -1116,6 +4255,46 @@ int luaopen_ratchet_dns (lua_State *L)
 	luaL_setfuncs (L, metameths, 0);
 	lua_pop (L, 1);
 
+	/* Methods for the per-event-loop resolver engine. */
+	const luaL_Reg engine_meths[] = {
+		{"get_fd", mydns_engine_get_fd},
+		{"get_timeout", mydns_engine_get_timeout},
+		{NULL}
+	};
+
+	/* Set up the resolver engine and lookup metatables. */
+	luaL_newmetatable (L, "ratchet_dns_engine_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, engine_meths, 0);
+	lua_setfield (L, -2, "__index");
+	lua_pushcfunction (L, mydns_engine_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+	luaL_newmetatable (L, "ratchet_dns_lookup_meta");
+	lua_pushcfunction (L, mydns_lookup_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+
+	/* Engines are keyed weakly on the ratchet object of their event loop. */
+	lua_newtable (L);
+	lua_createtable (L, 0, 1);
+	lua_pushliteral (L, "k");
+	lua_setfield (L, -2, "__mode");
+	lua_setmetatable (L, -2);
+	lua_setfield (L, LUA_REGISTRYINDEX, DNS_ENGINE_REGISTRY_KEY);
+
+	/* Set up the shared answer cache. */
+	struct dns_answer_cache *cache = (struct dns_answer_cache *) lua_newuserdata (L, sizeof (struct dns_answer_cache));
+	memset (cache, 0, sizeof (struct dns_answer_cache));
+	cache->enabled = 1;
+	cache->min_ttl = 0.0;
+	cache->max_ttl = 86400.0;
+	cache->negative_ttl = 300.0;
+	cache->max_entries = 10000;
+	lua_newtable (L);
+	lua_setuservalue (L, -2);
+	lua_setfield (L, LUA_REGISTRYINDEX, DNS_CACHE_REGISTRY_KEY);
+
 	/* Set up the ratchet.dns namespace functions. */
 	luaL_newlib (L, funcs);
 	lua_pushvalue (L, -1);
@@ -1128,6 +4307,20 @@ int luaopen_ratchet_dns (lua_State *L)
 	luaL_requiref (L, "ratchet.dns.hosts", luaopen_ratchet_dns_hosts, 0);
 	lua_setfield (L, -2, "hosts");
 
+	/* The stub nameserver helpers stay out of the namespace until required. */
+	luaL_getsubtable (L, LUA_REGISTRYINDEX, "_PRELOAD");
+	lua_pushcfunction (L, luaopen_ratchet_dns_stub);
+	lua_setfield (L, -2, "ratchet.dns.stub");
+	lua_pop (L, 1);
+
+	/* Watch the files behind the default resolv_conf and hosts objects. */
+	struct dns_config_watch *watch = (struct dns_config_watch *) lua_newuserdata (L, sizeof (struct dns_config_watch));
+	memset (watch, 0, sizeof (struct dns_config_watch));
+	watch->checked = cache_now ();
+	(void) stamp_config_file (DNS_RESOLV_CONF_PATH, &watch->resolv_conf);
+	(void) stamp_config_file (DNS_HOSTS_PATH, &watch->hosts);
+	lua_setfield (L, LUA_REGISTRYINDEX, DNS_CONFIG_REGISTRY_KEY);
+
 	return 1;
 }
 /* }}} */
@@ -27,6 +27,7 @@
 
 #include <math.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
@@ -87,6 +88,68 @@ static struct dns_hosts *load_hosts (lua_State *L, int index)
 }
 /* }}} */
 
+/* {{{ index_hosts_record() */
+static void index_hosts_record (lua_State *L, int index, const char *name, int type, const void *data, size_t len)
+{
+	/* Keys are lower-case and anchored, like the names queried for. */
+	char key[DNS_D_MAXNAME + 1];
+	size_t i, keylen = strlen (name);
+	if (keylen == 0 || keylen > DNS_D_MAXNAME)
+		return;
+
+	for (i=0; i<keylen; i++)
+		key[i] = (char) tolower ((unsigned char) name[i]);
+
+	lua_pushlstring (L, key, keylen);
+	lua_rawget (L, index);
+	if (lua_isnil (L, -1))
+	{
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushlstring (L, key, keylen);
+		lua_pushvalue (L, -2);
+		lua_rawset (L, index);
+	}
+
+	lua_rawgeti (L, -1, type);
+	if (lua_isnil (L, -1))
+	{
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushvalue (L, -1);
+		lua_rawseti (L, -3, type);
+	}
+
+	lua_pushlstring (L, (const char *) data, len);
+	lua_rawseti (L, -2, (int) lua_rawlen (L, -2) + 1);
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ index_hosts_entry() */
+struct hosts_indexer
+{
+	lua_State *L;
+	int index;
+};
+
+static int index_hosts_entry (void *arg, int af, const void *addr, const char *host, const char *arpa, _Bool alias)
+{
+	/* Files the entry's records the way dns_hosts_query() would answer them. */
+	struct hosts_indexer *indexer = (struct hosts_indexer *) arg;
+
+	if (af == AF_INET6)
+		index_hosts_record (indexer->L, indexer->index, host, DNS_T_AAAA, addr, sizeof (struct in6_addr));
+	else
+		index_hosts_record (indexer->L, indexer->index, host, DNS_T_A, addr, sizeof (struct in_addr));
+
+	if (!alias)
+		index_hosts_record (indexer->L, indexer->index, arpa, DNS_T_PTR, host, strlen (host));
+
+	return 0;
+}
+/* }}} */
+
 /* {{{ myhosts_new() */
 static int myhosts_new (lua_State *L)
 {
@@ -100,6 +163,14 @@ static int myhosts_new (lua_State *L)
 	luaL_getmetatable (L, "ratchet_dns_hosts_meta");
 	lua_setmetatable (L, -2);
 
+	/* Index the parsed entries by name, so lookups are a table hit. */
+	struct hosts_indexer indexer = {L, 4};
+	lua_createtable (L, 0, 1);
+	lua_newtable (L);
+	(void) dns_hosts_walk (*new, index_hosts_entry, &indexer);
+	lua_setfield (L, -2, "index");
+	lua_setuservalue (L, 2);
+
 	return 1;
 }
 /* }}} */
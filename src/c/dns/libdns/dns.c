@@ -3450,6 +3450,19 @@ int dns_hosts_dump(struct dns_hosts *hosts, FILE *fp) {
 } /* dns_hosts_dump() */
 
 
+int dns_hosts_walk(struct dns_hosts *hosts, dns_hosts_walk_t *fn, void *arg) {
+	struct dns_hosts_entry *ent;
+	int error;
+
+	for (ent = hosts->head; ent; ent = ent->next) {
+		if ((error = fn(arg, ent->af, &ent->addr, ent->host, ent->arpa, ent->alias)))
+			return error;
+	}
+
+	return 0;
+} /* dns_hosts_walk() */
+
+
 int dns_hosts_insert(struct dns_hosts *hosts, int af, const void *addr, const void *host, _Bool alias) {
 	struct dns_hosts_entry *ent;
 	int error;
@@ -782,6 +782,10 @@ int dns_hosts_loadpath(struct dns_hosts *, const char *);
 
 int dns_hosts_dump(struct dns_hosts *, FILE *);
 
+typedef int dns_hosts_walk_t(void *, int, const void *, const char *, const char *, _Bool);
+
+int dns_hosts_walk(struct dns_hosts *, dns_hosts_walk_t *, void *);
+
 int dns_hosts_insert(struct dns_hosts *, int, const void *, const void *, _Bool);
 
 struct dns_packet *dns_hosts_query(struct dns_hosts *, struct dns_packet *, int *);
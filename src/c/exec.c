@@ -19,6 +19,7 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include "config.h"
 
 #include <lua.h>
@@ -30,12 +31,21 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <signal.h>
 #include <math.h>
 #include <netdb.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#if HAVE_POSIX_SPAWNP
+#include <spawn.h>
+#endif
 
 #include "ratchet.h"
 #include "misc.h"
@@ -44,20 +54,95 @@ typedef void (*signal_handler) (int);
 
 #define CHECK_SIG_NAME(L, i, s) if (0 == strcmp (#s, lua_tostring (L, i))) { sig = s; }
 
+#define EXEC_READ_SIZE 65536
+#define EXEC_MAX_RLIMITS 8
+#define EXEC_STATS_REGISTRY_KEY "ratchet_exec_stats"
+
+/* Stack slots of a thread running communicate(). */
+#define COMM_SELF 1
+#define COMM_SOURCE 2
+#define COMM_OPTIONS 3
+#define COMM_STDOUT 4
+#define COMM_STDERR 5
+#define COMM_PENDING 6
+#define COMM_OFFSET 7
+#define COMM_OUTPUT 8
+#define COMM_LIMITED 9
+#define COMM_TOP 9
+
+/* Continuation contexts of communicate(). */
+#define COMM_STARTED 1
+#define COMM_TOOK_CHUNK 2
+#define COMM_DELIVERED 3
+#define COMM_WAITED 4
+#define COMM_REAPED 5
+
+extern char **environ;
+
+static int rexec_communicate (lua_State *L);
+static int communicate_finish (lua_State *L);
+
 /* {{{ struct rexec_state */
 struct rexec_state
 {
 	pid_t pid;
+	int pidfd;
+	double wait_timeout;
+	double started;
 	int infds[2];
 	int outfds[2];
 	int errfds[2];
 };
 /* }}} */
 
+/* {{{ struct rexec_stats */
+struct rexec_stats
+{
+	unsigned long spawned;
+	unsigned long spawn_failures;
+	unsigned long running;
+	unsigned long exited;
+	unsigned long signaled;
+	double utime;
+	double stime;
+	double wall;
+	long max_maxrss;
+};
+/* }}} */
+
+/* {{{ get_exec_stats() */
+static struct rexec_stats *get_exec_stats (lua_State *L)
+{
+	lua_getfield (L, LUA_REGISTRYINDEX, EXEC_STATS_REGISTRY_KEY);
+	struct rexec_stats *stats = (struct rexec_stats *) lua_touserdata (L, -1);
+	lua_pop (L, 1);
+
+	return stats;
+}
+/* }}} */
+
+/* {{{ monotonic_now() */
+static double monotonic_now (void)
+{
+	struct timespec ts;
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+	return fromtimespec (&ts);
+}
+/* }}} */
+
+/* {{{ timeval_seconds() */
+static double timeval_seconds (struct timeval *tv)
+{
+	return (double) tv->tv_sec + (double) tv->tv_usec / 1000000.0;
+}
+/* }}} */
+
 /* {{{ clear_state() */
 static void clear_state (struct rexec_state *state)
 {
 	memset (state, 0, sizeof (struct rexec_state));
+	state->pidfd = -1;
 	state->infds[0] = -1;
 	state->infds[1] = -1;
 	state->outfds[0] = -1;
@@ -111,53 +196,454 @@ static void free_argv_array (char **array)
 }
 /* }}} */
 
-/* {{{ start_process() */
-static int start_process (lua_State *L, struct rexec_state *state, char *const *argv)
+/* {{{ open_cloexec_pipe() */
+static int open_cloexec_pipe (int fds[2])
 {
-	if (-1 == pipe (state->infds))
-		return ratchet_error_errno (L, "ratchet.exec.start()", "pipe");
-	if (-1 == pipe (state->outfds))
-		return ratchet_error_errno (L, "ratchet.exec.start()", "pipe");
-	if (-1 == pipe (state->errfds))
-		return ratchet_error_errno (L, "ratchet.exec.start()", "pipe");
+#if HAVE_PIPE2
+	return pipe2 (fds, O_CLOEXEC);
+#else
+	if (-1 == pipe (fds))
+		return -1;
+	set_closeonexec (fds[0]);
+	set_closeonexec (fds[1]);
+	return 0;
+#endif
+}
+/* }}} */
+
+/* {{{ open_pipe() */
+static int open_pipe (int fds[2], int parent_end)
+{
+	/* Only the parent's end is non-blocking, the child gets a normal stdio
+	 * descriptor. Both are close-on-exec, the child's end is dup2()'ed. */
+	if (-1 == open_cloexec_pipe (fds))
+		return -1;
+	return set_nonblocking (fds[parent_end]);
+}
+/* }}} */
+
+/* {{{ close_pipes() */
+static void close_pipes (struct rexec_state *state)
+{
+	int *fds[] = {state->infds, state->outfds, state->errfds};
+	int i;
+	for (i=0; i<6; i++)
+	{
+		if (fds[i/2][i%2] >= 0)
+			close (fds[i/2][i%2]);
+		fds[i/2][i%2] = -1;
+	}
+}
+/* }}} */
+
+#if HAVE_POSIX_SPAWNP
+#define SPAWN_CALL "posix_spawnp"
 
+/* {{{ spawn_process() */
+static int spawn_process (struct rexec_state *state, char *const *argv)
+{
+	/* The glibc posix_spawn() shares the address space with the child until
+	 * it calls exec, so it costs the same however large the Lua heap is. */
+	posix_spawn_file_actions_t actions;
+	int error = posix_spawn_file_actions_init (&actions);
+	if (error)
+		return error;
+
+	if (!(error = posix_spawn_file_actions_adddup2 (&actions, state->infds[0], STDIN_FILENO))
+	 && !(error = posix_spawn_file_actions_adddup2 (&actions, state->outfds[1], STDOUT_FILENO))
+	 && !(error = posix_spawn_file_actions_adddup2 (&actions, state->errfds[1], STDERR_FILENO)))
+		error = posix_spawnp (&state->pid, argv[0], &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy (&actions);
+	return error;
+}
+/* }}} */
+#else
+#define SPAWN_CALL "fork"
+
+/* {{{ spawn_process() */
+static int spawn_process (struct rexec_state *state, char *const *argv)
+{
 	pid_t pid = fork ();
+	if (pid == -1)
+		return errno;
 
 	if (pid == 0)
 	{
-		close (state->infds[1]);
-		close (state->outfds[0]);
-		close (state->errfds[0]);
-		close (STDIN_FILENO);
-		close (STDOUT_FILENO);
-		close (STDERR_FILENO);
 		if (-1 == dup2 (state->infds[0], STDIN_FILENO))
 			_exit (1);
-		close (state->infds[0]);
 		if (-1 == dup2 (state->outfds[1], STDOUT_FILENO))
 			_exit (1);
-		close (state->outfds[1]);
 		if (-1 == dup2 (state->errfds[1], STDERR_FILENO))
 			_exit (1);
-		close (state->errfds[1]);
 
-		if (-1 == execvp (argv[0], argv))
-			_exit (1);
+		execvp (argv[0], argv);
+		_exit (1);
+	}
+
+	state->pid = pid;
+	return 0;
+}
+/* }}} */
+#endif
+
+/* {{{ open_pidfd() */
+static int open_pidfd (pid_t pid)
+{
+	/* A pidfd is readable once its process exits, so each waiting thread can
+	 * watch its own child rather than every thread waking on any SIGCHLD. */
+#ifdef SYS_pidfd_open
+	return (int) syscall (SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+/* }}} */
+
+/* {{{ push_rusage() */
+static void push_rusage (lua_State *L, struct rusage *usage)
+{
+	lua_createtable (L, 0, 8);
+	lua_pushnumber (L, (lua_Number) timeval_seconds (&usage->ru_utime));
+	lua_setfield (L, -2, "utime");
+	lua_pushnumber (L, (lua_Number) timeval_seconds (&usage->ru_stime));
+	lua_setfield (L, -2, "stime");
+	lua_pushinteger (L, (lua_Integer) usage->ru_maxrss);
+	lua_setfield (L, -2, "maxrss");
+	lua_pushinteger (L, (lua_Integer) usage->ru_minflt);
+	lua_setfield (L, -2, "minflt");
+	lua_pushinteger (L, (lua_Integer) usage->ru_majflt);
+	lua_setfield (L, -2, "majflt");
+	lua_pushinteger (L, (lua_Integer) usage->ru_nvcsw);
+	lua_setfield (L, -2, "nvcsw");
+	lua_pushinteger (L, (lua_Integer) usage->ru_nivcsw);
+	lua_setfield (L, -2, "nivcsw");
+}
+/* }}} */
+
+/* {{{ get_rlimit_resource() */
+static int get_rlimit_resource (const char *name)
+{
+	static const char *lst[] = {
+		"as",
+		"core",
+		"cpu",
+		"data",
+		"fsize",
+		"nofile",
+		"nproc",
+		"stack",
+		NULL
+	};
+	static const int resources[] = {
+		RLIMIT_AS,
+		RLIMIT_CORE,
+		RLIMIT_CPU,
+		RLIMIT_DATA,
+		RLIMIT_FSIZE,
+		RLIMIT_NOFILE,
+		RLIMIT_NPROC,
+		RLIMIT_STACK
+	};
+
+	int i;
+	for (i=0; lst[i]; i++)
+		if (!strcasecmp (lst[i], name))
+			return resources[i];
+
+	return -1;
+}
+/* }}} */
+
+/* {{{ struct rexec_limits */
+struct rexec_limits
+{
+	int any;
+	int num_rlimits;
+	int resources[EXEC_MAX_RLIMITS];
+	struct rlimit rlimits[EXEC_MAX_RLIMITS];
+	int has_cpus;
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+#endif
+	char cgroup_procs[4096];
+};
+/* }}} */
+
+/* Steps of the forked child that may fail, reported back to the parent. */
+enum limit_step
+{
+	LIMIT_DONE = 0,
+	LIMIT_DUP2,
+	LIMIT_OPEN,
+	LIMIT_WRITE,
+	LIMIT_SETRLIMIT,
+	LIMIT_SCHED_SETAFFINITY,
+	LIMIT_EXECVP
+};
+
+static const char *limit_step_calls[] = {
+	NULL,
+	"dup2",
+	"open",
+	"write",
+	"setrlimit",
+	"sched_setaffinity",
+	"execvp"
+};
+
+/* {{{ read_rlimit_value() */
+static rlim_t read_rlimit_value (lua_State *L, int index, int arg)
+{
+	/* "unlimited" and math.huge, or anything past the largest limit, mean
+	 * RLIM_INFINITY. Converting those to rlim_t directly is undefined. */
+	if (lua_type (L, index) == LUA_TSTRING && 0 == strcmp ("unlimited", lua_tostring (L, index)))
+		return RLIM_INFINITY;
+
+	lua_Number value = lua_tonumber (L, index);
+	luaL_argcheck (L, lua_type (L, index) == LUA_TNUMBER && value >= 0, arg, "rlimits must be non-negative numbers or \"unlimited\"");
+	if (value >= (lua_Number) RLIM_INFINITY)
+		return RLIM_INFINITY;
+
+	return (rlim_t) value;
+}
+/* }}} */
+
+/* {{{ read_rlimits() */
+static void read_rlimits (lua_State *L, struct rexec_limits *limits, int index, int arg)
+{
+	/* Each limit is one value for both soft and hard, or {soft, hard}. */
+	for (lua_pushnil (L); lua_next (L, index); lua_pop (L, 1))
+	{
+		int resource = (lua_type (L, -2) == LUA_TSTRING ? get_rlimit_resource (lua_tostring (L, -2)) : -1);
+		if (resource < 0)
+		{
+			lua_pushfstring (L, "unknown rlimit: %s", luaL_tolstring (L, -2, NULL));
+			luaL_argerror (L, arg, lua_tostring (L, -1));
+		}
+		luaL_argcheck (L, limits->num_rlimits < EXEC_MAX_RLIMITS, arg, "too many rlimits");
+
+		struct rlimit *rl = &limits->rlimits[limits->num_rlimits];
+		if (lua_istable (L, -1))
+		{
+			lua_rawgeti (L, -1, 1);
+			lua_rawgeti (L, -2, 2);
+			rl->rlim_cur = read_rlimit_value (L, -2, arg);
+			rl->rlim_max = (lua_isnil (L, -1) ? rl->rlim_cur : read_rlimit_value (L, -1, arg));
+			lua_pop (L, 2);
+			luaL_argcheck (L, rl->rlim_cur <= rl->rlim_max, arg, "soft rlimit is above the hard rlimit");
+		}
+		else
+			rl->rlim_cur = rl->rlim_max = read_rlimit_value (L, -1, arg);
+
+		limits->resources[limits->num_rlimits++] = resource;
+	}
+}
+/* }}} */
+
+/* {{{ read_affinity() */
+static void read_affinity (lua_State *L, struct rexec_limits *limits, int index, int arg)
+{
+#if HAVE_SCHED_SETAFFINITY
+	CPU_ZERO (&limits->cpus);
+
+	size_t i, num = lua_rawlen (L, index);
+	for (i=1; i<=num; i++)
+	{
+		lua_rawgeti (L, index, (int) i);
+		int isnum = 0;
+		lua_Integer cpu = lua_tointegerx (L, -1, &isnum);
+		lua_pop (L, 1);
+		luaL_argcheck (L, isnum && cpu >= 0 && cpu < CPU_SETSIZE, arg, "cpus must be CPU numbers");
+		CPU_SET ((int) cpu, &limits->cpus);
+	}
+
+	limits->has_cpus = 1;
+#else
+	luaL_argerror (L, arg, "cpus are not supported on this system");
+#endif
+}
+/* }}} */
+
+/* {{{ read_limits() */
+static void read_limits (lua_State *L, struct rexec_limits *limits, int options)
+{
+	/* Everything the child needs is gathered and checked up front, after
+	 * fork() it may only make async-signal-safe calls. */
+	int top = lua_gettop (L);
+	memset (limits, 0, sizeof (struct rexec_limits));
+
+	lua_getfield (L, options, "cgroup");
+	if (!lua_isnil (L, -1))
+	{
+		/* A cgroup-v2 directory, e.g. under /sys/fs/cgroup. */
+		luaL_argcheck (L, lua_type (L, -1) == LUA_TSTRING, options, "cgroup must be a string");
+		size_t len = (size_t) snprintf (limits->cgroup_procs, sizeof (limits->cgroup_procs), "%s/cgroup.procs", lua_tostring (L, -1));
+		luaL_argcheck (L, len < sizeof (limits->cgroup_procs), options, "cgroup path is too long");
+		limits->any = 1;
+	}
+
+	lua_getfield (L, options, "rlimits");
+	if (!lua_isnil (L, -1))
+	{
+		luaL_argcheck (L, lua_istable (L, -1), options, "rlimits must be a table");
+		read_rlimits (L, limits, lua_gettop (L), options);
+		limits->any = 1;
+	}
+
+	lua_getfield (L, options, "cpus");
+	if (!lua_isnil (L, -1))
+	{
+		luaL_argcheck (L, lua_istable (L, -1), options, "cpus must be a table");
+		read_affinity (L, limits, lua_gettop (L), options);
+		limits->any = 1;
+	}
+
+	lua_settop (L, top);
+}
+/* }}} */
+
+/* {{{ apply_limits() */
+static enum limit_step apply_limits (struct rexec_limits *limits)
+{
+	/* Runs in the forked child, moving it into its cgroup and limiting it
+	 * before the command is executed. */
+	int i;
+
+	if (limits->cgroup_procs[0])
+	{
+		char buf[24], *p = buf + sizeof (buf);
+		pid_t pid = getpid ();
+		do
+		{
+			*--p = (char) ('0' + pid % 10);
+			pid /= 10;
+		} while (pid > 0);
+
+		int fd = open (limits->cgroup_procs, O_WRONLY | O_CLOEXEC);
+		if (fd == -1)
+			return LIMIT_OPEN;
+		size_t len = (size_t) (buf + sizeof (buf) - p);
+		if (write (fd, p, len) != (ssize_t) len)
+			return LIMIT_WRITE;
+		close (fd);
+	}
+
+	for (i=0; i<limits->num_rlimits; i++)
+		if (-1 == setrlimit (limits->resources[i], &limits->rlimits[i]))
+			return LIMIT_SETRLIMIT;
+
+#if HAVE_SCHED_SETAFFINITY
+	if (limits->has_cpus && -1 == sched_setaffinity (0, sizeof (cpu_set_t), &limits->cpus))
+		return LIMIT_SCHED_SETAFFINITY;
+#endif
+
+	return LIMIT_DONE;
+}
+/* }}} */
+
+/* {{{ spawn_limited() */
+static const char *spawn_limited (struct rexec_state *state, char *const *argv, struct rexec_limits *limits)
+{
+	/* posix_spawn() has no place to apply limits before the exec, so the
+	 * child is forked and applies them itself. It reports a failed step and
+	 * its errno over a close-on-exec pipe, which reads empty once the exec
+	 * succeeded. Returns the name of the failed call, with errno set. */
+	int report_fds[2], report[2];
+	if (-1 == open_cloexec_pipe (report_fds))
+		return "pipe";
+
+	pid_t pid = fork ();
+	if (pid == -1)
+	{
+		int orig_errno = errno;
+		close (report_fds[0]);
+		close (report_fds[1]);
+		errno = orig_errno;
+		return "fork";
+	}
+
+	if (pid == 0)
+	{
+		close (report_fds[0]);
+		if (-1 == dup2 (state->infds[0], STDIN_FILENO)
+		 || -1 == dup2 (state->outfds[1], STDOUT_FILENO)
+		 || -1 == dup2 (state->errfds[1], STDERR_FILENO))
+			report[0] = LIMIT_DUP2;
+		else if (LIMIT_DONE == (report[0] = apply_limits (limits)))
+		{
+			execvp (argv[0], argv);
+			report[0] = LIMIT_EXECVP;
+		}
+		report[1] = errno;
+		(void) write (report_fds[1], report, sizeof (report));
+		_exit (127);
 	}
 
+	close (report_fds[1]);
+	ssize_t n;
+	do
+		n = read (report_fds[0], report, sizeof (report));
+	while (n == -1 && errno == EINTR);
+	close (report_fds[0]);
+
+	if (n == (ssize_t) sizeof (report))
+	{
+		waitpid (pid, NULL, 0);
+		errno = report[1];
+		return limit_step_calls[report[0]];
+	}
+
+	state->pid = pid;
+	return NULL;
+}
+/* }}} */
+
+/* {{{ start_process() */
+static const char *start_process (struct rexec_state *state, char *const *argv, struct rexec_limits *limits)
+{
+	/* Returns the name of the failed call, with errno set, or NULL. */
+	if (-1 == open_pipe (state->infds, 1) || -1 == open_pipe (state->outfds, 0) || -1 == open_pipe (state->errfds, 0))
+	{
+		int orig_errno = errno;
+		close_pipes (state);
+		errno = orig_errno;
+		return "pipe";
+	}
+
+	const char *failed = NULL;
+	if (limits)
+		failed = spawn_limited (state, argv, limits);
 	else
 	{
-		close (state->infds[0]);
-		close (state->outfds[1]);
-		close (state->errfds[1]);
-		set_nonblocking (state->infds[1]);
-		set_nonblocking (state->outfds[0]);
-		set_nonblocking (state->errfds[0]);
+		int error = spawn_process (state, argv);
+		if (error)
+		{
+			errno = error;
+			failed = SPAWN_CALL;
+		}
+	}
+	int orig_errno = errno;
 
-		state->pid = pid;
+	close (state->infds[0]);
+	close (state->outfds[1]);
+	close (state->errfds[1]);
+	state->infds[0] = -1;
+	state->outfds[1] = -1;
+	state->errfds[1] = -1;
+
+	if (failed)
+	{
+		close_pipes (state);
+		state->pid = 0;
+		errno = orig_errno;
+		return failed;
 	}
 
-	return 0;
+	state->pidfd = open_pidfd (state->pid);
+
+	return NULL;
 }
 /* }}} */
 
@@ -219,6 +705,8 @@ static int enable_sigchld (lua_State *L)
 static int rexec_new (lua_State *L)
 {
 	luaL_checktype (L, 1, LUA_TTABLE);
+	if (!lua_isnoneornil (L, 2))
+		luaL_checktype (L, 2, LUA_TTABLE);
 
 	struct rexec_state *state = (struct rexec_state *) lua_newuserdata (L, sizeof (struct rexec_state));
 	clear_state (state);
@@ -226,15 +714,53 @@ static int rexec_new (lua_State *L)
 	luaL_getmetatable (L, "ratchet_exec_meta");
 	lua_setmetatable (L, -2);
 
-	lua_newtable (L);
+	lua_createtable (L, 0, 2);
 	lua_pushvalue (L, 1);
 	lua_setfield (L, -2, "argv");
+	if (lua_istable (L, 2))
+	{
+		struct rexec_limits *limits = (struct rexec_limits *) lua_newuserdata (L, sizeof (struct rexec_limits));
+		read_limits (L, limits, 2);
+		if (limits->any)
+			lua_setfield (L, -2, "limits");
+		else
+			lua_pop (L, 1);
+	}
 	lua_setuservalue (L, -2);
 
 	return 1;
 }
 /* }}} */
 
+/* {{{ rexec_stats() */
+static int rexec_stats (lua_State *L)
+{
+	struct rexec_stats *stats = get_exec_stats (L);
+
+	lua_createtable (L, 0, 9);
+	lua_pushinteger (L, (lua_Integer) stats->spawned);
+	lua_setfield (L, -2, "spawned");
+	lua_pushinteger (L, (lua_Integer) stats->spawn_failures);
+	lua_setfield (L, -2, "spawn_failures");
+	lua_pushinteger (L, (lua_Integer) stats->running);
+	lua_setfield (L, -2, "running");
+	lua_pushinteger (L, (lua_Integer) stats->exited);
+	lua_setfield (L, -2, "exited");
+	lua_pushinteger (L, (lua_Integer) stats->signaled);
+	lua_setfield (L, -2, "signaled");
+	lua_pushnumber (L, (lua_Number) stats->utime);
+	lua_setfield (L, -2, "utime");
+	lua_pushnumber (L, (lua_Number) stats->stime);
+	lua_setfield (L, -2, "stime");
+	lua_pushnumber (L, (lua_Number) stats->wall);
+	lua_setfield (L, -2, "wall");
+	lua_pushinteger (L, (lua_Integer) stats->max_maxrss);
+	lua_setfield (L, -2, "max_maxrss");
+
+	return 1;
+}
+/* }}} */
+
 /* ---- Member Functions ---------------------------------------------------- */
 
 /* {{{ rexec_clean_up() */
@@ -247,8 +773,13 @@ static int rexec_clean_up (lua_State *L)
 	state->infds[1] = -1;
 	state->outfds[0] = -1;
 	state->errfds[0] = -1;
+	if (state->pidfd >= 0) close (state->pidfd);
+	state->pidfd = -1;
 	if (state->pid > 0)
+	{
 		waitpid (state->pid, NULL, WNOHANG);
+		get_exec_stats (L)->running--;
+	}
 	state->pid = 0;
 	return 0;
 }
@@ -270,9 +801,23 @@ static int rexec_start (lua_State *L)
 	struct rexec_state *state = (struct rexec_state *) luaL_checkudata (L, 1, "ratchet_exec_meta");
 
 	time_t start_time = time (NULL);
+	struct rexec_stats *stats = get_exec_stats (L);
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "limits");
+	struct rexec_limits *limits = (struct rexec_limits *) lua_touserdata (L, -1);
+	lua_pop (L, 2);
+
 	char **argv = alloc_argv_array (L, 1);
-	start_process (L, state, argv);
+	const char *failed = start_process (state, argv, limits);
 	free_argv_array (argv);
+	if (failed)
+	{
+		stats->spawn_failures++;
+		return ratchet_error_errno (L, "ratchet.exec.start()", failed);
+	}
+	state->started = monotonic_now ();
+	stats->spawned++;
+	stats->running++;
 
 	lua_getuservalue (L, 1);
 
@@ -369,245 +914,406 @@ static int rexec_wait (lua_State *L)
 	lua_settop (L, 2);
 
 	int status = 0;
-	pid_t ret = waitpid (state->pid, &status, WNOHANG);
+	struct rusage usage;
+	memset (&usage, 0, sizeof (struct rusage));
+	pid_t ret = wait4 (state->pid, &status, WNOHANG, &usage);
 	if (ret == -1)
-		return ratchet_error_errno (L, "ratchet.exec.wait()", "waitpid");
+		return ratchet_error_errno (L, "ratchet.exec.wait()", "wait4");
 	else if (0 == ret)
 	{
 		if (timed_out)
 			return ratchet_error_str (L, "ratchet.exec.wait()", "ETIMEDOUT", "Timed out on wait.");
 
+		if (state->pidfd >= 0)
+		{
+			state->wait_timeout = (double) luaL_optnumber (L, 2, -1.0);
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_pushvalue (L, 1);
+			return lua_yieldk (L, 2, 1, rexec_wait);
+		}
+
+		/* Without pidfds, every waiting thread wakes on any SIGCHLD. */
 		lua_pushlightuserdata (L, RATCHET_YIELD_SIGNAL);
 		lua_pushinteger (L, SIGCHLD);
 		lua_pushvalue (L, 2);
 		return lua_yieldk (L, 3, 1, rexec_wait);
 	}
 
+	double wall = monotonic_now () - state->started;
+	struct rexec_stats *stats = get_exec_stats (L);
+	stats->running--;
+	if (WIFSIGNALED (status))
+		stats->signaled++;
+	else
+		stats->exited++;
+	stats->utime += timeval_seconds (&usage.ru_utime);
+	stats->stime += timeval_seconds (&usage.ru_stime);
+	stats->wall += wall;
+	if (usage.ru_maxrss > stats->max_maxrss)
+		stats->max_maxrss = usage.ru_maxrss;
+
 	state->pid = 0;
 	rexec_clean_up (L);
 
 	lua_pushinteger (L, (lua_Integer) WEXITSTATUS (status));
 	lua_pushboolean (L, WIFEXITED (status));
-	return 2;
+	push_rusage (L, &usage);
+	lua_pushnumber (L, (lua_Number) wall);
+	lua_setfield (L, -2, "wall");
+	return 3;
 }
 /* }}} */
 
-/* {{{ rexec_communicate() */
-static int rexec_communicate (lua_State *L)
+/* {{{ rexec_get_fd() */
+static int rexec_get_fd (lua_State *L)
 {
-	(void) luaL_checkudata (L, 1, "ratchet_exec_meta");
-	int ctx = 0;
+	struct rexec_state *state = (struct rexec_state *) luaL_checkudata (L, 1, "ratchet_exec_meta");
+	lua_pushinteger (L, state->pidfd);
+	return 1;
+}
+/* }}} */
 
-	lua_getctx (L, &ctx);
+/* {{{ rexec_get_timeout() */
+static int rexec_get_timeout (lua_State *L)
+{
+	struct rexec_state *state = (struct rexec_state *) luaL_checkudata (L, 1, "ratchet_exec_meta");
+	lua_pushnumber (L, (lua_Number) state->wait_timeout);
+	return 1;
+}
+/* }}} */
 
-	const char *data = NULL;
-	if (ctx <= 2)
-		data = luaL_optstring (L, 2, NULL);
+/* {{{ communicate_deliver() */
+static void communicate_deliver (lua_State *L, int sink, const char *data, size_t len)
+{
+	/* Function sinks are called by communicate_step(), to allow yielding. */
+	lua_pushlstring (L, data, len);
+	lua_rawseti (L, sink, (int) lua_rawlen (L, sink) + 1);
+}
+/* }}} */
 
-top:
+/* {{{ communicate_take_chunk() */
+static void communicate_take_chunk (lua_State *L)
+{
+	/* Moves the chunk on top, returned by the input function, into place. */
+	struct rexec_state *state = (struct rexec_state *) lua_touserdata (L, COMM_SELF);
 
-	if (ctx == 0)
+	if (lua_isstring (L, -1))
 	{
-		lua_settop (L, 2);
-		lua_pushliteral (L, "");
-		lua_pushliteral (L, "");
-
-		lua_getfield (L, 1, "start");
-		lua_pushvalue (L, 1);
-		lua_callk (L, 1, 0, 1, rexec_communicate);
-		ctx = 1;
-		goto top;
+		lua_replace (L, COMM_PENDING);
+		lua_pushinteger (L, 0);
+		lua_replace (L, COMM_OFFSET);
 	}
-
-	else if (ctx == 1)
+	else
 	{
-		if (data)
-		{
-			lua_getuservalue (L, 1);
-			lua_getfield (L, -1, "stdin");
-			lua_remove (L, -2);
-			lua_getfield (L, -1, "write");
-			lua_insert (L, -2);
-			lua_pushvalue (L, 2);
-			lua_callk (L, 2, 1, 2, rexec_communicate);
-			ctx = 2;
-			goto top;
-		}
-		else
-		{
-			ctx = 2;
-			goto top;
-		}
+		/* End of input. */
+		lua_pop (L, 1);
+		if (state->infds[1] >= 0)
+			close (state->infds[1]);
+		state->infds[1] = -1;
 	}
+}
+/* }}} */
+
+/* {{{ communicate_write() */
+static int communicate_write (lua_State *L)
+{
+	/* Returns 1 if stdin is waiting to be writable. */
+	struct rexec_state *state = (struct rexec_state *) lua_touserdata (L, COMM_SELF);
+	size_t len;
+	const char *data = lua_tolstring (L, COMM_PENDING, &len);
+	size_t offset = (size_t) lua_tointeger (L, COMM_OFFSET);
 
-	else if (ctx == 2)
+	signal_handler old = signal (SIGPIPE, SIG_IGN);
+	ssize_t ret = write (state->infds[1], data+offset, len-offset);
+	int orig_errno = errno;
+	signal (SIGPIPE, old);
+
+	if (ret == -1)
 	{
-		if (!lua_isnil (L, -1))
+		if (orig_errno == EAGAIN || orig_errno == EWOULDBLOCK)
+			return 1;
+		else if (orig_errno != EPIPE)
 		{
-			lua_replace (L, 2);
-			data = lua_tostring (L, 2);
-			ctx = 1;
-			goto top;
+			errno = orig_errno;
+			ratchet_error_errno (L, "ratchet.exec.communicate()", "write");
 		}
-		lua_pop (L, 1);
 
-		lua_getuservalue (L, 1);
-		lua_getfield (L, -1, "stdin");
-		lua_remove (L, -2);
-		lua_getfield (L, -1, "close");
-		lua_insert (L, -2);
-		lua_callk (L, 1, 0, 3, rexec_communicate);
-
-		lua_getuservalue (L, 1);
-		lua_createtable (L, 2, 0);
-		lua_getfield (L, -2, "stdout");
-		lua_rawseti (L, -2, 1);
-		lua_getfield (L, -2, "stderr");
-		lua_rawseti (L, -2, 2);
-		lua_replace (L, 2);
-		lua_pop (L, 1);
+		/* The process stopped reading, drop the rest of the input. */
+		close (state->infds[1]);
+		state->infds[1] = -1;
+		lua_pushnil (L);
+		lua_replace (L, COMM_SOURCE);
+		ret = (ssize_t) (len-offset);
+	}
 
-		ctx = 3;
-		goto top;
+	if (offset + (size_t) ret < len)
+	{
+		lua_pushinteger (L, (lua_Integer) (offset + (size_t) ret));
+		lua_replace (L, COMM_OFFSET);
+	}
+	else
+	{
+		lua_pushnil (L);
+		lua_replace (L, COMM_PENDING);
 	}
 
-	else if (ctx == 3)
+	return 0;
+}
+/* }}} */
+
+/* {{{ communicate_read() */
+static int communicate_read (lua_State *L, int *fd)
+{
+	/* Pushes a chunk read from fd and returns 1, or returns 0 if fd would
+	 * block or has been closed at end of file. */
+	luaL_Buffer buffer;
+	luaL_buffinit (L, &buffer);
+	char *prepped = luaL_prepbuffsize (&buffer, EXEC_READ_SIZE);
+
+	ssize_t ret = read (*fd, prepped, EXEC_READ_SIZE);
+	if (ret == -1)
 	{
-		lua_rawgeti (L, 2, 1);
-		if (lua_isnil (L, -1))
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
 		{
+			luaL_pushresult (&buffer);
 			lua_pop (L, 1);
-			ctx = 9;
-			goto top;
+			return 0;
 		}
+		ratchet_error_errno (L, "ratchet.exec.communicate()", "read");
+	}
+	else if (ret == 0)
+	{
+		luaL_pushresult (&buffer);
 		lua_pop (L, 1);
-
-		lua_pushlightuserdata (L, RATCHET_YIELD_MULTIRW);
-		lua_pushvalue (L, 2);
-		lua_yieldk (L, 2, 4, rexec_communicate);
-		return luaL_error (L, "unreachable");
+		close (*fd);
+		*fd = -1;
+		return 0;
 	}
 
-	else if (ctx == 4)
+	luaL_addsize (&buffer, (size_t) ret);
+	luaL_pushresult (&buffer);
+	return 1;
+}
+/* }}} */
+
+/* {{{ communicate_over_limit() */
+static int communicate_over_limit (lua_State *L, size_t len)
+{
+	/* Counts output bytes against max_output, killing the process once over. */
+	struct rexec_state *state = (struct rexec_state *) lua_touserdata (L, COMM_SELF);
+	lua_Number output = lua_tonumber (L, COMM_OUTPUT) + (lua_Number) len;
+	lua_pushnumber (L, output);
+	lua_replace (L, COMM_OUTPUT);
+
+	lua_getfield (L, COMM_OPTIONS, "max_output");
+	int over = (lua_isnumber (L, -1) && output > lua_tonumber (L, -1));
+	lua_pop (L, 1);
+	if (!over)
+		return 0;
+
+	kill (state->pid, SIGKILL);
+	if (state->infds[1] >= 0) close (state->infds[1]);
+	if (state->outfds[0] >= 0) close (state->outfds[0]);
+	if (state->errfds[0] >= 0) close (state->errfds[0]);
+	state->infds[1] = -1;
+	state->outfds[0] = -1;
+	state->errfds[0] = -1;
+	lua_pushboolean (L, 1);
+	lua_replace (L, COMM_LIMITED);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ communicate_step() */
+static int communicate_step (lua_State *L)
+{
+	struct rexec_state *state = (struct rexec_state *) lua_touserdata (L, COMM_SELF);
+
+	while (1)
 	{
-		if (lua_isnumber (L, -1) && SIGPIPE == lua_tointeger (L, -1))
+		lua_settop (L, COMM_TOP);
+		int want_write = 0, progress = 0, i;
+
+		/* Feed stdin, from the input string or function. */
+		if (state->infds[1] >= 0)
 		{
-			lua_pop (L, 1);
-			ctx = 9;
-			goto top;
+			if (lua_isnil (L, COMM_PENDING))
+			{
+				if (lua_isfunction (L, COMM_SOURCE))
+				{
+					lua_pushvalue (L, COMM_SOURCE);
+					lua_callk (L, 0, 1, COMM_TOOK_CHUNK, rexec_communicate);
+					communicate_take_chunk (L);
+					continue;
+				}
+
+				close (state->infds[1]);
+				state->infds[1] = -1;
+			}
+			else if (communicate_write (L))
+				want_write = 1;
+			else
+				progress = 1;
 		}
 
-		lua_getuservalue (L, 1);
-		lua_getfield (L, -1, "stdout");
-		if (lua_compare (L, -1, -3, LUA_OPEQ))
+		/* Drain stdout and stderr into their sinks. */
+		int *fds[2] = {&state->outfds[0], &state->errfds[0]};
+		for (i=0; i<2; i++)
 		{
-			lua_replace (L, -3);
-			lua_pop (L, 1);
-			ctx = 5;
-			goto top;
+			if (*fds[i] < 0 || !communicate_read (L, fds[i]))
+				continue;
+
+			size_t len;
+			const char *data = lua_tolstring (L, -1, &len);
+			if (communicate_over_limit (L, len))
+				break;
+
+			progress = 1;
+			int sink = (i == 0 ? COMM_STDOUT : COMM_STDERR);
+			if (lua_isfunction (L, sink))
+			{
+				lua_pushvalue (L, sink);
+				lua_insert (L, -2);
+				lua_callk (L, 1, 0, COMM_DELIVERED, rexec_communicate);
+			}
+			else
+				communicate_deliver (L, sink, data, len);
+			lua_settop (L, COMM_TOP);
 		}
-		lua_pop (L, 1);
 
-		lua_getfield (L, -1, "stderr");
-		if (lua_compare (L, -1, -3, LUA_OPEQ))
+		if (progress)
+			continue;
+
+		if (state->outfds[0] < 0 && state->errfds[0] < 0 && state->infds[1] < 0)
+			break;
+
+		/* Wait for any of the pipes to be ready. */
+		lua_getuservalue (L, COMM_SELF);
+		lua_pushlightuserdata (L, RATCHET_YIELD_MULTIRW);
+		lua_newtable (L);
+		if (state->outfds[0] >= 0)
 		{
-			lua_replace (L, -3);
-			lua_pop (L, 1);
-			ctx = 7;
-			goto top;
+			lua_getfield (L, -3, "stdout");
+			lua_rawseti (L, -2, (int) lua_rawlen (L, -2) + 1);
 		}
-		lua_pop (L, 3);
-
-		ctx = 3;
-		goto top;
+		if (state->errfds[0] >= 0)
+		{
+			lua_getfield (L, -3, "stderr");
+			lua_rawseti (L, -2, (int) lua_rawlen (L, -2) + 1);
+		}
+		lua_newtable (L);
+		if (want_write)
+		{
+			lua_getfield (L, -4, "stdin");
+			lua_rawseti (L, -2, 1);
+		}
+		lua_remove (L, -4);
+		return lua_yieldk (L, 3, COMM_WAITED, rexec_communicate);
 	}
 
-	else if (ctx == 5)
+	lua_settop (L, COMM_TOP);
+	lua_getfield (L, COMM_SELF, "wait");
+	lua_pushvalue (L, COMM_SELF);
+	lua_callk (L, 1, 1, COMM_REAPED, rexec_communicate);
+	return communicate_finish (L);
+}
+/* }}} */
+
+/* {{{ communicate_finish() */
+static int communicate_finish (lua_State *L)
+{
+	/* Expects the exit status on top. */
+	if (lua_toboolean (L, COMM_LIMITED))
 	{
-		lua_getfield (L, -1, "read");
-		lua_insert (L, -2);
-		lua_callk (L, 1, 1, 6, rexec_communicate);
-		ctx = 6;
-		goto top;
+		lua_getfield (L, COMM_OPTIONS, "max_output");
+		return ratchet_error_str (L, "ratchet.exec.communicate()", "EFBIG", "Output exceeded %d bytes, process killed.", (int) lua_tointeger (L, -1));
 	}
 
-	else if (ctx == 6)
+	int i;
+	for (i=COMM_STDOUT; i<=COMM_STDERR; i++)
 	{
-		if (0 == strcmp ("", lua_tostring (L, -1)))
+		lua_getfield (L, COMM_OPTIONS, (i == COMM_STDOUT ? "stdout" : "stderr"));
+		if (lua_isnil (L, -1))
 		{
+			/* Gathered chunks are joined once, at the end. */
+			size_t j, num = lua_rawlen (L, i);
+			luaL_Buffer buffer;
 			lua_pop (L, 1);
-			lua_pushvalue (L, 2);
-			lua_rawgeti (L, -1, 2);
-			lua_rawseti (L, -2, 1);
-			lua_pushnil (L);
-			lua_rawseti (L, -2, 2);
-			lua_pop (L, 1);
-			ctx = 3;
-			goto top;
+			luaL_buffinit (L, &buffer);
+			for (j=1; j<=num; j++)
+			{
+				lua_rawgeti (L, i, (int) j);
+				luaL_addvalue (&buffer);
+			}
+			luaL_pushresult (&buffer);
 		}
-		else
+		else if (lua_isfunction (L, -1))
 		{
-			lua_pushvalue (L, 3);
-			lua_insert (L, -2);
-			lua_concat (L, 2);
-			lua_replace (L, 3);
-			ctx = 3;
-			goto top;
+			lua_pop (L, 1);
+			lua_pushnil (L);
 		}
 	}
+	lua_pushvalue (L, -3);
 
-	else if (ctx == 7)
-	{
-		lua_getfield (L, -1, "read");
-		lua_insert (L, -2);
-		lua_callk (L, 1, 1, 8, rexec_communicate);
-		ctx = 8;
-		goto top;
-	}
+	return 3;
+}
+/* }}} */
 
-	else if (ctx == 8)
+/* {{{ rexec_communicate() */
+static int rexec_communicate (lua_State *L)
+{
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
 	{
-		if (0 == strcmp ("", lua_tostring (L, -1)))
+		(void) luaL_checkudata (L, 1, "ratchet_exec_meta");
+		lua_settop (L, 3);
+		if (!lua_isnil (L, 2) && !lua_isstring (L, 2) && !lua_isfunction (L, 2))
+			return luaL_argerror (L, 2, "Optional string or function expected.");
+		if (lua_isnil (L, 3))
+		{
+			lua_newtable (L);
+			lua_replace (L, 3);
+		}
+		luaL_checktype (L, 3, LUA_TTABLE);
+
+		/* Sinks are functions, or tables to append chunks to. */
+		lua_getfield (L, 3, "stdout");
+		if (lua_isnil (L, -1))
 		{
 			lua_pop (L, 1);
-			lua_pushvalue (L, 2);
-			lua_rawgeti (L, -1, 2);
-			if (lua_isnil (L, -1))
-				lua_rawseti (L, -2, 1);
-			else
-			{
-				lua_pop (L, 1);
-				lua_pushnil (L);
-				lua_rawseti (L, -2, 2);
-			}
+			lua_newtable (L);
+		}
+		lua_getfield (L, 3, "stderr");
+		if (lua_isnil (L, -1))
+		{
 			lua_pop (L, 1);
-			ctx = 3;
-			goto top;
+			lua_newtable (L);
 		}
-		else
+		if (lua_isstring (L, 2))
 		{
-			lua_pushvalue (L, 4);
-			lua_insert (L, -2);
-			lua_concat (L, 2);
-			lua_replace (L, 4);
-			ctx = 3;
-			goto top;
+			lua_pushvalue (L, 2);
+			lua_pushnil (L);
+			lua_replace (L, 2);
 		}
-	}
+		else
+			lua_pushnil (L);
+		lua_pushinteger (L, 0);
+		lua_pushinteger (L, 0);
+		lua_pushboolean (L, 0);
 
-	else if (ctx == 9)
-	{
-		lua_getfield (L, 1, "wait");
+		lua_getfield (L, 1, "start");
 		lua_pushvalue (L, 1);
-		lua_callk (L, 1, 1, 10, rexec_communicate);
-		ctx = 10;
-		goto top;
+		lua_callk (L, 1, 0, COMM_STARTED, rexec_communicate);
 	}
+	else if (ctx == COMM_TOOK_CHUNK)
+		communicate_take_chunk (L);
+	else if (ctx == COMM_REAPED)
+		return communicate_finish (L);
 
-	else if (ctx == 10)
-		return 3;
-
-	return luaL_error (L, "unreachable");
+	return communicate_step (L);
 }
 /* }}} */
 
@@ -621,6 +1327,10 @@ static int rexec_kill (lua_State *L)
 	if (-1 == sig)
 		return luaL_argerror (L, 2, "Invalid signal.");
 
+	/* A pid of 0 would signal the whole process group. */
+	if (state->pid <= 0)
+		return ratchet_error_str (L, "ratchet.exec.kill()", "ESRCH", "Process is not running.");
+
 	if (-1 == kill (state->pid, sig))
 		return ratchet_error_errno (L, "ratchet.exec.kill()", "kill");
 
@@ -732,6 +1442,7 @@ int luaopen_ratchet_exec (lua_State *L)
 	const luaL_Reg funcs[] = {
 		/* Documented methods. */
 		{"new", rexec_new},
+		{"stats", rexec_stats},
 		/* Undocumented, helper methods. */
 		{NULL}
 	};
@@ -755,6 +1466,8 @@ int luaopen_ratchet_exec (lua_State *L)
 		{"wait", rexec_wait},
 		{"kill", rexec_kill},
 		/* Undocumented, helper methods. */
+		{"get_fd", rexec_get_fd},
+		{"get_timeout", rexec_get_timeout},
 		{NULL}
 	};
 
@@ -787,6 +1500,11 @@ int luaopen_ratchet_exec (lua_State *L)
 	lua_setfield (L, -2, "__index");
 	lua_pop (L, 2);
 
+	/* Set up the process accounting shared by every exec object. */
+	struct rexec_stats *stats = (struct rexec_stats *) lua_newuserdata (L, sizeof (struct rexec_stats));
+	memset (stats, 0, sizeof (struct rexec_stats));
+	lua_setfield (L, LUA_REGISTRYINDEX, EXEC_STATS_REGISTRY_KEY);
+
 	/* Set up the ratchet.exec namespace functions. */
 	luaL_newlib (L, funcs);
 	lua_pushvalue (L, -1);
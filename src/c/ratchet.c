@@ -36,6 +36,8 @@
 #define get_event_base(L, index) (*(struct event_base **) luaL_checkudata (L, index, "ratchet_meta"))
 #define get_thread(L, index, s) luaL_checktype (L, index, LUA_TTHREAD); lua_State *s = lua_tothread (L, index)
 
+#define ENDED_THREADS_REGISTRY_KEY "ratchet_ended_threads"
+
 const char *ratchet_version (void);
 
 /* {{{ setup_persistance_tables() */
@@ -132,6 +134,13 @@ static void end_thread_persist (lua_State *L, int index)
 	lua_State *L1 = lua_tothread (L, index);
 	lua_settop (L1, 0);
 
+	/* Killed threads stay yielded, so whoever still holds one can ask. */
+	lua_getfield (L, LUA_REGISTRYINDEX, ENDED_THREADS_REGISTRY_KEY);
+	lua_pushvalue (L, index);
+	lua_pushboolean (L, 1);
+	lua_rawset (L, -3);
+	lua_pop (L, 1);
+
 	lua_getfield (L, -1, "threads");
 	lua_pushvalue (L, index);
 	lua_pushnil (L);
@@ -1209,16 +1218,26 @@ static int ratchet_unpause (lua_State *L)
 {
 	get_thread (L, 1, L1);
 
+	/* A killed thread has nothing left to resume. */
+	if (ratchet_thread_ended (L, 1))
+	{
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+
+	/* Make sure it's unpause-able. */
+	if (lua_status (L1) != LUA_YIELD || !lua_isthread (L1, 1))
+		return luaL_error (L, "Thread is not yielding, cannot unpause.");
+
 	/* Get the ratchet object from the thread stack and put it at index 1. */
 	get_thread (L1, 1, L2);
 	lua_pushvalue (L2, 1);
 	lua_xmove (L2, L, 1);
 	lua_insert (L, 1);
-	lua_settop (L1, 0);
 
-	/* Make sure it's unpause-able. */
-	if (lua_status (L1) != LUA_YIELD)
-		return luaL_error (L, "Thread is not yielding, cannot unpause.");
+	/* A thread waiting with a timeout is woken early. */
+	end_all_waiting_thread_events (L1);
+	lua_settop (L1, 0);
 
 	/* Set up the extra arguments as return values from pause(). */
 	int nargs = lua_gettop (L) - 2;
@@ -1227,7 +1246,17 @@ static int ratchet_unpause (lua_State *L)
 	/* Add the thread to the ready table so it gets resumed. */
 	set_thread_ready (L, 2 /* index of thread */);
 
-	return 0;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+/* }}} */
+
+/* {{{ ratchet_is_alive() */
+static int ratchet_is_alive (lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTHREAD);
+	lua_pushboolean (L, !ratchet_thread_ended (L, 1));
+	return 1;
 }
 /* }}} */
 
@@ -1377,6 +1406,7 @@ int luaopen_ratchet (lua_State *L)
 		{"kill_all", ratchet_kill_all},
 		{"pause", ratchet_pause},
 		{"unpause", ratchet_unpause},
+		{"is_alive", ratchet_is_alive},
 		{"self", ratchet_running_thread},
 		{"block_on", ratchet_block_on},
 		{"sigwait", ratchet_sigwait},
@@ -1401,6 +1431,14 @@ int luaopen_ratchet (lua_State *L)
 	luaL_setfuncs (L, eventmetameths, 0);
 	lua_pop (L, 1);
 
+	/* Weak-key set of threads that were killed or have finished. */
+	lua_newtable (L);
+	lua_newtable (L);
+	lua_pushliteral (L, "k");
+	lua_setfield (L, -2, "__mode");
+	lua_setmetatable (L, -2);
+	lua_setfield (L, LUA_REGISTRYINDEX, ENDED_THREADS_REGISTRY_KEY);
+
 	luaL_newmetatable (L, "ratchet_meta");
 	lua_newtable (L);
 	luaL_setfuncs (L, meths, 0);
@@ -1413,6 +1451,8 @@ int luaopen_ratchet (lua_State *L)
 	lua_setglobal (L, "ratchet");
 
 	luaL_newlib (L, thread_funcs);
+	lua_pushvalue (L, -1);
+	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_thread_class");
 	lua_setfield (L, -2, "thread");
 
 	luaL_requiref (L, "ratchet.error", luaopen_ratchet_error, 0);
@@ -1453,6 +1493,25 @@ int luaopen_ratchet (lua_State *L)
 }
 /* }}} */
 
+/* {{{ ratchet_thread_ended() */
+int ratchet_thread_ended (lua_State *L, int index)
+{
+	index = lua_absindex (L, index);
+	lua_getfield (L, LUA_REGISTRYINDEX, ENDED_THREADS_REGISTRY_KEY);
+	if (!lua_istable (L, -1))
+	{
+		lua_pop (L, 1);
+		return 0;
+	}
+	lua_pushvalue (L, index);
+	lua_rawget (L, -2);
+	int ended = lua_toboolean (L, -1);
+	lua_pop (L, 2);
+
+	return ended;
+}
+/* }}} */
+
 /* {{{ ratchet_version() */
 const char *ratchet_version (void)
 {
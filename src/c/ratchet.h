@@ -29,6 +29,9 @@ int ratchet_error_errno_ln (lua_State *L, const char *function, const char *sysc
 int ratchet_error_top_ln (lua_State *L, const char *function, const char *code, const char *file, int line);
 int ratchet_error_str_ln (lua_State *L, const char *function, const char *code, const char *file, int line, const char *description, ...);
 
+/* True once the thread at index was killed or has finished. */
+int ratchet_thread_ended (lua_State *L, int index);
+
 #define RATCHET_YIELD_GET ((void *) 1)
 #define RATCHET_YIELD_WRITE ((void *) 2)
 #define RATCHET_YIELD_READ ((void *) 3)
@@ -358,9 +358,7 @@ static int rsock_new (lua_State *L)
 	luaL_getmetatable (L, "ratchet_socket_meta");
 	lua_setmetatable (L, -2);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -2);
 
 	return 1;
@@ -411,14 +409,10 @@ static int rsock_new_pair (lua_State *L)
 	luaL_getmetatable (L, "ratchet_socket_meta");
 	lua_setmetatable (L, -3);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -2);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -3);
 
 	return 2;
@@ -441,9 +435,7 @@ static int rsock_from_fd (lua_State *L)
 	luaL_getmetatable (L, "ratchet_socket_meta");
 	lua_setmetatable (L, -2);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -2);
 
 	return 1;
@@ -739,8 +731,12 @@ static int rsock_get_timeout (lua_State *L)
 {
 	(void) socket_fd (L, 1);
 
+	/* The default timeout is not stored, idle sockets keep a smaller
+	 * uservalue table. */
 	lua_getuservalue (L, 1);
 	lua_getfield (L, -1, "timeout");
+	if (lua_isnil (L, -1))
+		lua_pushnumber (L, (lua_Number) -1.0);
 	return 1;
 }
 /* }}} */
@@ -1057,6 +1053,94 @@ static int rsock_recv (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rsock_sendto() */
+static int rsock_sendto (lua_State *L)
+{
+	int sockfd = socket_fd (L, 1);
+	size_t data_len;
+	const char *data = luaL_checklstring (L, 2, &data_len);
+	struct sockaddr *addr = (struct sockaddr *) luaL_checkudata (L, 3, "ratchet_socket_sockaddr_meta");
+	socklen_t addrlen = (socklen_t) lua_rawlen (L, 3);
+	ssize_t ret;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 4))
+		return ratchet_error_str (L, "ratchet.socket.sendto()", "ETIMEDOUT", "Timed out on sendto.");
+	lua_settop (L, 3);
+
+	ret = sendto (sockfd, data, data_len, MSG_NOSIGNAL, addr, addrlen);
+	if (ret == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
+			lua_pushvalue (L, 1);
+			return lua_yieldk (L, 2, 1, rsock_sendto);
+		}
+		else
+			return ratchet_error_errno (L, "ratchet.socket.sendto()", "sendto");
+	}
+
+	lua_pushvalue (L, 2);
+	lua_pushvalue (L, 3);
+	call_tracer (L, 1, "sendto", 2);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rsock_recvfrom() */
+static int rsock_recvfrom (lua_State *L)
+{
+	int sockfd = socket_fd (L, 1);
+	luaL_Buffer buffer;
+	ssize_t ret;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 4))
+		return ratchet_error_str (L, "ratchet.socket.recvfrom()", "ETIMEDOUT", "Timed out on recvfrom.");
+	lua_settop (L, 2);
+
+	size_t len = (size_t) luaL_optunsigned (L, 2, (lua_Unsigned) LUAL_BUFFERSIZE);
+	if (len > LUAL_BUFFERSIZE)
+		return luaL_error (L, "Cannot recvfrom more than %u bytes, %u requested", (unsigned) LUAL_BUFFERSIZE, (unsigned) len);
+
+	struct sockaddr *addr = (struct sockaddr *) lua_newuserdata (L, sizeof (struct sockaddr_storage));
+	luaL_getmetatable (L, "ratchet_socket_sockaddr_meta");
+	lua_setmetatable (L, -2);
+	socklen_t addr_len = sizeof (struct sockaddr_storage);
+	memset (addr, 0, sizeof (struct sockaddr_storage));
+
+	luaL_buffinit (L, &buffer);
+	char *prepped = luaL_prepbuffer (&buffer);
+
+	ret = recvfrom (sockfd, prepped, len, 0, addr, &addr_len);
+	if (ret == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_pushvalue (L, 1);
+			return lua_yieldk (L, 2, 1, rsock_recvfrom);
+		}
+		else
+			return ratchet_error_errno (L, "ratchet.socket.recvfrom()", "recvfrom");
+	}
+
+	luaL_addsize (&buffer, (size_t) ret);
+	luaL_pushresult (&buffer);
+	lua_pushvalue (L, 3);
+
+	lua_pushvalue (L, -2);
+	lua_pushvalue (L, -2);
+	call_tracer (L, 1, "recvfrom", 2);
+
+	return 2;
+}
+/* }}} */
+
 #if HAVE_OPENSSL
 /* {{{ rsock_try_encrypted_send() */
 static int rsock_try_encrypted_send (lua_State *L)
@@ -1177,6 +1261,8 @@ int luaopen_ratchet_socket (lua_State *L)
 		{"send", rsock_send},
 		{"recv", rsock_recv},
 #endif
+		{"sendto", rsock_sendto},
+		{"recvfrom", rsock_recvfrom},
 		{"bind", rsock_bind},
 		{"listen", rsock_listen},
 		{"check_errors", rsock_check_errors},
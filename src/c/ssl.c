@@ -34,6 +34,15 @@
 #include <netdb.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#if HAVE_SSL_OFFLOAD
+#include <pthread.h>
+#include <sys/eventfd.h>
+#endif
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -44,6 +53,176 @@
 
 typedef void (*signal_handler) (int);
 
+#define get_ssl_ctx(L, i) ((struct rssl_ctx *) luaL_checkudata (L, i, "ratchet_ssl_ctx_meta"))
+#define get_ssl_session(L, i) ((struct rssl_session *) luaL_checkudata (L, i, "ratchet_ssl_session_meta"))
+
+#define get_ssl_buffer(L, i) ((struct rssl_buffer *) luaL_checkudata (L, i, "ratchet_ssl_buffer_meta"))
+
+#define SSL_RECORD_SIZE 16384
+
+#define OFFLOAD_ACCEPT 1
+#define OFFLOAD_CONNECT 2
+
+/* Without worker threads, SNI tables are only used by the event loop. */
+#if HAVE_SSL_OFFLOAD
+#define sni_lock_init(c) pthread_mutex_init (&(c)->sni_lock, NULL)
+#define sni_lock_destroy(c) pthread_mutex_destroy (&(c)->sni_lock)
+#define sni_lock(c) pthread_mutex_lock (&(c)->sni_lock)
+#define sni_unlock(c) pthread_mutex_unlock (&(c)->sni_lock)
+#else
+#define sni_lock_init(c) ((void) (c))
+#define sni_lock_destroy(c) ((void) (c))
+#define sni_lock(c) ((void) (c))
+#define sni_unlock(c) ((void) (c))
+#endif
+
+static int stats_index = -1;
+
+/* Bytes OpenSSL holds through ssl_mem_malloc(), and its live SSL objects. */
+static long ssl_mem_bytes = 0;
+static long ssl_mem_sessions = 0;
+static int ssl_mem_counting = -1;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define ssl_ctx_up_ref(c) CRYPTO_add (&(c)->references, 1, CRYPTO_LOCK_SSL_CTX)
+#else
+#define ssl_ctx_up_ref(c) SSL_CTX_up_ref (c)
+#endif
+
+/* {{{ struct rssl_offload_job */
+struct rssl_offload_job
+{
+	struct rssl_offload_job *next;
+	struct rssl_offload *offload;
+	SSL *ssl;
+	int efd;
+	int op;
+	int refs;
+	int in_flight;
+	int owns_ssl;
+
+	int ret;
+	int error;
+	int orig_errno;
+	unsigned long error_queue;
+};
+/* }}} */
+
+#if HAVE_SSL_OFFLOAD
+/* {{{ struct rssl_offload */
+struct rssl_offload
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rssl_offload_job *head;
+	struct rssl_offload_job *tail;
+	pthread_t *threads;
+	int num_threads;
+	int shutdown;
+};
+/* }}} */
+#endif
+
+/* {{{ struct rssl_sni_count */
+struct rssl_sni_count
+{
+	unsigned long handshakes;
+	int refs;
+};
+/* }}} */
+
+/* {{{ struct rssl_sni_entry */
+struct rssl_sni_entry
+{
+	char *name;
+	SSL_CTX *ctx;
+	struct rssl_sni_count *count;
+};
+/* }}} */
+
+/* {{{ struct rssl_sni_table */
+struct rssl_sni_table
+{
+	struct rssl_sni_entry *entries;
+	size_t size;
+	int refs;
+	struct rssl_sni_count *default_count;
+};
+/* }}} */
+
+/* {{{ struct rssl_ctx_stats */
+struct rssl_ctx_stats
+{
+	unsigned long handshakes_full;
+	unsigned long handshakes_resumed;
+	unsigned long handshake_failures;
+	double handshake_wall;
+	double handshake_cpu;
+	unsigned long plain_in;
+	unsigned long plain_out;
+	unsigned long wire_in;
+	unsigned long wire_out;
+	unsigned long renegotiations;
+	unsigned long alerts_sent;
+	unsigned long alerts_received;
+};
+/* }}} */
+
+/* {{{ struct rssl_ctx */
+struct rssl_ctx
+{
+	SSL_CTX *ctx;
+	struct rssl_offload *offload;
+#if HAVE_SSL_OFFLOAD
+	pthread_mutex_t sni_lock;
+#endif
+	struct rssl_sni_table *sni;
+	struct rssl_ctx_stats stats;
+};
+/* }}} */
+
+/* {{{ struct rssl_stats */
+struct rssl_stats
+{
+	/* Owned by the SSL object through ex_data, so it outlives the session
+	 * userdata whenever a handshake offload worker still holds the SSL. */
+	struct rssl_ctx *ctx;
+	struct rssl_sni_count *sni_count;
+	int handshake_done;
+	int resumed;
+	double handshake_start;
+	double handshake_wall;
+	double handshake_cpu;
+	unsigned long plain_in;
+	unsigned long plain_out;
+	unsigned long wire_in;
+	unsigned long wire_out;
+	unsigned long renegotiations;
+	unsigned long alerts_sent;
+	unsigned long alerts_received;
+};
+/* }}} */
+
+/* {{{ struct rssl_session */
+struct rssl_session
+{
+	SSL *ssl;
+	struct rssl_offload *offload;
+	struct rssl_offload_job *job;
+	size_t write_done;
+	size_t write_total;
+};
+/* }}} */
+
+/* {{{ struct rssl_buffer */
+struct rssl_buffer
+{
+	char *data;
+	size_t len;
+	size_t cap;
+};
+/* }}} */
+
 /* {{{ handle_ssl_error() */
 static int handle_ssl_error (lua_State *L, const char *func, int ret, unsigned long error, int orig_errno)
 {
@@ -104,8 +283,971 @@ void setup_ssl_methods (lua_State *L)
 }
 /* }}} */
 
+/* ---- Statistics Functions ------------------------------------------------ */
+
+/* {{{ stats_clock() */
+static double stats_clock (clockid_t clock)
+{
+	struct timespec ts;
+	if (clock_gettime (clock, &ts) < 0)
+		return 0.0;
+	return fromtimespec (&ts);
+}
+/* }}} */
+
+/* {{{ stats_get() */
+static struct rssl_stats *stats_get (SSL *ssl)
+{
+	return (struct rssl_stats *) SSL_get_ex_data (ssl, stats_index);
+}
+/* }}} */
+
+/* {{{ sni_count_unref() */
+static void sni_count_unref (struct rssl_sni_count *count)
+{
+	if (count && __sync_sub_and_fetch (&count->refs, 1) == 0)
+		free (count);
+}
+/* }}} */
+
+/* {{{ stats_free_cb() */
+static void stats_free_cb (void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+	struct rssl_stats *stats = (struct rssl_stats *) ptr;
+	if (stats)
+	{
+		sni_count_unref (stats->sni_count);
+		__sync_sub_and_fetch (&ssl_mem_sessions, 1);
+	}
+	free (ptr);
+}
+/* }}} */
+
+/* {{{ stats_info_cb() */
+static void stats_info_cb (const SSL *ssl, int where, int ret)
+{
+	/* This may run in a handshake offload worker, so Lua is off limits. */
+	struct rssl_stats *stats = stats_get ((SSL *) ssl);
+	if (!stats)
+		return;
+
+	if ((where & SSL_CB_HANDSHAKE_START) && stats->handshake_done)
+	{
+		stats->renegotiations++;
+		__sync_add_and_fetch (&stats->ctx->stats.renegotiations, 1);
+	}
+	else if ((where & SSL_CB_ALERT) && (where & SSL_CB_READ))
+	{
+		stats->alerts_received++;
+		__sync_add_and_fetch (&stats->ctx->stats.alerts_received, 1);
+	}
+	else if ((where & SSL_CB_ALERT) && (where & SSL_CB_WRITE))
+	{
+		stats->alerts_sent++;
+		__sync_add_and_fetch (&stats->ctx->stats.alerts_sent, 1);
+	}
+}
+/* }}} */
+
+/* {{{ stats_new() */
+static int stats_new (SSL *ssl, struct rssl_ctx *ctx)
+{
+	struct rssl_stats *stats = (struct rssl_stats *) calloc (1, sizeof (struct rssl_stats));
+	if (!stats)
+		return 0;
+	stats->ctx = ctx;
+
+	if (!SSL_set_ex_data (ssl, stats_index, stats))
+	{
+		free (stats);
+		return 0;
+	}
+	SSL_set_info_callback (ssl, stats_info_cb);
+	__sync_add_and_fetch (&ssl_mem_sessions, 1);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ stats_update_io() */
+static void stats_update_io (SSL *ssl, int plain_in, int plain_out)
+{
+	struct rssl_stats *stats = stats_get (ssl);
+	if (!stats)
+		return;
+	struct rssl_ctx_stats *ctx_stats = &stats->ctx->stats;
+
+	if (plain_in > 0)
+	{
+		stats->plain_in += (unsigned long) plain_in;
+		ctx_stats->plain_in += (unsigned long) plain_in;
+	}
+	if (plain_out > 0)
+	{
+		stats->plain_out += (unsigned long) plain_out;
+		ctx_stats->plain_out += (unsigned long) plain_out;
+	}
+
+	BIO *rbio = SSL_get_rbio (ssl), *wbio = SSL_get_wbio (ssl);
+	unsigned long wire_in = (rbio ? (unsigned long) BIO_number_read (rbio) : 0);
+	unsigned long wire_out = (wbio ? (unsigned long) BIO_number_written (wbio) : 0);
+	if (wire_in > stats->wire_in)
+		ctx_stats->wire_in += wire_in - stats->wire_in;
+	if (wire_out > stats->wire_out)
+		ctx_stats->wire_out += wire_out - stats->wire_out;
+	stats->wire_in = wire_in;
+	stats->wire_out = wire_out;
+}
+/* }}} */
+
+/* {{{ stats_handshake_step() */
+static double stats_handshake_step (SSL *ssl)
+{
+	struct rssl_stats *stats = stats_get (ssl);
+	if (stats && stats->handshake_start == 0.0)
+		stats->handshake_start = stats_clock (CLOCK_MONOTONIC);
+
+	return stats_clock (CLOCK_THREAD_CPUTIME_ID);
+}
+/* }}} */
+
+/* {{{ stats_handshake_cpu() */
+static void stats_handshake_cpu (SSL *ssl, double cpu_start)
+{
+	struct rssl_stats *stats = stats_get (ssl);
+	if (stats)
+		stats->handshake_cpu += stats_clock (CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+}
+/* }}} */
+
+/* {{{ stats_count_name() */
+static void stats_count_name (lua_State *L, int index, const char *field, const char *name)
+{
+	lua_getfield (L, index, field);
+	if (!lua_istable (L, -1))
+	{
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, index, field);
+	}
+
+	lua_getfield (L, -1, name);
+	lua_Number count = lua_tonumber (L, -1);
+	lua_pop (L, 1);
+	lua_pushnumber (L, count + 1);
+	lua_setfield (L, -2, name);
+	lua_pop (L, 1);
+}
+/* }}} */
+
+/* {{{ stats_handshake_done() */
+static void stats_handshake_done (lua_State *L, SSL *ssl, int success)
+{
+	struct rssl_stats *stats = stats_get (ssl);
+	if (!stats)
+		return;
+	struct rssl_ctx_stats *ctx_stats = &stats->ctx->stats;
+
+	stats_update_io (ssl, 0, 0);
+
+	if (!success)
+	{
+		ctx_stats->handshake_failures++;
+		return;
+	}
+
+	stats->handshake_done = 1;
+	stats->handshake_wall = stats_clock (CLOCK_MONOTONIC) - stats->handshake_start;
+	stats->resumed = SSL_session_reused (ssl);
+
+	if (stats->resumed)
+		ctx_stats->handshakes_resumed++;
+	else
+		ctx_stats->handshakes_full++;
+	ctx_stats->handshake_wall += stats->handshake_wall;
+	ctx_stats->handshake_cpu += stats->handshake_cpu;
+	if (stats->sni_count)
+		__sync_add_and_fetch (&stats->sni_count->handshakes, 1);
+
+	/* Protocol and cipher distributions live in the context's uservalue. */
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "ctx");
+	lua_getuservalue (L, -1);
+	int index = lua_gettop (L);
+	stats_count_name (L, index, "protocols", SSL_get_version (ssl));
+	stats_count_name (L, index, "ciphers", SSL_get_cipher (ssl));
+	lua_pop (L, 3);
+}
+/* }}} */
+
+/* {{{ stats_copy_names() */
+static void stats_copy_names (lua_State *L, int src, int dst, const char *field)
+{
+	lua_newtable (L);
+	lua_getfield (L, src, field);
+	if (lua_istable (L, -1))
+	{
+		for (lua_pushnil (L); lua_next (L, -2); lua_pop (L, 1))
+		{
+			lua_pushvalue (L, -2);
+			lua_insert (L, -2);
+			lua_settable (L, -5);
+		}
+	}
+	lua_pop (L, 1);
+	lua_setfield (L, dst, field);
+}
+/* }}} */
+
+/* ---- Idle Memory Functions ----------------------------------------------- */
+
+/* {{{ union ssl_mem_header */
+union ssl_mem_header
+{
+	/* Keeps the allocation after the header aligned for any type. */
+	size_t size;
+	void *ptr;
+	long double align;
+};
+/* }}} */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/* {{{ ssl_mem_malloc() */
+static void *ssl_mem_malloc (size_t num, const char *file, int line)
+{
+	(void) file;
+	(void) line;
+	union ssl_mem_header *header = (union ssl_mem_header *) malloc (sizeof (union ssl_mem_header) + num);
+	if (!header)
+		return NULL;
+	header->size = num;
+	__sync_add_and_fetch (&ssl_mem_bytes, (long) num);
+	return header + 1;
+}
+/* }}} */
+
+/* {{{ ssl_mem_free() */
+static void ssl_mem_free (void *ptr, const char *file, int line)
+{
+	(void) file;
+	(void) line;
+	if (!ptr)
+		return;
+	union ssl_mem_header *header = (union ssl_mem_header *) ptr - 1;
+	__sync_sub_and_fetch (&ssl_mem_bytes, (long) header->size);
+	free (header);
+}
+/* }}} */
+
+/* {{{ ssl_mem_realloc() */
+static void *ssl_mem_realloc (void *ptr, size_t num, const char *file, int line)
+{
+	if (!ptr)
+		return ssl_mem_malloc (num, file, line);
+	if (num == 0)
+	{
+		ssl_mem_free (ptr, file, line);
+		return NULL;
+	}
+
+	union ssl_mem_header *header = (union ssl_mem_header *) ptr - 1;
+	size_t old_size = header->size;
+	header = (union ssl_mem_header *) realloc (header, sizeof (union ssl_mem_header) + num);
+	if (!header)
+		return NULL;
+	header->size = num;
+	__sync_add_and_fetch (&ssl_mem_bytes, (long) num - (long) old_size);
+	return header + 1;
+}
+/* }}} */
+#endif
+
+/* {{{ setup_ssl_memory_counting() */
+static void setup_ssl_memory_counting (void)
+{
+	/* OpenSSL only accepts allocation functions before its first allocation,
+	 * so counting is off if another library got to it first. */
+	if (ssl_mem_counting >= 0)
+		return;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	ssl_mem_counting = CRYPTO_set_mem_functions (ssl_mem_malloc, ssl_mem_realloc, ssl_mem_free);
+#else
+	ssl_mem_counting = 0;
+#endif
+}
+/* }}} */
+
+/* {{{ compact_session_state() */
+static void compact_session_state (lua_State *L, int index)
+{
+	/* The handshake offload grew the uservalue table beyond the two fields an
+	 * established session keeps, so it is rebuilt to fit. */
+	lua_getuservalue (L, index);
+	lua_createtable (L, 0, 2);
+	lua_getfield (L, -2, "engine");
+	lua_setfield (L, -2, "engine");
+	lua_getfield (L, -2, "ctx");
+	lua_setfield (L, -2, "ctx");
+	lua_setuservalue (L, index);
+	lua_pop (L, 1);
+}
+/* }}} */
+
+/* ---- Handshake Offload Functions ----------------------------------------- */
+
+#if HAVE_SSL_OFFLOAD
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *openssl_locks = NULL;
+
+/* {{{ openssl_locking_cb() */
+static void openssl_locking_cb (int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock (&openssl_locks[n]);
+	else
+		pthread_mutex_unlock (&openssl_locks[n]);
+}
+/* }}} */
+
+/* {{{ openssl_id_cb() */
+static unsigned long openssl_id_cb (void)
+{
+	return (unsigned long) pthread_self ();
+}
+/* }}} */
+#endif
+
+/* {{{ setup_openssl_threading() */
+static void setup_openssl_threading (void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	/* Leave any callbacks the application installed itself in place. */
+	if (openssl_locks || CRYPTO_get_locking_callback ())
+		return;
+
+	int i, num = CRYPTO_num_locks ();
+	openssl_locks = (pthread_mutex_t *) malloc (sizeof (pthread_mutex_t) * num);
+	for (i=0; i<num; i++)
+		pthread_mutex_init (&openssl_locks[i], NULL);
+
+	CRYPTO_set_id_callback (openssl_id_cb);
+	CRYPTO_set_locking_callback (openssl_locking_cb);
+#endif
+}
+/* }}} */
+
+/* {{{ offload_job_unref() */
+static void offload_job_unref (struct rssl_offload_job *job)
+{
+	/* The offload lock must be held by the caller. */
+	if (--job->refs > 0)
+		return;
+
+	if (job->owns_ssl && job->ssl)
+		SSL_free (job->ssl);
+	if (job->efd >= 0)
+		close (job->efd);
+	free (job);
+}
+/* }}} */
+
+/* {{{ offload_worker() */
+static void *offload_worker (void *arg)
+{
+	struct rssl_offload *offload = (struct rssl_offload *) arg;
+	struct rssl_offload_job *job;
+	uint64_t one = 1;
+
+	pthread_mutex_lock (&offload->lock);
+	while (1)
+	{
+		while (!offload->head && !offload->shutdown)
+			pthread_cond_wait (&offload->cond, &offload->lock);
+		if (!offload->head)
+			break;
+
+		job = offload->head;
+		offload->head = job->next;
+		if (!offload->head)
+			offload->tail = NULL;
+		pthread_mutex_unlock (&offload->lock);
+
+		/* The SSL object is only touched here until in_flight is cleared,
+		 * the owning thread is paused waiting on the eventfd. */
+		ERR_clear_error ();
+		double cpu_start = stats_handshake_step (job->ssl);
+		if (job->op == OFFLOAD_ACCEPT)
+			job->ret = SSL_accept (job->ssl);
+		else
+			job->ret = SSL_connect (job->ssl);
+		stats_handshake_cpu (job->ssl, cpu_start);
+		job->orig_errno = errno;
+		job->error = SSL_get_error (job->ssl, job->ret);
+		job->error_queue = ERR_get_error ();
+		ERR_clear_error ();
+
+		pthread_mutex_lock (&offload->lock);
+		job->in_flight = 0;
+		if (job->efd >= 0)
+			while (write (job->efd, &one, sizeof (one)) < 0 && errno == EINTR);
+		offload_job_unref (job);
+	}
+	pthread_mutex_unlock (&offload->lock);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	ERR_remove_thread_state (NULL);
+#endif
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ offload_free() */
+static void offload_free (struct rssl_offload *offload)
+{
+	int i;
+
+	pthread_mutex_lock (&offload->lock);
+	offload->shutdown = 1;
+	pthread_cond_broadcast (&offload->cond);
+	pthread_mutex_unlock (&offload->lock);
+
+	for (i=0; i<offload->num_threads; i++)
+		pthread_join (offload->threads[i], NULL);
+
+	pthread_cond_destroy (&offload->cond);
+	pthread_mutex_destroy (&offload->lock);
+	free (offload->threads);
+	free (offload);
+}
+/* }}} */
+
+/* {{{ offload_new() */
+static struct rssl_offload *offload_new (int num_threads)
+{
+	struct rssl_offload *offload = (struct rssl_offload *) calloc (1, sizeof (struct rssl_offload));
+	if (!offload)
+		return NULL;
+	offload->threads = (pthread_t *) calloc (num_threads, sizeof (pthread_t));
+	if (!offload->threads)
+	{
+		free (offload);
+		return NULL;
+	}
+	pthread_mutex_init (&offload->lock, NULL);
+	pthread_cond_init (&offload->cond, NULL);
+
+	setup_openssl_threading ();
+
+	/* Workers should never handle signals meant for the event loop, and
+	 * should get EPIPE rather than SIGPIPE. */
+	sigset_t all, old;
+	sigfillset (&all);
+	pthread_sigmask (SIG_SETMASK, &all, &old);
+
+	int i, ret = 0;
+	for (i=0; i<num_threads; i++)
+	{
+		ret = pthread_create (&offload->threads[i], NULL, offload_worker, offload);
+		if (ret)
+			break;
+		offload->num_threads++;
+	}
+
+	pthread_sigmask (SIG_SETMASK, &old, NULL);
+
+	if (ret)
+	{
+		offload_free (offload);
+		errno = ret;
+		return NULL;
+	}
+
+	return offload;
+}
+/* }}} */
+
+/* {{{ offload_job_done() */
+static int offload_job_done (struct rssl_offload_job *job)
+{
+	/* The eventfd is reset on every wakeup, whether the job finished or the
+	 * wait timed out, so that the next wait does not return at once. The
+	 * worker signals after clearing in_flight, so no wakeup is lost. */
+	uint64_t val;
+	while (read (job->efd, &val, sizeof (val)) < 0 && errno == EINTR);
+
+	pthread_mutex_lock (&job->offload->lock);
+	int done = !job->in_flight;
+	pthread_mutex_unlock (&job->offload->lock);
+
+	return done;
+}
+/* }}} */
+
+/* {{{ offload_release() */
+static void offload_release (lua_State *L, struct rssl_session *session)
+{
+	struct rssl_offload_job *job = session->job;
+	if (!job)
+		return;
+
+	pthread_mutex_lock (&job->offload->lock);
+	if (job->efd >= 0)
+		close (job->efd);
+	job->efd = -1;
+	offload_job_unref (job);
+	pthread_mutex_unlock (&job->offload->lock);
+	session->job = NULL;
+
+	if (SSL_get_mode (session->ssl) & SSL_MODE_RELEASE_BUFFERS)
+		compact_session_state (L, 1);
+	else
+	{
+		lua_getuservalue (L, 1);
+		lua_pushnil (L);
+		lua_setfield (L, -2, "offload");
+		lua_pop (L, 1);
+	}
+}
+/* }}} */
+
+/* {{{ offload_handshake() */
+static int offload_handshake (lua_State *L, struct rssl_session *session, int op, int submit, lua_CFunction k)
+{
+	struct rssl_offload_job *job = session->job;
+
+	if (!job)
+	{
+		job = (struct rssl_offload_job *) calloc (1, sizeof (struct rssl_offload_job));
+		if (!job)
+			return luaL_error (L, "Could not allocate handshake offload job");
+		job->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (job->efd < 0)
+		{
+			free (job);
+			return ratchet_error_errno (L, "ratchet.ssl.session.handshake()", "eventfd");
+		}
+		job->offload = session->offload;
+		job->ssl = session->ssl;
+		job->refs = 2;
+
+		struct rssl_offload_job **handle = (struct rssl_offload_job **) lua_newuserdata (L, sizeof (struct rssl_offload_job *));
+		*handle = job;
+		luaL_getmetatable (L, "ratchet_ssl_offload_meta");
+		lua_setmetatable (L, -2);
+
+		/* The wait on the eventfd uses the timeout of the engine. */
+		lua_createtable (L, 0, 1);
+		lua_getuservalue (L, 1);
+		lua_getfield (L, -1, "engine");
+		lua_setfield (L, -3, "engine");
+		lua_pop (L, 1);
+		lua_setuservalue (L, -2);
+
+		lua_getuservalue (L, 1);
+		lua_insert (L, -2);
+		lua_setfield (L, -2, "offload");
+		lua_pop (L, 1);
+
+		session->job = job;
+	}
+
+	if (submit)
+	{
+		struct rssl_offload *offload = job->offload;
+
+		pthread_mutex_lock (&offload->lock);
+		job->op = op;
+		job->in_flight = 1;
+		job->refs++;
+		job->next = NULL;
+		if (offload->tail)
+			offload->tail->next = job;
+		else
+			offload->head = job;
+		offload->tail = job;
+		pthread_cond_signal (&offload->cond);
+		pthread_mutex_unlock (&offload->lock);
+	}
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "offload");
+	lua_remove (L, -2);
+	return lua_yieldk (L, 2, 2, k);
+}
+/* }}} */
+
+/* {{{ offload_handshake_error() */
+static int offload_handshake_error (lua_State *L, struct rssl_session *session, const char *func)
+{
+	struct rssl_offload_job *job = session->job;
+	int ret = job->ret;
+	unsigned long error = job->error;
+	unsigned long error_queue = job->error_queue;
+	int orig_errno = job->orig_errno;
+
+	offload_release (L, session);
+
+	if (error_queue)
+	{
+		const char *reason = ERR_reason_error_string (error_queue);
+		if (reason)
+			return ratchet_error_str (L, func, "SSLERROR", "SSL error: %s", reason);
+	}
+
+	return handle_ssl_error (L, func, ret, error, orig_errno);
+}
+/* }}} */
+
+/* {{{ offload_in_flight() */
+static int offload_in_flight (struct rssl_offload_job *job)
+{
+	if (!job)
+		return 0;
+
+	pthread_mutex_lock (&job->offload->lock);
+	int in_flight = job->in_flight;
+	pthread_mutex_unlock (&job->offload->lock);
+
+	return in_flight;
+}
+/* }}} */
+#else
+/* {{{ offload_free() */
+static void offload_free (struct rssl_offload *offload)
+{
+	(void) offload;
+}
+/* }}} */
+
+/* {{{ offload_in_flight() */
+static int offload_in_flight (struct rssl_offload_job *job)
+{
+	(void) job;
+	return 0;
+}
+/* }}} */
+
+/* {{{ offload_job_done() */
+static int offload_job_done (struct rssl_offload_job *job)
+{
+	(void) job;
+	return 1;
+}
+/* }}} */
+
+/* {{{ offload_release() */
+static void offload_release (lua_State *L, struct rssl_session *session)
+{
+	(void) L;
+	(void) session;
+}
+/* }}} */
+
+/* {{{ offload_handshake() */
+static int offload_handshake (lua_State *L, struct rssl_session *session, int op, int submit, lua_CFunction k)
+{
+	return luaL_error (L, "Handshake offload is not supported");
+}
+/* }}} */
+
+/* {{{ offload_handshake_error() */
+static int offload_handshake_error (lua_State *L, struct rssl_session *session, const char *func)
+{
+	return luaL_error (L, "Handshake offload is not supported");
+}
+/* }}} */
+#endif
+
+/* ---- SNI Functions ------------------------------------------------------- */
+
+/* {{{ sni_hash() */
+static unsigned long sni_hash (const char *name)
+{
+	unsigned long hash = 2166136261UL;
+	while (*name)
+	{
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+/* }}} */
+
+/* {{{ sni_lowercase() */
+static int sni_lowercase (char *dst, const char *src, size_t dst_len)
+{
+	size_t i;
+	for (i=0; src[i]; i++)
+	{
+		if (i+1 >= dst_len)
+			return 0;
+		dst[i] = (char) tolower ((unsigned char) src[i]);
+	}
+	dst[i] = '\0';
+
+	/* Ignore any trailing dot on fully-qualified names. */
+	if (i > 0 && dst[i-1] == '.')
+		dst[i-1] = '\0';
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ sni_table_unref() */
+static void sni_table_unref (struct rssl_sni_table *table)
+{
+	if (__sync_sub_and_fetch (&table->refs, 1) > 0)
+		return;
+
+	size_t i;
+	for (i=0; i<table->size; i++)
+	{
+		if (table->entries[i].name)
+		{
+			free (table->entries[i].name);
+			if (table->entries[i].ctx)
+				SSL_CTX_free (table->entries[i].ctx);
+			sni_count_unref (table->entries[i].count);
+		}
+	}
+	sni_count_unref (table->default_count);
+	free (table->entries);
+	free (table);
+}
+/* }}} */
+
+/* {{{ sni_table_find() */
+static struct rssl_sni_entry *sni_table_find (struct rssl_sni_table *table, const char *name)
+{
+	size_t mask = table->size - 1;
+	size_t i = (size_t) sni_hash (name) & mask;
+
+	while (table->entries[i].name)
+	{
+		if (0 == strcmp (table->entries[i].name, name))
+			return &table->entries[i];
+		i = (i+1) & mask;
+	}
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ sni_table_insert() */
+static struct rssl_sni_entry *sni_table_insert (struct rssl_sni_table *table, const char *name)
+{
+	size_t mask = table->size - 1;
+	size_t i = (size_t) sni_hash (name) & mask;
+
+	while (table->entries[i].name)
+	{
+		if (0 == strcmp (table->entries[i].name, name))
+			return &table->entries[i];
+		i = (i+1) & mask;
+	}
+
+	table->entries[i].name = strdup (name);
+	return &table->entries[i];
+}
+/* }}} */
+
+/* {{{ sni_table_lookup() */
+static struct rssl_sni_entry *sni_table_lookup (struct rssl_sni_table *table, const char *servername)
+{
+	char name[256];
+	if (!sni_lowercase (name, servername, sizeof (name)))
+		return NULL;
+
+	struct rssl_sni_entry *entry = sni_table_find (table, name);
+	if (entry)
+		return entry;
+
+	/* Wildcards only ever match the left-most label. */
+	char *dot = strchr (name, '.');
+	if (!dot || dot == name)
+		return NULL;
+	*(--dot) = '*';
+
+	return sni_table_find (table, dot);
+}
+/* }}} */
+
+/* {{{ sni_table_acquire() */
+static struct rssl_sni_table *sni_table_acquire (struct rssl_ctx *ctx)
+{
+	sni_lock (ctx);
+	struct rssl_sni_table *table = ctx->sni;
+	if (table)
+		__sync_add_and_fetch (&table->refs, 1);
+	sni_unlock (ctx);
+
+	return table;
+}
+/* }}} */
+
+/* {{{ sni_servername_cb() */
+static int sni_servername_cb (SSL *ssl, int *ad, void *arg)
+{
+	/* This may run in a handshake offload worker, so Lua is off limits. */
+	struct rssl_ctx *ctx = (struct rssl_ctx *) arg;
+	struct rssl_sni_table *table = sni_table_acquire (ctx);
+	if (!table)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	const char *servername = SSL_get_servername (ssl, TLSEXT_NAMETYPE_host_name);
+	struct rssl_sni_entry *entry = (servername ? sni_table_lookup (table, servername) : NULL);
+	struct rssl_sni_count *count = table->default_count;
+	if (entry)
+	{
+		SSL_set_SSL_CTX (ssl, entry->ctx);
+		SSL_set_verify (ssl, SSL_CTX_get_verify_mode (entry->ctx), SSL_CTX_get_verify_callback (entry->ctx));
+		count = entry->count;
+	}
+
+	/* The count is taken when the handshake finishes, which may be after
+	 * the table has been replaced, so the session holds on to it. */
+	struct rssl_stats *stats = stats_get (ssl);
+	if (stats)
+	{
+		__sync_add_and_fetch (&count->refs, 1);
+		sni_count_unref (stats->sni_count);
+		stats->sni_count = count;
+	}
+
+	sni_table_unref (table);
+
+	return SSL_TLSEXT_ERR_OK;
+}
+/* }}} */
+
+/* {{{ sni_count_share() */
+static struct rssl_sni_count *sni_count_share (struct rssl_sni_count *old)
+{
+	/* Tables built from one another share counters, so a count taken
+	 * during a reload is never lost. */
+	if (old)
+	{
+		__sync_add_and_fetch (&old->refs, 1);
+		return old;
+	}
+
+	struct rssl_sni_count *count = (struct rssl_sni_count *) calloc (1, sizeof (struct rssl_sni_count));
+	if (count)
+		count->refs = 1;
+	return count;
+}
+/* }}} */
+
+/* {{{ sni_table_check() */
+static size_t sni_table_check (lua_State *L, int index)
+{
+	size_t num = 0;
+	for (lua_pushnil (L); lua_next (L, index); lua_pop (L, 1))
+	{
+		if (lua_type (L, -2) != LUA_TSTRING || !luaL_testudata (L, -1, "ratchet_ssl_ctx_meta"))
+			luaL_argerror (L, index, "Table of hostnames to ssl context objects expected.");
+		num++;
+	}
+	return num;
+}
+/* }}} */
+
+/* {{{ sni_table_new() */
+static struct rssl_sni_table *sni_table_new (lua_State *L, int index, size_t num, struct rssl_sni_table *old)
+{
+	/* Does not raise errors, the table must pass sni_table_check() first. */
+	size_t size = 8;
+	while (size < num*2)
+		size <<= 1;
+
+	struct rssl_sni_table *table = (struct rssl_sni_table *) calloc (1, sizeof (struct rssl_sni_table));
+	if (!table)
+		return NULL;
+	table->entries = (struct rssl_sni_entry *) calloc (size, sizeof (struct rssl_sni_entry));
+	if (!table->entries)
+	{
+		free (table);
+		return NULL;
+	}
+	table->size = size;
+	table->refs = 1;
+	table->default_count = sni_count_share (old ? old->default_count : NULL);
+	if (!table->default_count)
+	{
+		sni_table_unref (table);
+		return NULL;
+	}
+
+	for (lua_pushnil (L); lua_next (L, index); lua_pop (L, 1))
+	{
+		char name[256];
+		if (!sni_lowercase (name, lua_tostring (L, -2), sizeof (name)))
+			continue;
+
+		struct rssl_sni_entry *entry = sni_table_insert (table, name);
+		if (!entry->name)
+			continue;
+		if (entry->ctx)
+			SSL_CTX_free (entry->ctx);
+		entry->ctx = get_ssl_ctx (L, -1)->ctx;
+		ssl_ctx_up_ref (entry->ctx);
+
+		/* Handshake counts survive a reload for hostnames that remain. */
+		if (!entry->count)
+		{
+			struct rssl_sni_entry *old_entry = (old ? sni_table_find (old, name) : NULL);
+			entry->count = sni_count_share (old_entry ? old_entry->count : NULL);
+			if (!entry->count)
+			{
+				sni_table_unref (table);
+				return NULL;
+			}
+		}
+	}
+
+	return table;
+}
+/* }}} */
+
 /* ---- Namespace Functions ------------------------------------------------- */
 
+/* {{{ rssl_buffer_new() */
+static int rssl_buffer_new (lua_State *L)
+{
+	size_t cap = (size_t) luaL_optunsigned (L, 1, (lua_Unsigned) SSL_RECORD_SIZE);
+
+	struct rssl_buffer *buffer = (struct rssl_buffer *) lua_newuserdata (L, sizeof (struct rssl_buffer));
+	memset (buffer, 0, sizeof (struct rssl_buffer));
+	luaL_setmetatable (L, "ratchet_ssl_buffer_meta");
+
+	if (cap > 0)
+	{
+		buffer->data = (char *) malloc (cap);
+		if (!buffer->data)
+			return luaL_error (L, "Could not allocate %u byte buffer", (unsigned) cap);
+		buffer->cap = cap;
+	}
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rssl_memory_usage() */
+static int rssl_memory_usage (lua_State *L)
+{
+	if (ssl_mem_counting > 0)
+		lua_pushnumber (L, (lua_Number) __sync_fetch_and_add (&ssl_mem_bytes, 0));
+	else
+		lua_pushnil (L);
+	lua_pushnumber (L, (lua_Number) __sync_fetch_and_add (&ssl_mem_sessions, 0));
+
+	return 2;
+}
+/* }}} */
+
 /* {{{ rssl_ctx_new() */
 static int rssl_ctx_new (lua_State *L)
 {
@@ -126,18 +1268,84 @@ static int rssl_ctx_new (lua_State *L)
 		return luaL_error (L, "Creation of SSL_CTX object failed");
 
 	/* Set up Lua object. */
-	SSL_CTX **new = (SSL_CTX **) lua_newuserdata (L, sizeof (SSL_CTX *));
-	*new = ctx;
+	struct rssl_ctx *new = (struct rssl_ctx *) lua_newuserdata (L, sizeof (struct rssl_ctx));
+	memset (new, 0, sizeof (struct rssl_ctx));
+	new->ctx = ctx;
+	sni_lock_init (new);
 
 	luaL_getmetatable (L, "ratchet_ssl_ctx_meta");
 	lua_setmetatable (L, -2);
 
-	lua_createtable (L, 0, 1);
-	lua_pushvalue (L, 2);
-	lua_setfield (L, -2, "password");
-	lua_setuservalue (L, -2);
+	lua_createtable (L, 0, 1);
+	lua_pushvalue (L, 2);
+	lua_setfield (L, -2, "password");
+	lua_setuservalue (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* ---- Buffer Functions ---------------------------------------------------- */
+
+/* {{{ rssl_buffer_gc() */
+static int rssl_buffer_gc (lua_State *L)
+{
+	struct rssl_buffer *buffer = get_ssl_buffer (L, 1);
+	free (buffer->data);
+	buffer->data = NULL;
+	buffer->len = buffer->cap = 0;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rssl_buffer_len() */
+static int rssl_buffer_len (lua_State *L)
+{
+	struct rssl_buffer *buffer = get_ssl_buffer (L, 1);
+	lua_pushunsigned (L, (lua_Unsigned) buffer->len);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rssl_buffer_tostring() */
+static int rssl_buffer_tostring (lua_State *L)
+{
+	struct rssl_buffer *buffer = get_ssl_buffer (L, 1);
+	lua_pushlstring (L, buffer->data ? buffer->data : "", buffer->len);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rssl_buffer_clear() */
+static int rssl_buffer_clear (lua_State *L)
+{
+	struct rssl_buffer *buffer = get_ssl_buffer (L, 1);
+	buffer->len = 0;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rssl_buffer_reserve() */
+static char *rssl_buffer_reserve (struct rssl_buffer *buffer, size_t extra)
+{
+	if (buffer->cap - buffer->len < extra)
+	{
+		size_t cap = (buffer->cap ? buffer->cap : SSL_RECORD_SIZE);
+		while (cap - buffer->len < extra)
+			cap *= 2;
+
+		char *data = (char *) realloc (buffer->data, cap);
+		if (!data)
+			return NULL;
+		buffer->data = data;
+		buffer->cap = cap;
+	}
 
-	return 1;
+	return buffer->data + buffer->len;
 }
 /* }}} */
 
@@ -146,10 +1354,19 @@ static int rssl_ctx_new (lua_State *L)
 /* {{{ rssl_ctx_gc() */
 static int rssl_ctx_gc (lua_State *L)
 {
-	SSL_CTX **ctx = (SSL_CTX **) luaL_checkudata (L, 1, "ratchet_ssl_ctx_meta");
-	if (*ctx)
-		SSL_CTX_free (*ctx);
-	*ctx = NULL;
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
+	if (ctx->offload)
+		offload_free (ctx->offload);
+	ctx->offload = NULL;
+	if (ctx->sni)
+		sni_table_unref (ctx->sni);
+	ctx->sni = NULL;
+	if (ctx->ctx)
+	{
+		SSL_CTX_free (ctx->ctx);
+		sni_lock_destroy (ctx);
+	}
+	ctx->ctx = NULL;
 
 	return 0;
 }
@@ -158,7 +1375,7 @@ static int rssl_ctx_gc (lua_State *L)
 /* {{{ rssl_ctx_create_session() */
 static int rssl_ctx_create_session (lua_State *L)
 {
-	SSL_CTX *ctx = *(SSL_CTX **) luaL_checkudata (L, 1, "ratchet_ssl_ctx_meta");
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
 	luaL_checkany (L, 2);
 	luaL_checktype (L, 3, LUA_TLIGHTUSERDATA);
 	BIO *rbio = (BIO *) lua_topointer (L, 3);
@@ -169,22 +1386,31 @@ static int rssl_ctx_create_session (lua_State *L)
 		wbio = (BIO *) lua_topointer (L, 4);
 	}
 
-	SSL *ssl = SSL_new (ctx);
+	SSL *ssl = SSL_new (ctx->ctx);
 	if (!ssl)
 		return luaL_error (L, "Could not create SSL object");
 	SSL_set_bio (ssl, rbio, wbio);
+	if (!stats_new (ssl, ctx))
+	{
+		SSL_free (ssl);
+		return luaL_error (L, "Could not allocate SSL statistics");
+	}
 
 	/* Set up Lua object. */
-	SSL **new = (SSL **) lua_newuserdata (L, sizeof (SSL *));
-	*new = ssl;
+	struct rssl_session *new = (struct rssl_session *) lua_newuserdata (L, sizeof (struct rssl_session));
+	memset (new, 0, sizeof (struct rssl_session));
+	new->ssl = ssl;
+	new->offload = ctx->offload;
 
 	luaL_getmetatable (L, "ratchet_ssl_session_meta");
 	lua_setmetatable (L, -2);
 
-	/* Save the engine for later. */
-	lua_createtable (L, 0, 1);
+	/* Save the engine for later, and keep the context alive. */
+	lua_createtable (L, 0, 2);
 	lua_pushvalue (L, 2);
 	lua_setfield (L, -2, "engine");
+	lua_pushvalue (L, 1);
+	lua_setfield (L, -2, "ctx");
 	lua_setuservalue (L, -2);
 
 	return 1;
@@ -327,18 +1553,242 @@ static int rssl_ctx_generate_tmp_rsa (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rssl_ctx_set_sni_contexts() */
+static int rssl_ctx_set_sni_contexts (lua_State *L)
+{
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
+	struct rssl_sni_table *table = NULL;
+	if (!lua_isnoneornil (L, 2))
+		luaL_checktype (L, 2, LUA_TTABLE);
+	lua_settop (L, 2);
+
+	if (!lua_isnil (L, 2))
+	{
+		/* Checked before acquiring, an error would leak the reference. */
+		size_t num = sni_table_check (L, 2);
+		struct rssl_sni_table *old = sni_table_acquire (ctx);
+		table = sni_table_new (L, 2, num, old);
+		if (old)
+			sni_table_unref (old);
+		if (!table)
+			return luaL_error (L, "Could not allocate SNI table");
+	}
+
+	/* Handshakes already in progress keep using the table they acquired. */
+	sni_lock (ctx);
+	struct rssl_sni_table *old = ctx->sni;
+	ctx->sni = table;
+	sni_unlock (ctx);
+	if (old)
+		sni_table_unref (old);
+
+	SSL_CTX_set_tlsext_servername_arg (ctx->ctx, ctx);
+	SSL_CTX_set_tlsext_servername_callback (ctx->ctx, (table ? sni_servername_cb : NULL));
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rssl_ctx_get_sni_counts() */
+static int rssl_ctx_get_sni_counts (lua_State *L)
+{
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
+	struct rssl_sni_table *table = sni_table_acquire (ctx);
+	if (!table)
+	{
+		lua_newtable (L);
+		return 1;
+	}
+
+	size_t i;
+	lua_createtable (L, 0, (int) table->size / 2);
+	for (i=0; i<table->size; i++)
+	{
+		if (table->entries[i].name)
+		{
+			lua_pushnumber (L, (lua_Number) table->entries[i].count->handshakes);
+			lua_setfield (L, -2, table->entries[i].name);
+		}
+	}
+	lua_pushnumber (L, (lua_Number) table->default_count->handshakes);
+
+	sni_table_unref (table);
+
+	return 2;
+}
+/* }}} */
+
+/* {{{ rssl_ctx_stats() */
+static int rssl_ctx_stats (lua_State *L)
+{
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
+	struct rssl_ctx_stats *stats = &ctx->stats;
+
+	lua_createtable (L, 0, 16);
+
+	lua_pushnumber (L, (lua_Number) (stats->handshakes_full + stats->handshakes_resumed));
+	lua_setfield (L, -2, "handshakes");
+	lua_pushnumber (L, (lua_Number) stats->handshakes_full);
+	lua_setfield (L, -2, "full_handshakes");
+	lua_pushnumber (L, (lua_Number) stats->handshakes_resumed);
+	lua_setfield (L, -2, "resumed_handshakes");
+	lua_pushnumber (L, (lua_Number) stats->handshake_failures);
+	lua_setfield (L, -2, "failed_handshakes");
+	lua_pushnumber (L, (lua_Number) stats->handshake_wall);
+	lua_setfield (L, -2, "handshake_time");
+	lua_pushnumber (L, (lua_Number) stats->handshake_cpu);
+	lua_setfield (L, -2, "handshake_cpu");
+	lua_pushnumber (L, (lua_Number) stats->plain_in);
+	lua_setfield (L, -2, "bytes_read");
+	lua_pushnumber (L, (lua_Number) stats->plain_out);
+	lua_setfield (L, -2, "bytes_written");
+	lua_pushnumber (L, (lua_Number) stats->wire_in);
+	lua_setfield (L, -2, "wire_bytes_read");
+	lua_pushnumber (L, (lua_Number) stats->wire_out);
+	lua_setfield (L, -2, "wire_bytes_written");
+	lua_pushnumber (L, (lua_Number) stats->renegotiations);
+	lua_setfield (L, -2, "renegotiations");
+	lua_pushnumber (L, (lua_Number) stats->alerts_sent);
+	lua_setfield (L, -2, "alerts_sent");
+	lua_pushnumber (L, (lua_Number) stats->alerts_received);
+	lua_setfield (L, -2, "alerts_received");
+
+	int result = lua_gettop (L);
+	lua_getuservalue (L, 1);
+	stats_copy_names (L, result+1, result, "protocols");
+	stats_copy_names (L, result+1, result, "ciphers");
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rssl_ctx_set_idle_memory_mode() */
+static int rssl_ctx_set_idle_memory_mode (lua_State *L)
+{
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
+	int enable = (lua_isnoneornil (L, 2) ? 1 : lua_toboolean (L, 2));
+
+	if (enable)
+		SSL_CTX_set_mode (ctx->ctx, SSL_MODE_RELEASE_BUFFERS);
+	else
+		SSL_CTX_clear_mode (ctx->ctx, SSL_MODE_RELEASE_BUFFERS);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rssl_ctx_set_handshake_offload() */
+static int rssl_ctx_set_handshake_offload (lua_State *L)
+{
+	struct rssl_ctx *ctx = get_ssl_ctx (L, 1);
+	long def_threads = sysconf (_SC_NPROCESSORS_ONLN);
+	int threads = luaL_optint (L, 2, (def_threads > 0 ? (int) def_threads : 1));
+	if (threads <= 0)
+		return luaL_argerror (L, 2, "Number of threads must be positive.");
+
+#if HAVE_SSL_OFFLOAD
+	/* Existing sessions hold on to the pool, so it cannot be replaced. */
+	if (ctx->offload)
+		return luaL_error (L, "Handshake offload already enabled on SSL context");
+
+	ctx->offload = offload_new (threads);
+	if (!ctx->offload)
+		return ratchet_error_errno (L, "ratchet.ssl.set_handshake_offload()", "pthread_create");
+
+	return 0;
+#else
+	(void) ctx;
+	return ratchet_error_str (L, "ratchet.ssl.set_handshake_offload()", "ENOTSUP", "Handshake offload is not supported.");
+#endif
+}
+/* }}} */
+
 /* {{{ rssl_session_gc() */
 static int rssl_session_gc (lua_State *L)
 {
-	SSL **session = (SSL **) luaL_checkudata (L, 1, "ratchet_ssl_session_meta");
-	if (*session)
-		SSL_free (*session);
-	*session = NULL;
+	struct rssl_session *session = get_ssl_session (L, 1);
+	struct rssl_offload_job *job = session->job;
+
+#if HAVE_SSL_OFFLOAD
+	if (job)
+	{
+		/* A worker may still be using the SSL object, let it clean up. */
+		pthread_mutex_lock (&job->offload->lock);
+		if (job->in_flight)
+			job->owns_ssl = 1;
+		else if (session->ssl)
+			SSL_free (session->ssl);
+		offload_job_unref (job);
+		pthread_mutex_unlock (&job->offload->lock);
+	}
+	else
+#else
+	(void) job;
+#endif
+	if (session->ssl)
+		SSL_free (session->ssl);
+	session->ssl = NULL;
+	session->job = NULL;
+
+	return 0;
+}
+/* }}} */
+
+#if HAVE_SSL_OFFLOAD
+/* {{{ rssl_offload_gc() */
+static int rssl_offload_gc (lua_State *L)
+{
+	struct rssl_offload_job **job = (struct rssl_offload_job **) luaL_checkudata (L, 1, "ratchet_ssl_offload_meta");
+	if (*job)
+	{
+		struct rssl_offload *offload = (*job)->offload;
+		pthread_mutex_lock (&offload->lock);
+		offload_job_unref (*job);
+		pthread_mutex_unlock (&offload->lock);
+	}
+	*job = NULL;
 
 	return 0;
 }
 /* }}} */
 
+/* {{{ rssl_offload_get_fd() */
+static int rssl_offload_get_fd (lua_State *L)
+{
+	struct rssl_offload_job *job = *(struct rssl_offload_job **) luaL_checkudata (L, 1, "ratchet_ssl_offload_meta");
+	lua_pushinteger (L, job ? job->efd : -1);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rssl_offload_get_timeout() */
+static int rssl_offload_get_timeout (lua_State *L)
+{
+	(void) luaL_checkudata (L, 1, "ratchet_ssl_offload_meta");
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "engine");
+	if (lua_isnil (L, -1))
+	{
+		lua_pushnumber (L, -1.0);
+		return 1;
+	}
+
+	lua_getfield (L, -1, "get_timeout");
+	if (lua_isnil (L, -1))
+	{
+		lua_pushnumber (L, -1.0);
+		return 1;
+	}
+	lua_insert (L, -2);
+	lua_call (L, 1, 1);
+
+	return 1;
+}
+/* }}} */
+#endif
+
 /* {{{ rssl_session_get_engine() */
 static int rssl_session_get_engine (lua_State *L)
 {
@@ -457,6 +1907,65 @@ static int rssl_session_get_cipher (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rssl_session_stats() */
+static int rssl_session_stats (lua_State *L)
+{
+	SSL *session = *(SSL **) luaL_checkudata (L, 1, "ratchet_ssl_session_meta");
+	struct rssl_stats *stats = stats_get (session);
+	if (!stats)
+		return luaL_error (L, "No statistics for this session");
+
+	stats_update_io (session, 0, 0);
+
+	lua_createtable (L, 0, 13);
+
+	lua_pushboolean (L, stats->handshake_done);
+	lua_setfield (L, -2, "handshake_done");
+	if (stats->handshake_done)
+	{
+		lua_pushboolean (L, stats->resumed);
+		lua_setfield (L, -2, "resumed");
+		lua_pushnumber (L, (lua_Number) stats->handshake_wall);
+		lua_setfield (L, -2, "handshake_time");
+		lua_pushstring (L, SSL_get_version (session));
+		lua_setfield (L, -2, "protocol");
+		lua_pushstring (L, SSL_get_cipher (session));
+		lua_setfield (L, -2, "cipher");
+	}
+	lua_pushnumber (L, (lua_Number) stats->handshake_cpu);
+	lua_setfield (L, -2, "handshake_cpu");
+	lua_pushnumber (L, (lua_Number) stats->plain_in);
+	lua_setfield (L, -2, "bytes_read");
+	lua_pushnumber (L, (lua_Number) stats->plain_out);
+	lua_setfield (L, -2, "bytes_written");
+	lua_pushnumber (L, (lua_Number) stats->wire_in);
+	lua_setfield (L, -2, "wire_bytes_read");
+	lua_pushnumber (L, (lua_Number) stats->wire_out);
+	lua_setfield (L, -2, "wire_bytes_written");
+	lua_pushnumber (L, (lua_Number) stats->renegotiations);
+	lua_setfield (L, -2, "renegotiations");
+	lua_pushnumber (L, (lua_Number) stats->alerts_sent);
+	lua_setfield (L, -2, "alerts_sent");
+	lua_pushnumber (L, (lua_Number) stats->alerts_received);
+	lua_setfield (L, -2, "alerts_received");
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rssl_session_set_server_name() */
+static int rssl_session_set_server_name (lua_State *L)
+{
+	struct rssl_session *session = get_ssl_session (L, 1);
+	const char *name = luaL_checkstring (L, 2);
+
+	if (!SSL_set_tlsext_host_name (session->ssl, name))
+		return luaL_error (L, "Could not set server name: %s", name);
+
+	return 0;
+}
+/* }}} */
+
 /* {{{ rssl_session_shutdown() */
 static int rssl_session_shutdown (lua_State *L)
 {
@@ -474,6 +1983,7 @@ static int rssl_session_shutdown (lua_State *L)
 		ret = SSL_shutdown (session);
 	int orig_errno = errno;
 	signal (SIGPIPE, old);
+	stats_update_io (session, 0, 0);
 
 	unsigned long error = SSL_get_error (session, ret);
 	switch (error)
@@ -534,6 +2044,7 @@ static int rssl_session_read (lua_State *L)
 	int ret = SSL_read (session, prepped, len);
 	int orig_errno = errno;
 	signal (SIGPIPE, old);
+	stats_update_io (session, ret, 0);
 
 	unsigned long error = SSL_get_error (session, ret);
 	switch (error)
@@ -569,6 +2080,76 @@ static int rssl_session_read (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rssl_session_read_into() */
+static int rssl_session_read_into (lua_State *L)
+{
+	SSL *session = *(SSL **) luaL_checkudata (L, 1, "ratchet_ssl_session_meta");
+	struct rssl_buffer *buffer = get_ssl_buffer (L, 2);
+	size_t max = (size_t) luaL_optunsigned (L, 3, (lua_Unsigned) SSL_RECORD_SIZE);
+	if (max == 0 || max > INT_MAX)
+		return luaL_argerror (L, 3, "Invalid maximum read size.");
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 4))
+		return ratchet_error_str (L, "ratchet.ssl.session.read_into()", "ETIMEDOUT", "Timed out on read.");
+	lua_settop (L, 3);
+
+	char *dest = rssl_buffer_reserve (buffer, max);
+	if (!dest)
+		return luaL_error (L, "Could not grow buffer by %u bytes", (unsigned) max);
+
+	/* Keep reading while OpenSSL has decrypted data ready, to fill max
+	 * without yielding back to the event loop between records. */
+	size_t total = 0;
+	signal_handler old = signal (SIGPIPE, SIG_IGN);
+	int ret, orig_errno;
+	do
+	{
+		ret = SSL_read (session, dest+total, (int) (max-total));
+		orig_errno = errno;
+		if (ret > 0)
+			total += (size_t) ret;
+	} while (ret > 0 && total < max && SSL_pending (session) > 0);
+	signal (SIGPIPE, old);
+	stats_update_io (session, (int) total, 0);
+
+	if (total > 0)
+	{
+		buffer->len += total;
+		lua_pushunsigned (L, (lua_Unsigned) total);
+		return 1;
+	}
+
+	unsigned long error = SSL_get_error (session, ret);
+	switch (error)
+	{
+		case SSL_ERROR_ZERO_RETURN:
+			lua_pushinteger (L, 0);
+			return 1;
+
+		case SSL_ERROR_WANT_READ:
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_getuservalue (L, 1);
+			lua_getfield (L, -1, "engine");
+			lua_remove (L, -2);
+			return lua_yieldk (L, 2, 1, rssl_session_read_into);
+
+		case SSL_ERROR_WANT_WRITE:
+			lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
+			lua_getuservalue (L, 1);
+			lua_getfield (L, -1, "engine");
+			lua_remove (L, -2);
+			return lua_yieldk (L, 2, 1, rssl_session_read_into);
+
+		default:
+			return handle_ssl_error (L, "ratchet.ssl.session.read_into()", ret, error, orig_errno);
+	}
+
+	return luaL_error (L, "unreachable");
+}
+/* }}} */
+
 /* {{{ rssl_session_write() */
 static int rssl_session_write (lua_State *L)
 {
@@ -588,6 +2169,7 @@ static int rssl_session_write (lua_State *L)
 	int ret = SSL_write (session, data, (int) size);
 	int orig_errno = errno;
 	signal (SIGPIPE, old);
+	stats_update_io (session, 0, ret);
 
 	unsigned long error = SSL_get_error (session, ret);
 	switch (error)
@@ -617,26 +2199,131 @@ static int rssl_session_write (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rssl_session_write_all() */
+static int rssl_session_write_all (lua_State *L)
+{
+	struct rssl_session *session = get_ssl_session (L, 1);
+	size_t size;
+	const char *data = luaL_checklstring (L, 2, &size);
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 3))
+		return ratchet_error_str (L, "ratchet.ssl.session.write_all()", "ETIMEDOUT", "Timed out on write.");
+	lua_settop (L, 2);
+
+	if (ctx == 0)
+	{
+		/* Hand OpenSSL one record at a time, so it never buffers a copy of
+		 * the whole string. A record is written whole or retried with the
+		 * same arguments, so no write modes are changed on the session. */
+		session->write_done = 0;
+		session->write_total = size;
+	}
+
+	ERR_clear_error ();
+
+	signal_handler old = signal (SIGPIPE, SIG_IGN);
+	int ret = 1, orig_errno = 0;
+	while (session->write_done < size)
+	{
+		size_t chunk = size - session->write_done;
+		if (chunk > SSL_RECORD_SIZE)
+			chunk = SSL_RECORD_SIZE;
+
+		ret = SSL_write (session->ssl, data + session->write_done, (int) chunk);
+		orig_errno = errno;
+		if (ret <= 0)
+			break;
+		session->write_done += (size_t) ret;
+		stats_update_io (session->ssl, 0, ret);
+	}
+	signal (SIGPIPE, old);
+
+	if (session->write_done >= size)
+		return 0;
+
+	unsigned long error = SSL_get_error (session->ssl, ret);
+	switch (error)
+	{
+		case SSL_ERROR_WANT_READ:
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_getuservalue (L, 1);
+			lua_getfield (L, -1, "engine");
+			lua_remove (L, -2);
+			return lua_yieldk (L, 2, 1, rssl_session_write_all);
+
+		case SSL_ERROR_WANT_WRITE:
+			lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
+			lua_getuservalue (L, 1);
+			lua_getfield (L, -1, "engine");
+			lua_remove (L, -2);
+			return lua_yieldk (L, 2, 1, rssl_session_write_all);
+
+		default:
+			return handle_ssl_error (L, "ratchet.ssl.session.write_all()", ret, error, orig_errno);
+	}
+
+	return luaL_error (L, "unreachable");
+}
+/* }}} */
+
+/* {{{ rssl_session_get_write_progress() */
+static int rssl_session_get_write_progress (lua_State *L)
+{
+	struct rssl_session *session = get_ssl_session (L, 1);
+
+	lua_pushunsigned (L, (lua_Unsigned) session->write_done);
+	lua_pushunsigned (L, (lua_Unsigned) session->write_total);
+
+	return 2;
+}
+/* }}} */
+
 /* {{{ rssl_session_connect() */
 static int rssl_session_connect (lua_State *L)
 {
-	SSL *session = *(SSL **) luaL_checkudata (L, 1, "ratchet_ssl_session_meta");
+	struct rssl_session *session = get_ssl_session (L, 1);
+	int ret, orig_errno;
+	unsigned long error;
 
 	int ctx = 0;
 	lua_getctx (L, &ctx);
-	if (ctx == 1 && !lua_toboolean (L, 2))
+	if (ctx != 0 && !lua_toboolean (L, 2))
 		return ratchet_error_str (L, "ratchet.ssl.session.client_handshake()", "ETIMEDOUT", "Timed out on client_handshake.");
 	lua_settop (L, 1);
 
-	signal_handler old = signal (SIGPIPE, SIG_IGN);
-	int ret = SSL_connect (session);
-	int orig_errno = errno;
-	signal (SIGPIPE, old);
+	/* After a timed out step, the worker may still hold the SSL object. */
+	if (ctx == 0 && offload_in_flight (session->job))
+		return ratchet_error_str (L, "ratchet.ssl.session.client_handshake()", "EBUSY", "Previous client_handshake step still running.");
+
+	if (session->offload)
+	{
+		/* Run the CPU-bound handshake step in a worker thread, ctx 2 means
+		 * the worker has signalled completion on the eventfd. */
+		if (ctx != 2 || !offload_job_done (session->job))
+			return offload_handshake (L, session, OFFLOAD_CONNECT, (ctx != 2), rssl_session_connect);
+		ret = session->job->ret;
+		error = session->job->error;
+		orig_errno = session->job->orig_errno;
+	}
+	else
+	{
+		double cpu_start = stats_handshake_step (session->ssl);
+		signal_handler old = signal (SIGPIPE, SIG_IGN);
+		ret = SSL_connect (session->ssl);
+		orig_errno = errno;
+		signal (SIGPIPE, old);
+		stats_handshake_cpu (session->ssl, cpu_start);
+
+		error = SSL_get_error (session->ssl, ret);
+	}
 
-	unsigned long error = SSL_get_error (session, ret);
 	switch (error)
 	{
 		case SSL_ERROR_NONE:
+			stats_handshake_done (L, session->ssl, 1);
+			offload_release (L, session);
 			return 0;
 
 		case SSL_ERROR_WANT_READ:
@@ -654,6 +2341,9 @@ static int rssl_session_connect (lua_State *L)
 			return lua_yieldk (L, 2, 1, rssl_session_connect);
 
 		default:
+			stats_handshake_done (L, session->ssl, 0);
+			if (session->job)
+				return offload_handshake_error (L, session, "ratchet.ssl.session.client_handshake()");
 			return handle_ssl_error (L, "ratchet.ssl.session.client_handshake()", ret, error, orig_errno);
 	}
 
@@ -664,23 +2354,47 @@ static int rssl_session_connect (lua_State *L)
 /* {{{ rssl_session_accept() */
 static int rssl_session_accept (lua_State *L)
 {
-	SSL *session = *(SSL **) luaL_checkudata (L, 1, "ratchet_ssl_session_meta");
+	struct rssl_session *session = get_ssl_session (L, 1);
+	int ret, orig_errno;
+	unsigned long error;
 
 	int ctx = 0;
 	lua_getctx (L, &ctx);
-	if (ctx == 1 && !lua_toboolean (L, 2))
+	if (ctx != 0 && !lua_toboolean (L, 2))
 		return ratchet_error_str (L, "ratchet.ssl.session.server_handshake()", "ETIMEDOUT", "Timed out on server_handshake.");
 	lua_settop (L, 1);
 
-	signal_handler old = signal (SIGPIPE, SIG_IGN);
-	int ret = SSL_accept (session);
-	int orig_errno = errno;
-	signal (SIGPIPE, old);
+	/* After a timed out step, the worker may still hold the SSL object. */
+	if (ctx == 0 && offload_in_flight (session->job))
+		return ratchet_error_str (L, "ratchet.ssl.session.server_handshake()", "EBUSY", "Previous server_handshake step still running.");
+
+	if (session->offload)
+	{
+		/* Run the CPU-bound handshake step in a worker thread, ctx 2 means
+		 * the worker has signalled completion on the eventfd. */
+		if (ctx != 2 || !offload_job_done (session->job))
+			return offload_handshake (L, session, OFFLOAD_ACCEPT, (ctx != 2), rssl_session_accept);
+		ret = session->job->ret;
+		error = session->job->error;
+		orig_errno = session->job->orig_errno;
+	}
+	else
+	{
+		double cpu_start = stats_handshake_step (session->ssl);
+		signal_handler old = signal (SIGPIPE, SIG_IGN);
+		ret = SSL_accept (session->ssl);
+		orig_errno = errno;
+		signal (SIGPIPE, old);
+		stats_handshake_cpu (session->ssl, cpu_start);
+
+		error = SSL_get_error (session->ssl, ret);
+	}
 
-	unsigned long error = SSL_get_error (session, ret);
 	switch (error)
 	{
 		case SSL_ERROR_NONE:
+			stats_handshake_done (L, session->ssl, 1);
+			offload_release (L, session);
 			return 0;
 
 		case SSL_ERROR_WANT_READ:
@@ -698,6 +2412,9 @@ static int rssl_session_accept (lua_State *L)
 			return lua_yieldk (L, 2, 1, rssl_session_accept);
 
 		default:
+			stats_handshake_done (L, session->ssl, 0);
+			if (session->job)
+				return offload_handshake_error (L, session, "ratchet.ssl.session.server_handshake()");
 			return handle_ssl_error (L, "ratchet.ssl.session.server_handshake()", ret, error, orig_errno);
 	}
 
@@ -751,6 +2468,8 @@ int luaopen_ratchet_ssl (lua_State *L)
 {
 	const luaL_Reg funcs[] = {
 		{"new", rssl_ctx_new},
+		{"new_buffer", rssl_buffer_new},
+		{"memory_usage", rssl_memory_usage},
 		{NULL}
 	};
 
@@ -763,6 +2482,11 @@ int luaopen_ratchet_ssl (lua_State *L)
 		{"load_randomness", rssl_ctx_load_randomness},
 		{"load_dh_params", rssl_ctx_load_dh_params},
 		{"generate_tmp_rsa", rssl_ctx_generate_tmp_rsa},
+		{"set_handshake_offload", rssl_ctx_set_handshake_offload},
+		{"set_sni_contexts", rssl_ctx_set_sni_contexts},
+		{"get_sni_counts", rssl_ctx_get_sni_counts},
+		{"stats", rssl_ctx_stats},
+		{"set_idle_memory_mode", rssl_ctx_set_idle_memory_mode},
 		/* Undocumented, helper methods. */
 		{NULL}
 	};
@@ -778,8 +2502,13 @@ int luaopen_ratchet_ssl (lua_State *L)
 		{"verify_certificate", rssl_session_verify_certificate},
 		{"get_rfc2253", rssl_session_get_rfc2253},
 		{"get_cipher", rssl_session_get_cipher},
+		{"stats", rssl_session_stats},
+		{"set_server_name", rssl_session_set_server_name},
 		{"read", rssl_session_read},
 		{"write", rssl_session_write},
+		{"read_into", rssl_session_read_into},
+		{"write_all", rssl_session_write_all},
+		{"get_write_progress", rssl_session_get_write_progress},
 		{"shutdown", rssl_session_shutdown},
 		{"connect", rssl_session_connect},
 		{"accept", rssl_session_accept},
@@ -794,6 +2523,19 @@ int luaopen_ratchet_ssl (lua_State *L)
 		{NULL}
 	};
 
+#if HAVE_SSL_OFFLOAD
+	const luaL_Reg offloadmeths[] = {
+		{"get_fd", rssl_offload_get_fd},
+		{"get_timeout", rssl_offload_get_timeout},
+		{NULL}
+	};
+
+	const luaL_Reg offloadmetameths[] = {
+		{"__gc", rssl_offload_gc},
+		{NULL}
+	};
+#endif
+
 	luaL_newmetatable (L, "ratchet_ssl_ctx_meta");
 	lua_newtable (L);
 	luaL_setfuncs (L, ctxmeths, 0);
@@ -808,6 +2550,38 @@ int luaopen_ratchet_ssl (lua_State *L)
 	luaL_setfuncs (L, sslmetameths, 0);
 	lua_pop (L, 1);
 
+	const luaL_Reg buffermeths[] = {
+		/* Documented methods. */
+		{"tostring", rssl_buffer_tostring},
+		{"clear", rssl_buffer_clear},
+		{"len", rssl_buffer_len},
+		/* Undocumented, helper methods. */
+		{NULL}
+	};
+
+	const luaL_Reg buffermetameths[] = {
+		{"__gc", rssl_buffer_gc},
+		{"__len", rssl_buffer_len},
+		{"__tostring", rssl_buffer_tostring},
+		{NULL}
+	};
+
+	luaL_newmetatable (L, "ratchet_ssl_buffer_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, buffermeths, 0);
+	lua_setfield (L, -2, "__index");
+	luaL_setfuncs (L, buffermetameths, 0);
+	lua_pop (L, 1);
+
+#if HAVE_SSL_OFFLOAD
+	luaL_newmetatable (L, "ratchet_ssl_offload_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, offloadmeths, 0);
+	lua_setfield (L, -2, "__index");
+	luaL_setfuncs (L, offloadmetameths, 0);
+	lua_pop (L, 1);
+#endif
+
 	luaL_newlib (L, funcs);
 	lua_pushvalue (L, -1);
 	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_ssl_class");
@@ -815,8 +2589,11 @@ int luaopen_ratchet_ssl (lua_State *L)
 	setup_ssl_methods (L);
 
 	/* Global system initialization. */
+	setup_ssl_memory_counting ();
 	SSL_library_init ();
 	SSL_load_error_strings ();
+	if (stats_index < 0)
+		stats_index = SSL_get_ex_new_index (0, NULL, NULL, NULL, stats_free_cb);
 
 	return 1;
 }
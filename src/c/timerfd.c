@@ -29,6 +29,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <string.h>
 #include <errno.h>
 
@@ -75,6 +76,22 @@ static int rtfd_new (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rtfd_now() */
+static int rtfd_now (lua_State *L)
+{
+	static const char *lst[] = {"monotonic", "realtime", NULL};
+	static const int howlst[] = {CLOCK_MONOTONIC, CLOCK_REALTIME};
+	int how = howlst[luaL_checkoption (L, 1, "monotonic", lst)];
+
+	struct timespec now;
+	if (clock_gettime (how, &now) < 0)
+		return ratchet_error_errno (L, "ratchet.timerfd.now()", "clock_gettime");
+
+	lua_pushnumber (L, (lua_Number) fromtimespec (&now));
+	return 1;
+}
+/* }}} */
+
 /* ---- Member Functions ---------------------------------------------------- */
 
 /* {{{ rtfd_gc() */
@@ -190,6 +207,7 @@ int luaopen_ratchet_timerfd (lua_State *L)
 	/* Static functions in the ratchet.timerfd namespace. */
 	const luaL_Reg funcs[] = {
 		{"new", rtfd_new},
+		{"now", rtfd_now},
 		{NULL}
 	};
 
@@ -25,6 +25,8 @@
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include <stdlib.h>
+#include <limits.h>
 #include <math.h>
 #include <netdb.h>
 #include <string.h>
@@ -38,15 +40,67 @@
 #define RATCHET_ZMQ_IO_THREADS 10
 #endif
 
+/* Messages moved by proxy() before other threads get a turn. */
+#ifndef RATCHET_ZMQ_PROXY_BATCH
+#define RATCHET_ZMQ_PROXY_BATCH 256
+#endif
+
+/* Frames at least this long are sent straight out of the Lua string. */
+#ifndef RATCHET_ZMQ_ZEROCOPY_MIN
+#define RATCHET_ZMQ_ZEROCOPY_MIN 512
+#endif
+
+#define CHECK_OPT_GET(opt, type) if (0 == strcmp (#opt, key)) return rzmq_getsockopt_##type (L, socket, opt)
+#define CHECK_OPT_SET(opt, type) if (0 == strcmp (#opt, key)) return rzmq_setsockopt_##type (L, socket, opt, 3)
+
+#define socket_data(L, i) ((struct socket_data *) luaL_checkudata (L, i, "ratchet_zmqsocket_meta"))
 #define socket_ptr(L, i) (((struct socket_data *) luaL_checkudata (L, i, "ratchet_zmqsocket_meta"))->socket)
 #define socket_timeout(L, i) (((struct socket_data *) luaL_checkudata (L, i, "ratchet_zmqsocket_meta"))->timeout)
 
 #define raise_zmq_error(L, f) raise_zmq_error_ln (L, f, __FILE__, __LINE__)
 
+struct socket_counters
+{
+	lua_Number sent_messages;
+	lua_Number sent_bytes;
+	lua_Number received_messages;
+	lua_Number received_bytes;
+};
+
+struct socket_queue
+{
+	int refs;
+	long frames;
+	long bytes;
+};
+
+struct pinned_string;
+
+struct context_data
+{
+	void *context;
+	int io_threads;
+	int linger;
+	int sockets;
+	struct pinned_string *released;
+};
+
 struct socket_data
 {
 	void *socket;
 	double timeout;
+	struct context_data *context;
+	struct socket_queue *queue;
+	struct socket_counters counters;
+};
+
+struct pinned_string
+{
+	int ref;
+	size_t bytes;
+	struct context_data *owner;
+	struct socket_queue *queue;
+	struct pinned_string *next;
 };
 
 /* {{{ raise_zmq_error_ln() */
@@ -72,37 +126,298 @@ static int raise_zmq_error_ln (lua_State *L, const char *func, const char *file,
 }
 /* }}} */
 
+/* {{{ release_socket_queue() */
+static void release_socket_queue (struct socket_queue *queue)
+{
+	/* Shared by the socket and each of its frames still held by ZeroMQ. */
+	if (0 == __sync_sub_and_fetch (&queue->refs, 1))
+		free (queue);
+}
+/* }}} */
+
+/* {{{ release_pinned_string() */
+static void release_pinned_string (void *data, void *hint)
+{
+	/* ZeroMQ may call this from one of its I/O threads, so the reference is
+	 * only queued here and released by unpin_released_strings(). */
+	struct pinned_string *pin = (struct pinned_string *) hint;
+	struct context_data *cd = pin->owner;
+	(void) data;
+
+	__sync_fetch_and_sub (&pin->queue->frames, 1);
+	__sync_fetch_and_sub (&pin->queue->bytes, (long) pin->bytes);
+	release_socket_queue (pin->queue);
+	pin->queue = NULL;
+
+	do
+		pin->next = cd->released;
+	while (!__sync_bool_compare_and_swap (&cd->released, pin->next, pin));
+}
+/* }}} */
+
+/* {{{ unpin_released_strings() */
+static void unpin_released_strings (lua_State *L, struct context_data *cd)
+{
+	struct pinned_string *pin = __sync_lock_test_and_set (&cd->released, NULL);
+	while (pin)
+	{
+		struct pinned_string *next = pin->next;
+		luaL_unref (L, LUA_REGISTRYINDEX, pin->ref);
+		free (pin);
+		pin = next;
+	}
+}
+/* }}} */
+
+/* {{{ get_socket_events() */
+static int get_socket_events (void *socket)
+{
+	int events;
+	size_t events_len = sizeof (int);
+
+	if (-1 == zmq_getsockopt (socket, ZMQ_EVENTS, &events, &events_len))
+		return -1;
+
+	return events;
+}
+/* }}} */
+
+/* {{{ count_sent() */
+static void count_sent (struct socket_data *sd, size_t bytes, int flags)
+{
+	sd->counters.sent_bytes += (lua_Number) bytes;
+	if (!(flags & ZMQ_SNDMORE))
+		sd->counters.sent_messages++;
+}
+/* }}} */
+
+/* {{{ count_received() */
+static void count_received (struct socket_data *sd, size_t bytes, int more)
+{
+	sd->counters.received_bytes += (lua_Number) bytes;
+	if (!more)
+		sd->counters.received_messages++;
+}
+/* }}} */
+
+/* {{{ send_frame() */
+static int send_frame (lua_State *L, struct socket_data *sd, int index, int flags)
+{
+	size_t data_len;
+	const char *data = lua_tolstring (L, index, &data_len);
+
+	/* Large frames reference the Lua string, which stays pinned in the
+	 * registry until ZeroMQ is done with it. */
+	zmq_msg_t msg;
+	if (data_len < RATCHET_ZMQ_ZEROCOPY_MIN)
+	{
+		if (-1 == zmq_msg_init_size (&msg, data_len))
+			return -1;
+		memcpy (zmq_msg_data (&msg), data, data_len);
+	}
+	else
+	{
+		struct context_data *cd = sd->context;
+		unpin_released_strings (L, cd);
+
+		struct pinned_string *pin = (struct pinned_string *) malloc (sizeof (struct pinned_string));
+		if (!pin)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		lua_pushvalue (L, index);
+		pin->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		pin->bytes = data_len;
+		pin->owner = cd;
+		pin->queue = sd->queue;
+		pin->next = NULL;
+
+		if (-1 == zmq_msg_init_data (&msg, (void *) data, data_len, release_pinned_string, pin))
+		{
+			luaL_unref (L, LUA_REGISTRYINDEX, pin->ref);
+			free (pin);
+			return -1;
+		}
+		__sync_fetch_and_add (&sd->queue->refs, 1);
+		__sync_fetch_and_add (&sd->queue->frames, 1);
+		__sync_fetch_and_add (&sd->queue->bytes, (long) data_len);
+	}
+
+	int ret = zmq_send (sd->socket, &msg, flags);
+	int orig_errno = errno;
+	zmq_msg_close (&msg);
+	errno = orig_errno;
+
+	if (ret != -1)
+		count_sent (sd, data_len, flags);
+	return ret;
+}
+/* }}} */
+
 /* {{{ gc_zmq_context() */
 static int gc_zmq_context (lua_State *L)
 {
-	void **ctx = (void **) lua_touserdata (L, 1);
-	zmq_term (*ctx);
+	struct context_data *cd = (struct context_data *) luaL_checkudata (L, 1, "ratchet_zmqcontext_meta");
+	zmq_term (cd->context);
+	unpin_released_strings (L, cd);
 
 	return 0;
 }
 /* }}} */
 
 /* {{{ push_new_zmq_context() */
-static int push_new_zmq_context (lua_State *L)
+static int push_new_zmq_context (lua_State *L, int io_threads, int linger)
 {
-	void *ctx = zmq_init (RATCHET_ZMQ_IO_THREADS);
+	void *ctx = zmq_init (io_threads);
 	if (ctx)
 	{
-		void **ptr = (void **) lua_newuserdata (L, sizeof (void *));
-		*ptr = ctx;
-		lua_createtable (L, 0, 1);
-		lua_pushcfunction (L, gc_zmq_context);
-		lua_setfield (L, -2, "__gc");
+		struct context_data *cd = (struct context_data *) lua_newuserdata (L, sizeof (struct context_data));
+		cd->context = ctx;
+		cd->io_threads = io_threads;
+		cd->linger = linger;
+		cd->sockets = 0;
+		cd->released = NULL;
+		luaL_getmetatable (L, "ratchet_zmqcontext_meta");
 		lua_setmetatable (L, -2);
 		return 1;
 	}
 	else
-		return raise_zmq_error (L, NULL);
+		return raise_zmq_error (L, "ratchet.zmqsocket.new_context()");
+}
+/* }}} */
+
+/* {{{ rzmq_getsockopt_int() */
+static int rzmq_getsockopt_int (lua_State *L, void *socket, int opt)
+{
+	int val;
+	size_t val_len = sizeof (val);
+	if (-1 == zmq_getsockopt (socket, opt, &val, &val_len))
+		return raise_zmq_error (L, "ratchet.zmqsocket.getsockopt()");
+
+	lua_pushinteger (L, val);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_getsockopt_int64() */
+static int rzmq_getsockopt_int64 (lua_State *L, void *socket, int opt)
+{
+	int64_t val;
+	size_t val_len = sizeof (val);
+	if (-1 == zmq_getsockopt (socket, opt, &val, &val_len))
+		return raise_zmq_error (L, "ratchet.zmqsocket.getsockopt()");
+
+	lua_pushnumber (L, (lua_Number) val);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_getsockopt_uint64() */
+static int rzmq_getsockopt_uint64 (lua_State *L, void *socket, int opt)
+{
+	uint64_t val;
+	size_t val_len = sizeof (val);
+	if (-1 == zmq_getsockopt (socket, opt, &val, &val_len))
+		return raise_zmq_error (L, "ratchet.zmqsocket.getsockopt()");
+
+	lua_pushnumber (L, (lua_Number) val);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_getsockopt_uint32() */
+static int rzmq_getsockopt_uint32 (lua_State *L, void *socket, int opt)
+{
+	uint32_t val;
+	size_t val_len = sizeof (val);
+	if (-1 == zmq_getsockopt (socket, opt, &val, &val_len))
+		return raise_zmq_error (L, "ratchet.zmqsocket.getsockopt()");
+
+	lua_pushnumber (L, (lua_Number) val);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_getsockopt_string() */
+static int rzmq_getsockopt_string (lua_State *L, void *socket, int opt)
+{
+	char val[256];
+	size_t val_len = sizeof (val);
+	if (-1 == zmq_getsockopt (socket, opt, val, &val_len))
+		return raise_zmq_error (L, "ratchet.zmqsocket.getsockopt()");
+
+	lua_pushlstring (L, val, val_len);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_setsockopt_int() */
+static int rzmq_setsockopt_int (lua_State *L, void *socket, int opt, int valindex)
+{
+	int val = luaL_checkint (L, valindex);
+	if (-1 == zmq_setsockopt (socket, opt, &val, sizeof (val)))
+		return raise_zmq_error (L, "ratchet.zmqsocket.setsockopt()");
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rzmq_setsockopt_int64() */
+static int rzmq_setsockopt_int64 (lua_State *L, void *socket, int opt, int valindex)
+{
+	int64_t val = (int64_t) luaL_checknumber (L, valindex);
+	if (-1 == zmq_setsockopt (socket, opt, &val, sizeof (val)))
+		return raise_zmq_error (L, "ratchet.zmqsocket.setsockopt()");
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rzmq_setsockopt_uint64() */
+static int rzmq_setsockopt_uint64 (lua_State *L, void *socket, int opt, int valindex)
+{
+	uint64_t val = (uint64_t) luaL_checknumber (L, valindex);
+	if (-1 == zmq_setsockopt (socket, opt, &val, sizeof (val)))
+		return raise_zmq_error (L, "ratchet.zmqsocket.setsockopt()");
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rzmq_setsockopt_string() */
+static int rzmq_setsockopt_string (lua_State *L, void *socket, int opt, int valindex)
+{
+	size_t val_len;
+	const char *val = luaL_checklstring (L, valindex, &val_len);
+	if (-1 == zmq_setsockopt (socket, opt, val, val_len))
+		return raise_zmq_error (L, "ratchet.zmqsocket.setsockopt()");
+
+	return 0;
 }
 /* }}} */
 
 /* ---- Namespace Functions ------------------------------------------------- */
 
+/* {{{ rzmq_new_context() */
+static int rzmq_new_context (lua_State *L)
+{
+	int io_threads = luaL_optint (L, 1, RATCHET_ZMQ_IO_THREADS);
+	luaL_argcheck (L, io_threads > 0, 1, "at least one I/O thread required");
+
+	/* ZMQ_LINGER given to new sockets, or -1 to keep the ZeroMQ default. */
+	int linger = -1;
+	if (!lua_isnoneornil (L, 2))
+	{
+		lua_Number seconds = luaL_checknumber (L, 2);
+		luaL_argcheck (L, seconds >= 0.0 && seconds <= (lua_Number) (INT_MAX / 1000), 2, "linger out of range");
+		linger = (int) (seconds * 1000.0);
+	}
+
+	return push_new_zmq_context (L, io_threads, linger);
+}
+/* }}} */
+
 /* {{{ rzmq_new() */
 static int rzmq_new (lua_State *L)
 {
@@ -114,23 +429,56 @@ static int rzmq_new (lua_State *L)
 	static const int typelst[] = {ZMQ_PAIR, ZMQ_PUB, ZMQ_SUB, ZMQ_REQ, ZMQ_REP, ZMQ_XREQ, ZMQ_XREP, ZMQ_PULL, ZMQ_PUSH};
 #endif
 
-	void *context = *(void **) lua_touserdata (L, lua_upvalueindex (1));
 	int type = typelst[luaL_checkoption (L, 1, "PAIR", lst)];
+	if (lua_isnoneornil (L, 2))
+	{
+		lua_settop (L, 1);
+		lua_pushvalue (L, lua_upvalueindex (1));
+	}
+	else
+		lua_settop (L, 2);
+	struct context_data *cd = (struct context_data *) luaL_checkudata (L, 2, "ratchet_zmqcontext_meta");
+
+	struct socket_queue *queue = (struct socket_queue *) malloc (sizeof (struct socket_queue));
+	if (!queue)
+		return luaL_error (L, "Out of memory.");
 
-	void *socket = zmq_socket (context, type);
+	void *socket = zmq_socket (cd->context, type);
+	if (socket && cd->linger >= 0 && -1 == zmq_setsockopt (socket, ZMQ_LINGER, &cd->linger, sizeof (int)))
+	{
+		int orig_errno = errno;
+		zmq_close (socket);
+		errno = orig_errno;
+		socket = NULL;
+	}
 	if (socket)
 	{
 		struct socket_data *sd = (struct socket_data *) lua_newuserdata (L, sizeof (struct socket_data));
 		sd->socket = socket;
 		sd->timeout = -1.0;
+		sd->context = cd;
+		sd->queue = queue;
+		memset (queue, 0, sizeof (struct socket_queue));
+		queue->refs = 1;
+		memset (&sd->counters, 0, sizeof (struct socket_counters));
+		cd->sockets++;
 
 		luaL_getmetatable (L, "ratchet_zmqsocket_meta");
 		lua_setmetatable (L, -2);
 
+		/* The context must outlive its sockets. */
+		lua_createtable (L, 0, 1);
+		lua_pushvalue (L, 2);
+		lua_setfield (L, -2, "context");
+		lua_setuservalue (L, -2);
+
 		return 1;
 	}
-	else
-		return raise_zmq_error (L, "ratchet.zmqsocket.new()");
+
+	int orig_errno = errno;
+	free (queue);
+	errno = orig_errno;
+	return raise_zmq_error (L, "ratchet.zmqsocket.new()");
 }
 /* }}} */
 
@@ -166,14 +514,154 @@ static int rzmq_prepare_uri (lua_State *L)
 }
 /* }}} */
 
+/* {{{ proxy_message() */
+static int proxy_message (struct socket_data *from, struct socket_data *to, struct socket_data *capture)
+{
+	/* Moves one whole message, returning 0 if none was waiting. */
+	int more, frame = 0, dropping = 0;
+	do
+	{
+		zmq_msg_t msg;
+		zmq_msg_init (&msg);
+		if (-1 == zmq_recv (from->socket, &msg, ZMQ_NOBLOCK))
+		{
+			int orig_errno = errno;
+			zmq_msg_close (&msg);
+			errno = orig_errno;
+			return (frame == 0 && EAGAIN == orig_errno) ? 0 : -1;
+		}
+		frame++;
+
+		int64_t rcvmore;
+		size_t rcvmore_len = sizeof (rcvmore);
+		if (-1 == zmq_getsockopt (from->socket, ZMQ_RCVMORE, &rcvmore, &rcvmore_len))
+		{
+			int orig_errno = errno;
+			zmq_msg_close (&msg);
+			errno = orig_errno;
+			return -1;
+		}
+		more = (int) rcvmore;
+		int flags = ZMQ_NOBLOCK | (more ? ZMQ_SNDMORE : 0);
+		size_t size = zmq_msg_size (&msg);
+		count_received (from, size, more);
+
+		/* Like zmq_device(), a capture socket that cannot keep up loses
+		 * messages rather than stalling the proxy. */
+		if (capture)
+		{
+			zmq_msg_t copy;
+			zmq_msg_init (&copy);
+			if (0 == zmq_msg_copy (&copy, &msg) && 0 == zmq_send (capture->socket, &copy, flags))
+				count_sent (capture, size, flags);
+			zmq_msg_close (&copy);
+		}
+
+		if (!dropping)
+		{
+			if (0 == zmq_send (to->socket, &msg, flags))
+				count_sent (to, size, flags);
+			else if (EAGAIN == zmq_errno ())
+				dropping = 1;
+			else
+			{
+				int orig_errno = errno;
+				zmq_msg_close (&msg);
+				errno = orig_errno;
+				return -1;
+			}
+		}
+		zmq_msg_close (&msg);
+	} while (more);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ proxy_ready() */
+static int proxy_ready (struct socket_data *from, struct socket_data *to)
+{
+	int from_events = get_socket_events (from->socket);
+	if (from_events == -1)
+		return -1;
+	int to_events = get_socket_events (to->socket);
+	if (to_events == -1)
+		return -1;
+
+	return (from_events & ZMQ_POLLIN) && (to_events & ZMQ_POLLOUT);
+}
+/* }}} */
+
+/* {{{ rzmq_proxy() */
+static int rzmq_proxy (lua_State *L)
+{
+	int ctx = 0;
+	if (LUA_YIELD == lua_getctx (L, &ctx) && ctx == 1 && !lua_toboolean (L, 4))
+		return 0;
+	lua_settop (L, 3);
+
+	struct socket_data *frontend = socket_data (L, 1);
+	struct socket_data *backend = socket_data (L, 2);
+	struct socket_data *capture = (lua_isnoneornil (L, 3) ? NULL : socket_data (L, 3));
+
+	int moved = 0;
+	while (1)
+	{
+		int forward = proxy_ready (frontend, backend);
+		if (forward == -1)
+			return raise_zmq_error (L, "ratchet.zmqsocket.proxy()");
+		if (forward && -1 == (forward = proxy_message (frontend, backend, capture)))
+			return raise_zmq_error (L, "ratchet.zmqsocket.proxy()");
+
+		int backward = proxy_ready (backend, frontend);
+		if (backward == -1)
+			return raise_zmq_error (L, "ratchet.zmqsocket.proxy()");
+		if (backward && -1 == (backward = proxy_message (backend, frontend, capture)))
+			return raise_zmq_error (L, "ratchet.zmqsocket.proxy()");
+
+		if (!forward && !backward)
+			break;
+
+		/* Let other threads run between batches of a busy proxy. */
+		moved += forward + backward;
+		if (moved >= RATCHET_ZMQ_PROXY_BATCH)
+		{
+			lua_pushlightuserdata (L, RATCHET_YIELD_TIMEOUT);
+			lua_pushnumber (L, 0.0);
+			return lua_yieldk (L, 2, 2, rzmq_proxy);
+		}
+	}
+
+	/* ZMQ_FD signals any change in ZMQ_EVENTS, so both directions are
+	 * woken by waiting for both sockets to be readable. */
+	lua_pushlightuserdata (L, RATCHET_YIELD_MULTIRW);
+	lua_createtable (L, 2, 0);
+	lua_pushvalue (L, 1);
+	lua_rawseti (L, -2, 1);
+	lua_pushvalue (L, 2);
+	lua_rawseti (L, -2, 2);
+	lua_pushnil (L);
+	if (frontend->timeout >= 0.0)
+		lua_pushnumber (L, frontend->timeout);
+	else
+		lua_pushnil (L);
+	return lua_yieldk (L, 4, 1, rzmq_proxy);
+}
+/* }}} */
+
 /* ---- Member Functions ---------------------------------------------------- */
 
 /* {{{ rzmq_gc() */
 static int rzmq_gc (lua_State *L)
 {
-	void *socket = socket_ptr (L, 1);
-	if (socket)
-		zmq_close (socket);
+	struct socket_data *sd = socket_data (L, 1);
+	if (sd->socket)
+	{
+		zmq_close (sd->socket);
+		sd->context->sockets--;
+	}
+	unpin_released_strings (L, sd->context);
+	release_socket_queue (sd->queue);
 
 	return 0;
 }
@@ -218,11 +706,8 @@ static int rzmq_set_timeout (lua_State *L)
 static int rzmq_is_readable (lua_State *L)
 {
 	void *socket = socket_ptr (L, 1);
-	int events;
-	size_t events_len = sizeof (int);
-
-	int ret = zmq_getsockopt (socket, ZMQ_EVENTS, &events, &events_len);
-	if (ret == -1)
+	int events = get_socket_events (socket);
+	if (events == -1)
 		return raise_zmq_error (L, "ratchet.zmqsocket.is_readable()");
 
 	lua_pushboolean (L, (events & ZMQ_POLLIN));
@@ -235,11 +720,8 @@ static int rzmq_is_readable (lua_State *L)
 static int rzmq_is_writable (lua_State *L)
 {
 	void *socket = socket_ptr (L, 1);
-	int events;
-	size_t events_len = sizeof (int);
-
-	int ret = zmq_getsockopt (socket, ZMQ_EVENTS, &events, &events_len);
-	if (ret == -1)
+	int events = get_socket_events (socket);
+	if (events == -1)
 		return raise_zmq_error (L, "ratchet.zmqsocket.is_writable()");
 
 	lua_pushboolean (L, (events & ZMQ_POLLOUT));
@@ -264,6 +746,109 @@ static int rzmq_is_rcvmore (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rzmq_stats() */
+static int rzmq_stats (lua_State *L)
+{
+	struct socket_data *sd = socket_data (L, 1);
+
+	lua_createtable (L, 0, 6);
+	lua_pushnumber (L, sd->counters.sent_messages);
+	lua_setfield (L, -2, "sent_messages");
+	lua_pushnumber (L, sd->counters.sent_bytes);
+	lua_setfield (L, -2, "sent_bytes");
+	lua_pushnumber (L, sd->counters.received_messages);
+	lua_setfield (L, -2, "received_messages");
+	lua_pushnumber (L, sd->counters.received_bytes);
+	lua_setfield (L, -2, "received_bytes");
+	lua_pushnumber (L, (lua_Number) __sync_fetch_and_add (&sd->queue->frames, 0));
+	lua_setfield (L, -2, "pinned_frames");
+	lua_pushnumber (L, (lua_Number) __sync_fetch_and_add (&sd->queue->bytes, 0));
+	lua_setfield (L, -2, "pinned_bytes");
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_getsockopt() */
+static int rzmq_getsockopt (lua_State *L)
+{
+	void *socket = socket_ptr (L, 1);
+	const char *key = luaL_checkstring (L, 2);
+
+	CHECK_OPT_GET (ZMQ_TYPE, int);
+	CHECK_OPT_GET (ZMQ_RCVMORE, int64);
+	CHECK_OPT_GET (ZMQ_HWM, uint64);
+	CHECK_OPT_GET (ZMQ_SWAP, int64);
+	CHECK_OPT_GET (ZMQ_AFFINITY, uint64);
+	CHECK_OPT_GET (ZMQ_IDENTITY, string);
+	CHECK_OPT_GET (ZMQ_RATE, int64);
+	CHECK_OPT_GET (ZMQ_RECOVERY_IVL, int64);
+#ifdef ZMQ_RECOVERY_IVL_MSEC
+	CHECK_OPT_GET (ZMQ_RECOVERY_IVL_MSEC, int64);
+#endif
+	CHECK_OPT_GET (ZMQ_MCAST_LOOP, int64);
+	CHECK_OPT_GET (ZMQ_SNDBUF, uint64);
+	CHECK_OPT_GET (ZMQ_RCVBUF, uint64);
+	CHECK_OPT_GET (ZMQ_LINGER, int);
+	CHECK_OPT_GET (ZMQ_RECONNECT_IVL, int);
+#ifdef ZMQ_RECONNECT_IVL_MAX
+	CHECK_OPT_GET (ZMQ_RECONNECT_IVL_MAX, int);
+#endif
+	CHECK_OPT_GET (ZMQ_BACKLOG, int);
+	CHECK_OPT_GET (ZMQ_FD, int);
+	CHECK_OPT_GET (ZMQ_EVENTS, uint32);
+
+	lua_pushnil (L);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_setsockopt() */
+static int rzmq_setsockopt (lua_State *L)
+{
+	void *socket = socket_ptr (L, 1);
+	const char *key = luaL_checkstring (L, 2);
+
+	CHECK_OPT_SET (ZMQ_HWM, uint64);
+	CHECK_OPT_SET (ZMQ_SWAP, int64);
+	CHECK_OPT_SET (ZMQ_AFFINITY, uint64);
+	CHECK_OPT_SET (ZMQ_IDENTITY, string);
+	CHECK_OPT_SET (ZMQ_SUBSCRIBE, string);
+	CHECK_OPT_SET (ZMQ_UNSUBSCRIBE, string);
+	CHECK_OPT_SET (ZMQ_RATE, int64);
+	CHECK_OPT_SET (ZMQ_RECOVERY_IVL, int64);
+#ifdef ZMQ_RECOVERY_IVL_MSEC
+	CHECK_OPT_SET (ZMQ_RECOVERY_IVL_MSEC, int64);
+#endif
+	CHECK_OPT_SET (ZMQ_MCAST_LOOP, int64);
+	CHECK_OPT_SET (ZMQ_SNDBUF, uint64);
+	CHECK_OPT_SET (ZMQ_RCVBUF, uint64);
+	CHECK_OPT_SET (ZMQ_LINGER, int);
+	CHECK_OPT_SET (ZMQ_RECONNECT_IVL, int);
+#ifdef ZMQ_RECONNECT_IVL_MAX
+	CHECK_OPT_SET (ZMQ_RECONNECT_IVL_MAX, int);
+#endif
+	CHECK_OPT_SET (ZMQ_BACKLOG, int);
+
+	return luaL_argerror (L, 2, "unknown or read-only option");
+}
+/* }}} */
+
+/* {{{ rzmqctx_stats() */
+static int rzmqctx_stats (lua_State *L)
+{
+	struct context_data *cd = (struct context_data *) luaL_checkudata (L, 1, "ratchet_zmqcontext_meta");
+
+	lua_createtable (L, 0, 2);
+	lua_pushinteger (L, cd->io_threads);
+	lua_setfield (L, -2, "io_threads");
+	lua_pushinteger (L, cd->sockets);
+	lua_setfield (L, -2, "sockets");
+
+	return 1;
+}
+/* }}} */
+
 /* {{{ rzmq_bind() */
 static int rzmq_bind (lua_State *L)
 {
@@ -297,20 +882,13 @@ static int rzmq_connect (lua_State *L)
 /* {{{ rzmq_rawsend() */
 static int rzmq_rawsend (lua_State *L)
 {
-	void *socket = socket_ptr (L, 1);
-	size_t data_len;
-	const char *data = luaL_checklstring (L, 2, &data_len);
+	struct socket_data *sd = socket_data (L, 1);
+	luaL_checkstring (L, 2);
 	int flags = ZMQ_NOBLOCK | (lua_toboolean (L, 3) ? ZMQ_SNDMORE : 0);
 
-	/* Set up the zmq_msg_t object to send. */
-	zmq_msg_t msg;
-	zmq_msg_init_size (&msg, data_len);
-	memcpy (zmq_msg_data (&msg), data, data_len);
-
-	int ret = zmq_send (socket, &msg, flags);
+	int ret = send_frame (L, sd, 2, flags);
 	if (ret == -1)
 		return raise_zmq_error (L, "ratchet.zmqsocket.send()");
-	zmq_msg_close (&msg);
 
 	lua_pushboolean (L, 1);
 	return 1;
@@ -320,24 +898,26 @@ static int rzmq_rawsend (lua_State *L)
 /* {{{ rzmq_rawrecv() */
 static int rzmq_rawrecv (lua_State *L)
 {
-	void *socket = socket_ptr (L, 1);
+	struct socket_data *sd = socket_data (L, 1);
 	int flags = ZMQ_NOBLOCK;
 
 	/* Set up the zmq_msg_t object to recv. */
 	zmq_msg_t msg;
 	zmq_msg_init (&msg);
 
-	int ret = zmq_recv (socket, &msg, flags);
+	int ret = zmq_recv (sd->socket, &msg, flags);
 	if (ret == -1)
 		return raise_zmq_error (L, "ratchet.zmqsocket.recv()");
 
 	/* Build Lua string from zmq_msg_t. */
-	lua_pushlstring (L, (const char *) zmq_msg_data (&msg), zmq_msg_size (&msg));
+	size_t size = zmq_msg_size (&msg);
+	lua_pushlstring (L, (const char *) zmq_msg_data (&msg), size);
 	zmq_msg_close (&msg);
 
 	lua_getfield (L, 1, "is_rcvmore");
 	lua_pushvalue (L, 1);
 	lua_call (L, 1, 1);
+	count_received (sd, size, lua_toboolean (L, -1));
 
 	return 2;
 }
@@ -375,6 +955,67 @@ static int rzmq_send (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rzmq_send_multipart() */
+static int rzmq_send_multipart (lua_State *L)
+{
+	int i = 1, num;
+	if (LUA_YIELD == lua_getctx (L, &i))
+	{
+		if (!lua_toboolean (L, 3))
+			return 0;
+		lua_settop (L, 2);
+		num = (int) lua_rawlen (L, 2);
+	}
+	else
+	{
+		(void) socket_ptr (L, 1);
+		luaL_checktype (L, 2, LUA_TTABLE);
+		lua_settop (L, 2);
+
+		/* Every frame is checked before the first one is sent. */
+		num = (int) lua_rawlen (L, 2);
+		luaL_argcheck (L, num > 0, 2, "no message frames");
+		int j;
+		for (j=1; j<=num; j++)
+		{
+			lua_rawgeti (L, 2, j);
+			luaL_argcheck (L, lua_isstring (L, -1), 2, "message frames must be strings");
+			lua_pop (L, 1);
+		}
+	}
+
+	struct socket_data *sd = socket_data (L, 1);
+	while (i <= num)
+	{
+		lua_rawgeti (L, 2, i);
+		int ret = send_frame (L, sd, 3, ZMQ_NOBLOCK | (i < num ? ZMQ_SNDMORE : 0));
+		lua_pop (L, 1);
+
+		if (ret != -1)
+			i++;
+		else if (EAGAIN != zmq_errno ())
+			return raise_zmq_error (L, "ratchet.zmqsocket.send_multipart()");
+		else
+		{
+			/* ZMQ_FD is edge-triggered, ZMQ_EVENTS must be checked before
+			 * waiting on it. */
+			int events = get_socket_events (sd->socket);
+			if (events == -1)
+				return raise_zmq_error (L, "ratchet.zmqsocket.send_multipart()");
+			if (!(events & ZMQ_POLLOUT))
+			{
+				lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
+				lua_pushvalue (L, 1);
+				return lua_yieldk (L, 2, i, rzmq_send_multipart);
+			}
+		}
+	}
+
+	lua_pushboolean (L, 1);
+	return 1;
+}
+/* }}} */
+
 /* {{{ rzmq_recv() */
 static int rzmq_recv (lua_State *L)
 {
@@ -407,44 +1048,107 @@ static int rzmq_recv (lua_State *L)
 }
 /* }}} */
 
-/* {{{ rzmq_recv_all() */
-static int rzmq_recv_all (lua_State *L)
+/* {{{ recv_frames() */
+static int recv_frames (struct socket_data *sd, lua_State *L, int index)
+{
+	/* Returns 1 once the last frame is received, 0 if the socket would block
+	 * and -1 on error. */
+	while (1)
+	{
+		zmq_msg_t msg;
+		zmq_msg_init (&msg);
+
+		if (-1 == zmq_recv (sd->socket, &msg, ZMQ_NOBLOCK))
+		{
+			int orig_errno = errno;
+			zmq_msg_close (&msg);
+			if (EAGAIN != orig_errno)
+			{
+				errno = orig_errno;
+				return -1;
+			}
+
+			/* ZMQ_FD is edge-triggered, ZMQ_EVENTS must be checked before
+			 * waiting on it. */
+			int events = get_socket_events (sd->socket);
+			if (events == -1)
+				return -1;
+			if (!(events & ZMQ_POLLIN))
+				return 0;
+			continue;
+		}
+
+		size_t size = zmq_msg_size (&msg);
+		lua_pushlstring (L, (const char *) zmq_msg_data (&msg), size);
+		lua_rawseti (L, index, (int) lua_rawlen (L, index) + 1);
+		zmq_msg_close (&msg);
+
+		int64_t rcvmore;
+		size_t rcvmore_len = sizeof (rcvmore);
+		if (-1 == zmq_getsockopt (sd->socket, ZMQ_RCVMORE, &rcvmore, &rcvmore_len))
+			return -1;
+		count_received (sd, size, (int) rcvmore);
+		if (!rcvmore)
+			return 1;
+	}
+}
+/* }}} */
+
+/* {{{ recv_multipart() */
+static int recv_multipart (lua_State *L, int concat, lua_CFunction k, const char *func)
 {
 	int ctx = 0;
-	if (LUA_OK == lua_getctx (L, &ctx))
+	if (LUA_YIELD == lua_getctx (L, &ctx))
+	{
+		if (!lua_toboolean (L, 3))
+			return 0;
+		lua_settop (L, 2);
+	}
+	else
 	{
+		(void) socket_ptr (L, 1);
 		lua_settop (L, 1);
 		lua_newtable (L);
 	}
-	else
+
+	int ret = recv_frames (socket_data (L, 1), L, 2);
+	if (ret == -1)
+		return raise_zmq_error (L, func);
+	else if (ret == 0)
 	{
-		int more, i;
-received:
-		more = lua_toboolean (L, -1);
-		lua_pop (L, 1);
-		i = lua_rawlen (L, 2)+1;
-		lua_rawseti (L, 2, i);
+		lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+		lua_pushvalue (L, 1);
+		return lua_yieldk (L, 2, 1, k);
+	}
 
-		if (!more)
+	if (concat)
+	{
+		int i, num = (int) lua_rawlen (L, 2);
+		luaL_Buffer buff;
+		luaL_buffinit (L, &buff);
+		for (i=1; i<=num; i++)
 		{
-			int j;
-			luaL_Buffer buff;
-			luaL_buffinit (L, &buff);
-			for (j=1; j<=i; j++)
-			{
-				lua_rawgeti (L, 2, j);
-				luaL_addvalue (&buff);
-			}
-			luaL_pushresult (&buff);
-			return 1;
+			lua_rawgeti (L, 2, i);
+			luaL_addvalue (&buff);
 		}
+		luaL_pushresult (&buff);
 	}
 
-	lua_getfield (L, 1, "recv");
-	lua_pushvalue (L, 1);
-	lua_callk (L, 1, 2, ctx, rzmq_recv_all);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rzmq_recv_multipart() */
+static int rzmq_recv_multipart (lua_State *L)
+{
+	return recv_multipart (L, 0, rzmq_recv_multipart, "ratchet.zmqsocket.recv_multipart()");
+}
+/* }}} */
 
-	goto received;
+/* {{{ rzmq_recv_all() */
+static int rzmq_recv_all (lua_State *L)
+{
+	return recv_multipart (L, 1, rzmq_recv_all, "ratchet.zmqsocket.recv_all()");
 }
 /* }}} */
 
@@ -456,7 +1160,9 @@ int luaopen_ratchet_zmqsocket (lua_State *L)
 	/* Static functions in the ratchet.zmqsocket namespace. */
 	const luaL_Reg funcs[] = {
 		{"new", rzmq_new},
+		{"new_context", rzmq_new_context},
 		{"prepare_uri", rzmq_prepare_uri},
+		{"proxy", rzmq_proxy},
 		{NULL}
 	};
 
@@ -466,6 +1172,19 @@ int luaopen_ratchet_zmqsocket (lua_State *L)
 		{NULL}
 	};
 
+	/* Meta-methods for ratchet.zmqsocket context object metatables. */
+	const luaL_Reg ctxmetameths[] = {
+		{"__gc", gc_zmq_context},
+		{NULL}
+	};
+
+	/* Methods in the ratchet.zmqsocket context class. */
+	const luaL_Reg ctxmeths[] = {
+		/* Documented methods. */
+		{"stats", rzmqctx_stats},
+		{NULL}
+	};
+
 	/* Methods in the ratchet.zmqsocket class. */
 	const luaL_Reg meths[] = {
 		/* Documented methods. */
@@ -475,8 +1194,13 @@ int luaopen_ratchet_zmqsocket (lua_State *L)
 		{"bind", rzmq_bind},
 		{"connect", rzmq_connect},
 		{"send", rzmq_send},
+		{"send_multipart", rzmq_send_multipart},
 		{"recv", rzmq_recv},
 		{"recv_all", rzmq_recv_all},
+		{"recv_multipart", rzmq_recv_multipart},
+		{"stats", rzmq_stats},
+		{"getsockopt", rzmq_getsockopt},
+		{"setsockopt", rzmq_setsockopt},
 		/* Undocumented, helper methods. */
 		{"is_readable", rzmq_is_readable},
 		{"is_writable", rzmq_is_writable},
@@ -486,11 +1210,19 @@ int luaopen_ratchet_zmqsocket (lua_State *L)
 		{NULL}
 	};
 
+	/* Set up the ratchet.zmqsocket context metatable. */
+	luaL_newmetatable (L, "ratchet_zmqcontext_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, ctxmeths, 0);
+	lua_setfield (L, -2, "__index");
+	luaL_setfuncs (L, ctxmetameths, 0);
+	lua_pop (L, 1);
+
 	/* Set up the ratchet.zmqsocket namespace functions. */
 	luaL_newlibtable (L, funcs);
 	lua_pushvalue (L, -1);
 	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_zmq_class");
-	push_new_zmq_context (L);
+	push_new_zmq_context (L, RATCHET_ZMQ_IO_THREADS, -1);
 	luaL_setfuncs (L, funcs, 1);
 
 	/* Set up the ratchet.zmqsocket class and metatables. */
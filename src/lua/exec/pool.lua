@@ -0,0 +1,285 @@
+
+require "ratchet"
+
+ratchet.exec.pool = {}
+ratchet.exec.pool.__index = ratchet.exec.pool
+
+-- Seconds between checks for killed requests while others are queued.
+local queue_check_interval = 1.0
+
+-- {{{ ratchet.exec.pool.new()
+function ratchet.exec.pool.new(argv, options)
+    local self = {}
+    setmetatable(self, ratchet.exec.pool)
+
+    options = options or {}
+    self.argv = argv
+    self.size = options.size or 4
+    self.max_requests = options.max_requests
+
+    self.helpers = {}
+    self.num_helpers = 0
+    self.idle = {}
+    self.busy = {}
+    self.queue = {}
+    self.counters = {
+        requests = 0,
+        failures = 0,
+        spawned = 0,
+        crashed = 0,
+        recycled = 0,
+        queued = 0,
+        abandoned = 0,
+    }
+
+    return self
+end
+-- }}}
+
+-- {{{ encode_length()
+local function encode_length(n)
+    return string.char(math.floor(n / 16777216) % 256,
+                       math.floor(n / 65536) % 256,
+                       math.floor(n / 256) % 256,
+                       n % 256)
+end
+-- }}}
+
+-- {{{ decode_length()
+local function decode_length(str)
+    local a, b, c, d = str:byte(1, 4)
+    return ((a * 256 + b) * 256 + c) * 256 + d
+end
+-- }}}
+
+-- {{{ watch_helper()
+local function watch_helper(process)
+    -- Drains stderr, so a chatty helper cannot block on a full pipe, and
+    -- reaps the helper once it exits.
+    local stderr = process:stderr()
+    while stderr:read() ~= "" do end
+    process:wait()
+end
+-- }}}
+
+-- {{{ spawn_helper()
+local function spawn_helper(self)
+    local process = ratchet.exec.new(self.argv)
+    local ok, err = pcall(process.start, process)
+    if not ok then
+        return nil, err
+    end
+    ratchet.thread.attach(watch_helper, process)
+
+    local helper = {process = process, recv_buffer = "", requests = 0}
+    self.helpers[helper] = true
+    self.num_helpers = self.num_helpers + 1
+    self.counters.spawned = self.counters.spawned + 1
+
+    return helper
+end
+-- }}}
+
+-- {{{ retire_helper()
+local function retire_helper(self, helper, broken)
+    self.helpers[helper] = nil
+    self.num_helpers = self.num_helpers - 1
+
+    -- Healthy helpers should exit when their stdin is closed.
+    helper.process:stdin():close()
+    if broken then
+        pcall(helper.process.kill, helper.process, "SIGKILL")
+    end
+end
+-- }}}
+
+-- {{{ release_helper()
+local function release_helper(self, helper)
+    -- A nil helper was retired, and is replaced if a request is waiting.
+    -- Requests killed while queued are skipped.
+    while self.queue[1] do
+        local waiting = table.remove(self.queue, 1)
+        if ratchet.thread.is_alive(waiting) then
+            local err
+            if not helper then
+                helper, err = spawn_helper(self)
+            end
+            if helper then
+                self.busy[helper] = waiting
+                ratchet.thread.unpause(waiting, helper)
+                return
+            end
+            ratchet.thread.unpause(waiting, nil, err)
+        end
+    end
+
+    if helper and self.closed then
+        retire_helper(self, helper)
+    elseif helper then
+        table.insert(self.idle, helper)
+    end
+end
+-- }}}
+
+-- {{{ reap_abandoned()
+local function reap_abandoned(self)
+    -- A request killed during exchange() leaves its helper mid-message, so
+    -- the helper is retired and replaced for whoever is waiting.
+    for i=#self.queue, 1, -1 do
+        if not ratchet.thread.is_alive(self.queue[i]) then
+            table.remove(self.queue, i)
+        end
+    end
+
+    local abandoned = {}
+    for helper, thread in pairs(self.busy) do
+        if not ratchet.thread.is_alive(thread) then
+            table.insert(abandoned, helper)
+        end
+    end
+    for i, helper in ipairs(abandoned) do
+        self.busy[helper] = nil
+        retire_helper(self, helper, true)
+        self.counters.abandoned = self.counters.abandoned + 1
+        release_helper(self, nil)
+    end
+end
+-- }}}
+
+-- {{{ watch_queue()
+local function watch_queue(self)
+    -- Nothing else notices a killed request while every helper is busy.
+    while self.queue[1] do
+        ratchet.thread.timer(queue_check_interval)
+        reap_abandoned(self)
+    end
+    self.queue_watcher = nil
+end
+-- }}}
+
+-- {{{ acquire_helper()
+local function acquire_helper(self)
+    if self.closed then
+        return nil, "Pool is closed."
+    end
+    reap_abandoned(self)
+
+    local helper, err = table.remove(self.idle)
+    if not helper and self.num_helpers < self.size then
+        helper, err = spawn_helper(self)
+    elseif not helper then
+        table.insert(self.queue, ratchet.thread.self())
+        self.counters.queued = self.counters.queued + 1
+        if not (self.queue_watcher and ratchet.thread.is_alive(self.queue_watcher)) then
+            self.queue_watcher = ratchet.thread.attach(watch_queue, self)
+        end
+        return ratchet.thread.pause()
+    end
+
+    if helper then
+        self.busy[helper] = ratchet.thread.self()
+    end
+    return helper, err
+end
+-- }}}
+
+-- {{{ send_all()
+local function send_all(file, data)
+    local remaining = data
+    repeat
+        remaining = file:write(remaining)
+    until not remaining
+end
+-- }}}
+
+-- {{{ recv_bytes()
+local function recv_bytes(helper, bytes)
+    local stdout = helper.process:stdout()
+    local parts, have = {helper.recv_buffer}, #helper.recv_buffer
+    while have < bytes do
+        local data = stdout:read()
+        if data == "" then
+            return nil
+        end
+        table.insert(parts, data)
+        have = have + #data
+    end
+
+    local all = table.concat(parts)
+    helper.recv_buffer = all:sub(bytes+1)
+    return all:sub(1, bytes)
+end
+-- }}}
+
+-- {{{ exchange()
+local function exchange(helper, data)
+    local stdin = helper.process:stdin()
+    send_all(stdin, encode_length(#data))
+    send_all(stdin, data)
+
+    local header = recv_bytes(helper, 4)
+    if not header then
+        return nil
+    end
+    return recv_bytes(helper, decode_length(header))
+end
+-- }}}
+
+-- {{{ ratchet.exec.pool:request()
+function ratchet.exec.pool:request(data)
+    local helper, err = acquire_helper(self)
+    if not helper then
+        self.counters.failures = self.counters.failures + 1
+        return nil, err
+    end
+
+    self.counters.requests = self.counters.requests + 1
+    local ok, response = pcall(exchange, helper, data)
+    self.busy[helper] = nil
+    if ok and response then
+        helper.requests = helper.requests + 1
+        if self.max_requests and helper.requests >= self.max_requests then
+            retire_helper(self, helper)
+            self.counters.recycled = self.counters.recycled + 1
+            helper = nil
+        end
+        release_helper(self, helper)
+        return response
+    end
+
+    -- The helper crashed or broke protocol, a new one is started as needed.
+    retire_helper(self, helper, true)
+    self.counters.crashed = self.counters.crashed + 1
+    self.counters.failures = self.counters.failures + 1
+    release_helper(self, nil)
+    return nil, (ok and "Helper exited before responding." or response)
+end
+-- }}}
+
+-- {{{ ratchet.exec.pool:stats()
+function ratchet.exec.pool:stats()
+    local ret = {
+        helpers = self.num_helpers,
+        idle = #self.idle,
+        waiting = #self.queue,
+    }
+    for k, v in pairs(self.counters) do
+        ret[k] = v
+    end
+    return ret
+end
+-- }}}
+
+-- {{{ ratchet.exec.pool:close()
+function ratchet.exec.pool:close()
+    -- Busy helpers are retired as their requests finish.
+    self.closed = true
+    while self.idle[1] do
+        retire_helper(self, table.remove(self.idle))
+    end
+end
+-- }}}
+
+return ratchet.exec.pool
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,314 @@
+
+require "ratchet"
+
+ratchet.timerfd.group = {}
+ratchet.timerfd.group.__index = ratchet.timerfd.group
+
+local timer_class = {}
+timer_class.__index = timer_class
+
+-- {{{ ratchet.timerfd.group.new()
+function ratchet.timerfd.group.new(clock, slack)
+    local self = {}
+    setmetatable(self, ratchet.timerfd.group)
+
+    self.clock = clock or "monotonic"
+    self.slack = slack or 0
+    self.tfd = ratchet.timerfd.new(self.clock)
+
+    self.heap = {}
+    self.num_timers = 0
+    self.waiters = {}
+    self.waiting = 0
+    self.sweep_interval = 1.0
+    self.counters = {
+        wakeups = 0,
+        fires = 0,
+        abandoned = 0,
+    }
+
+    return self
+end
+-- }}}
+
+-- {{{ heap_swap()
+local function heap_swap(heap, i, j)
+    heap[i], heap[j] = heap[j], heap[i]
+    heap[i].heap_index = i
+    heap[j].heap_index = j
+end
+-- }}}
+
+-- {{{ heap_up()
+local function heap_up(heap, i)
+    while i > 1 do
+        local parent = math.floor(i / 2)
+        if heap[parent].deadline <= heap[i].deadline then
+            break
+        end
+        heap_swap(heap, i, parent)
+        i = parent
+    end
+end
+-- }}}
+
+-- {{{ heap_down()
+local function heap_down(heap, i)
+    local n = #heap
+    while true do
+        local smallest, left, right = i, i * 2, i * 2 + 1
+        if left <= n and heap[left].deadline < heap[smallest].deadline then
+            smallest = left
+        end
+        if right <= n and heap[right].deadline < heap[smallest].deadline then
+            smallest = right
+        end
+        if smallest == i then
+            break
+        end
+        heap_swap(heap, i, smallest)
+        i = smallest
+    end
+end
+-- }}}
+
+-- {{{ heap_insert()
+local function heap_insert(heap, timer)
+    local i = #heap + 1
+    heap[i] = timer
+    timer.heap_index = i
+    heap_up(heap, i)
+end
+-- }}}
+
+-- {{{ heap_remove()
+local function heap_remove(heap, timer)
+    local i, n = timer.heap_index, #heap
+    timer.heap_index = nil
+    if i ~= n then
+        heap[i] = heap[n]
+        heap[i].heap_index = i
+        heap[n] = nil
+        heap_down(heap, i)
+        heap_up(heap, i)
+    else
+        heap[n] = nil
+    end
+end
+-- }}}
+
+-- {{{ rearm()
+local function rearm(self)
+    -- With slack, the timerfd fires on a grid so nearby deadlines share one
+    -- wakeup, at most slack seconds late.
+    local first = self.heap[1]
+    local deadline = first and first.deadline
+    if deadline and self.slack > 0 then
+        deadline = math.ceil(deadline / self.slack) * self.slack
+    end
+
+    -- While threads wait, the timerfd fires at least every sweep_interval
+    -- so that killed waiters are noticed.
+    if self.waiting > 0 then
+        local sweep = ratchet.timerfd.now(self.clock) + self.sweep_interval
+        if not deadline or deadline > sweep then
+            local armed = self.armed
+            deadline = (armed and armed < sweep) and armed or sweep
+        end
+    end
+
+    if deadline ~= self.armed then
+        self.armed = deadline
+        if deadline then
+            self.tfd:settime(deadline, nil, "absolute")
+        else
+            self.tfd:settime(nil)
+        end
+    end
+end
+-- }}}
+
+-- {{{ drop_waiter()
+local function drop_waiter(self, timer)
+    local waiter = timer.waiter
+    timer.waiter = nil
+    self.waiters[timer] = nil
+    self.waiting = self.waiting - 1
+    return waiter
+end
+-- }}}
+
+-- {{{ wake_waiter()
+local function wake_waiter(self, timer, fires)
+    local waiter = drop_waiter(self, timer)
+    if not ratchet.thread.unpause(waiter, fires) then
+        self.counters.abandoned = self.counters.abandoned + 1
+    end
+end
+-- }}}
+
+-- {{{ sweep_waiters()
+local function sweep_waiters(self)
+    -- Killed threads are never woken, so they are only found by looking.
+    for timer in pairs(self.waiters) do
+        if not ratchet.thread.is_alive(timer.waiter) then
+            drop_waiter(self, timer)
+            self.counters.abandoned = self.counters.abandoned + 1
+        end
+    end
+end
+-- }}}
+
+-- {{{ fire_expired()
+local function fire_expired(self)
+    local heap, now = self.heap, ratchet.timerfd.now(self.clock)
+    while heap[1] and heap[1].deadline <= now do
+        local timer = heap[1]
+        local fires = 1
+        if timer.interval then
+            -- Like timerfd, periods missed in between are counted as fires.
+            local missed = math.floor((now - timer.deadline) / timer.interval)
+            fires = fires + missed
+            timer.deadline = timer.deadline + (missed + 1) * timer.interval
+            heap_down(heap, 1)
+        else
+            heap_remove(heap, timer)
+        end
+        self.counters.fires = self.counters.fires + fires
+
+        if timer.waiter then
+            wake_waiter(self, timer, timer.fires + fires)
+            timer.fires = 0
+        else
+            timer.fires = timer.fires + fires
+        end
+    end
+
+    self.armed = nil
+    rearm(self)
+end
+-- }}}
+
+-- {{{ dispatch()
+local function dispatch(self)
+    -- Only this thread waits on the timerfd, on behalf of every timer.
+    while self.waiting > 0 do
+        self.tfd:read()
+        self.counters.wakeups = self.counters.wakeups + 1
+        fire_expired(self)
+        sweep_waiters(self)
+    end
+    self.dispatcher = nil
+end
+-- }}}
+
+-- {{{ ratchet.timerfd.group:new_timer()
+function ratchet.timerfd.group:new_timer()
+    local timer = {group = self, fires = 0}
+    setmetatable(timer, timer_class)
+    self.num_timers = self.num_timers + 1
+
+    return timer
+end
+-- }}}
+
+-- {{{ ratchet.timerfd.group:stats()
+function ratchet.timerfd.group:stats()
+    local ret = {
+        timers = self.num_timers,
+        armed = #self.heap,
+        waiting = self.waiting,
+    }
+    for k, v in pairs(self.counters) do
+        ret[k] = v
+    end
+    return ret
+end
+-- }}}
+
+-- {{{ timer_class:settime()
+function timer_class:settime(wait_seconds, interval_seconds, flag)
+    local group = self.group
+    local old_value, old_interval = self:gettime()
+
+    if self.heap_index then
+        heap_remove(group.heap, self)
+    end
+    self.fires = 0
+    self.interval = (interval_seconds and interval_seconds > 0) and interval_seconds or nil
+
+    if wait_seconds and (wait_seconds > 0 or flag == "absolute") then
+        if flag == "absolute" then
+            self.deadline = wait_seconds
+        else
+            self.deadline = ratchet.timerfd.now(group.clock) + wait_seconds
+        end
+        heap_insert(group.heap, self)
+    end
+    rearm(group)
+
+    return old_value, old_interval
+end
+-- }}}
+
+-- {{{ timer_class:gettime()
+function timer_class:gettime()
+    if not self.heap_index then
+        return 0, 0
+    end
+    local remaining = self.deadline - ratchet.timerfd.now(self.group.clock)
+    return math.max(remaining, 0), self.interval or 0
+end
+-- }}}
+
+-- {{{ timer_class:read()
+function timer_class:read()
+    local fires = self.fires
+    if fires > 0 then
+        self.fires = 0
+        return fires
+    end
+
+    local group = self.group
+    sweep_waiters(group)
+    self.waiter = ratchet.thread.self()
+    group.waiters[self] = true
+    group.waiting = group.waiting + 1
+    if group.waiting == 1 then
+        rearm(group)
+    end
+    if not group.dispatcher then
+        group.dispatcher = ratchet.thread.attach(dispatch, group)
+    end
+
+    return ratchet.thread.pause()
+end
+-- }}}
+
+-- {{{ timer_class:close()
+function timer_class:close()
+    local group = self.group
+    if self.heap_index then
+        heap_remove(group.heap, self)
+        rearm(group)
+    end
+    if self.waiter then
+        wake_waiter(group, self, 0)
+    end
+    sweep_waiters(group)
+    if not self.closed then
+        self.closed = true
+        group.num_timers = group.num_timers - 1
+    end
+
+    -- Nothing is left to wait for, so the dispatcher is stopped.
+    if group.waiting == 0 and group.dispatcher then
+        ratchet.thread.kill(group.dispatcher)
+        group.dispatcher = nil
+    end
+end
+-- }}}
+
+return ratchet.timerfd.group
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,209 @@
+require "ratchet"
+stub = require "ratchet.dns.stub"
+
+-- Usage: bench_dns.lua [queries] [concurrency] [latency] [loss] [truncate] [mode] [cache]
+--
+-- Drives ratchet.dns against a stub nameserver on the loopback, so resolver
+-- changes can be measured without a network. The stub delays each answer by
+-- latency seconds, drops a loss fraction of queries and truncates a truncate
+-- fraction of answers, which are then retried over TCP. The mode is either
+-- "query" (A only) or "query_all" (AAAA and A). The shared answer cache is
+-- off unless cache is "on", so by default every query reaches the stub.
+
+num_queries = tonumber(arg[1]) or 10000
+concurrency = tonumber(arg[2]) or 100
+latency = tonumber(arg[3]) or 0.0
+loss = tonumber(arg[4]) or 0.0
+truncate = tonumber(arg[5]) or 0.0
+mode = arg[6] or "query"
+cache = (arg[7] == "on")
+
+host = "127.0.0.1"
+port = 53535
+num_names = 1000
+
+records = {}
+for i=1, num_names do
+    records["host" .. i .. ".bench."] = {"10.0." .. math.floor(i / 256) .. "." .. (i % 256), "fd00::" .. i}
+end
+
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("nameserver [" .. host .. "]:" .. port .. "\n")
+f:write("options timeout:1 attempts:3\n")
+f:write("lookup bind\n")
+f:close()
+
+-- {{{ count_fds()
+function count_fds()
+    local p = io.popen("ls /proc/$PPID/fd | wc -l")
+    local n = tonumber(p:read("*a"))
+    p:close()
+    return n
+end
+-- }}}
+
+-- {{{ udp_reply()
+function udp_reply(socket, query, from)
+    if latency > 0 then
+        ratchet.thread.timer(latency)
+    end
+    local answer = stub.build_answer(query, records, {truncate = (math.random() < truncate)})
+    socket:sendto(answer, from)
+end
+-- }}}
+
+-- {{{ udp_server()
+function udp_server()
+    local rec = ratchet.socket.prepare_udp(host, port, "AF_INET")
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:bind(rec.addr)
+
+    while true do
+        local query, from = socket:recvfrom()
+        if math.random() >= loss then
+            if latency > 0 then
+                ratchet.thread.attach(udp_reply, socket, query, from)
+            else
+                udp_reply(socket, query, from)
+            end
+        end
+    end
+end
+-- }}}
+
+-- {{{ tcp_client()
+function tcp_client(client)
+    local buffer = ""
+    while true do
+        local data = client:recv()
+        if data == "" then
+            break
+        end
+        buffer = buffer .. data
+
+        while #buffer >= 2 do
+            local len = buffer:byte(1) * 256 + buffer:byte(2)
+            if #buffer < len + 2 then
+                break
+            end
+            local answer = stub.build_answer(buffer:sub(3, len + 2), records)
+            buffer = buffer:sub(len + 3)
+            client:send(string.char(math.floor(#answer / 256), #answer % 256) .. answer)
+        end
+    end
+    client:close()
+end
+-- }}}
+
+-- {{{ tcp_server()
+function tcp_server()
+    local rec = ratchet.socket.prepare_tcp(host, port, "AF_INET")
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:setsockopt("SO_REUSEADDR", true)
+    socket:bind(rec.addr)
+    socket:listen()
+
+    while true do
+        local client = socket:accept()
+        ratchet.thread.attach(tcp_client, client)
+    end
+end
+-- }}}
+
+-- {{{ worker()
+function worker(state)
+    while state.next <= num_queries do
+        local i = state.next
+        state.next = i + 1
+        local name = "host" .. ((i % num_names) + 1) .. ".bench."
+
+        local started = state.now()
+        local answer, err
+        if mode == "query_all" then
+            local answers = ratchet.dns.query_all(name, {"aaaa", "a"}, state.rc)
+            answer, err = answers.a, answers.a_error
+        else
+            answer, err = ratchet.dns.query(name, "a", state.rc)
+        end
+        state.latencies[i] = state.now() - started
+
+        if not answer then
+            state.errors = state.errors + 1
+        end
+    end
+end
+-- }}}
+
+-- {{{ driver()
+function driver()
+    ratchet.thread.attach(udp_server)
+    ratchet.thread.attach(tcp_server)
+    ratchet.thread.timer(0.1)
+
+    -- A timerfd armed far into the future doubles as a monotonic stopwatch.
+    local clock = ratchet.timerfd.new("monotonic")
+    clock:settime(1000000)
+    local state = {
+        next = 1,
+        errors = 0,
+        latencies = {},
+        rc = ratchet.dns.resolv_conf.new({resolv_conf_file}),
+        now = function () return 1000000 - clock:gettime() end,
+    }
+
+    -- Only lookups through the default resolv_conf are cached, so the stub's
+    -- stands in for it.
+    ratchet.dns.set_cache_options({enabled = cache})
+    ratchet.dns.flush_cache()
+    if cache then
+        debug.getregistry().ratchet_dns_resolv_conf_default = state.rc
+        state.rc = nil
+    end
+
+    local fds_before = count_fds()
+    collectgarbage("collect")
+    collectgarbage("stop")
+    local kb_before = collectgarbage("count")
+    local started = state.now()
+
+    local threads = {}
+    for i=1, concurrency do
+        threads[i] = ratchet.thread.attach(worker, state)
+    end
+    ratchet.thread.wait_all(threads)
+
+    local elapsed = state.now() - started
+    local kb_allocated = collectgarbage("count") - kb_before
+    collectgarbage("restart")
+    local fds_after = count_fds()
+
+    table.sort(state.latencies)
+    local function percentile(p)
+        return state.latencies[math.max(1, math.ceil(#state.latencies * p))] * 1000.0
+    end
+    local stats = ratchet.dns.engine_stats()
+    local cache_stats = ratchet.dns.cache_stats()
+
+    print(string.format("mode=%s queries=%d concurrency=%d latency=%.3f loss=%.2f truncate=%.2f cache=%s",
+          mode, num_queries, concurrency, latency, loss, truncate, cache and "on" or "off"))
+    print(string.format("elapsed=%.3fs qps=%.0f errors=%d", elapsed, num_queries / elapsed, state.errors))
+    print(string.format("p50=%.3fms p99=%.3fms max=%.3fms", percentile(0.50), percentile(0.99), percentile(1.0)))
+    print(string.format("fds_before=%d fds_after=%d engine_sockets=%d", fds_before, fds_after, stats.sockets))
+    print(string.format("sent=%d retransmits=%d responses=%d truncated=%d timeouts=%d coalesced=%d",
+          stats.sent, stats.retransmits, stats.responses, stats.truncated, stats.timeouts, stats.coalesced))
+    print(string.format("cache_hits=%d cache_negative_hits=%d cache_misses=%d",
+          cache_stats.hits, cache_stats.negative_hits, cache_stats.misses))
+    print(string.format("lua_allocated=%.0fKB per_query=%.2fKB", kb_allocated, kb_allocated / num_queries))
+
+    os.remove(resolv_conf_file)
+    os.exit(0)
+end
+-- }}}
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(driver)
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,75 @@
+require "ratchet"
+
+-- Usage: bench_exec.lua [spawns] [heap_mb,...] [command]
+--
+-- Measures how long ratchet.exec takes to start and reap a trivial command
+-- as the Lua heap grows, since a fork() copies the page tables of the whole
+-- address space. The heap is grown with resident strings before each round.
+
+num_spawns = tonumber(arg[1]) or 200
+heap_sizes = {}
+for mb in (arg[2] or "0,256,1024"):gmatch("%d+") do
+    table.insert(heap_sizes, tonumber(mb))
+end
+command = arg[3] or "true"
+
+-- {{{ grow_heap()
+function grow_heap(ballast, mb)
+    -- Unique strings, so every page is really allocated and touched.
+    local chunk = string.rep("x", 1024 * 1024 - 16)
+    while #ballast < mb do
+        table.insert(ballast, chunk .. string.format("%016d", #ballast))
+    end
+end
+-- }}}
+
+-- {{{ spawn_round()
+function spawn_round(now)
+    local latencies = {}
+    for i=1, num_spawns do
+        local started = now()
+        local p = ratchet.exec.new({command})
+        p:start()
+        p:stdin():close()
+        p:wait()
+        latencies[i] = now() - started
+    end
+    table.sort(latencies)
+    return latencies
+end
+-- }}}
+
+-- {{{ driver()
+function driver()
+    -- A timerfd armed far into the future doubles as a monotonic stopwatch.
+    local clock = ratchet.timerfd.new("monotonic")
+    clock:settime(1000000)
+    local now = function () return 1000000 - clock:gettime() end
+
+    local ballast = {}
+    for i, mb in ipairs(heap_sizes) do
+        grow_heap(ballast, mb)
+        collectgarbage("collect")
+
+        local started = now()
+        local latencies = spawn_round(now)
+        local elapsed = now() - started
+
+        local function percentile(p)
+            return latencies[math.max(1, math.ceil(#latencies * p))] * 1000.0
+        end
+        print(string.format("heap=%.0fMB spawns=%d command=%s elapsed=%.3fs spawns_per_sec=%.0f",
+              collectgarbage("count") / 1024, num_spawns, command, elapsed, num_spawns / elapsed))
+        print(string.format("p50=%.3fms p99=%.3fms max=%.3fms", percentile(0.50), percentile(0.99), percentile(1.0)))
+    end
+
+    os.exit(0)
+end
+-- }}}
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(driver)
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,47 @@
+require "ratchet"
+
+counter = 0
+
+function ctx1()
+    -- Hosts file entries have no TTL, so force them into the cache.
+    ratchet.dns.set_cache_options({min_ttl = 60})
+
+    local first = ratchet.dns.query("localhost", "a")
+    assert(first and first[1])
+
+    -- Portion being tested.
+    --
+    local second = ratchet.dns.query("localhost", "a")
+    assert(second ~= first)
+    assert(#second == #first and tostring(second[1]) == tostring(first[1]))
+
+    -- Changing a returned answer does not change the cached one.
+    second[1] = nil
+    local again = ratchet.dns.query("localhost", "a")
+    assert(again[1] and tostring(again[1]) == tostring(first[1]))
+
+    local stats = ratchet.dns.cache_stats()
+    assert(stats.hits == 2)
+    assert(stats.entries == 1)
+
+    local answers = ratchet.dns.query_all("localhost", {"a"})
+    assert(answers.a ~= first and tostring(answers.a[1]) == tostring(first[1]))
+    assert(ratchet.dns.cache_stats().hits == 3)
+
+    ratchet.dns.flush_cache("localhost")
+    assert(ratchet.dns.cache_stats().entries == 0)
+
+    local third = ratchet.dns.query("localhost", "a")
+    assert(third and third[1])
+
+    counter = counter + 1
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+assert(counter == 1)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,45 @@
+require "ratchet"
+
+-- Only the hosts file is consulted.
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("lookup file\n")
+f:close()
+
+function ctx1()
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+
+    -- Portion being tested.
+    --
+    local addrs, err = ratchet.dns.query_all("localhost", {"aaaa", "a", compact = true}, rc)
+    assert(addrs and #addrs > 0, err)
+    local last_pref = 0
+    for i = 1, #addrs do
+        assert(addrs[i])
+        assert(addrs:get_preference(i) >= last_pref)
+        last_pref = addrs:get_preference(i)
+        assert(addrs:get_ttl(i) >= 0)
+        assert(addrs:get_sockaddr(i, 25))
+    end
+    assert(addrs[#addrs + 1] == nil)
+    assert(not pcall(addrs.get_sockaddr, addrs, #addrs + 1, 25))
+
+    local socket = ratchet.socket.new(addrs:get_family(1))
+    socket:close()
+
+    local special = ratchet.dns.query_all("127.0.0.1", {"a", compact = true}, rc)
+    assert(#special == 1)
+    assert(tostring(special[1]) == "127.0.0.1")
+    assert(special:get_preference(1) == 0)
+
+    assert(not pcall(ratchet.dns.query_all, "localhost", {"mx", compact = true}, rc))
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
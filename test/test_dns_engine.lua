@@ -0,0 +1,60 @@
+require "ratchet"
+
+counter = 0
+num_queries = 20
+
+-- The nameserver never answers, so every lookup falls back to the hosts file.
+silent_port = 53543
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("nameserver [127.0.0.1]:" .. silent_port .. "\n")
+f:write("options timeout:1 attempts:1\n")
+f:write("lookup bind file\n")
+f:close()
+
+function query_localhost(rc)
+    -- Portion being tested.
+    --
+    local answer, err = ratchet.dns.query("localhost", "a", rc, nil, 0.5)
+    assert(answer and answer[1], err)
+
+    -- Identical concurrent queries share the first one's result.
+    first_answer = first_answer or answer
+    assert(answer == first_answer)
+
+    counter = counter + 1
+end
+
+function ctx1()
+    -- Bound but never read, so queries go unanswered.
+    local rec = ratchet.socket.prepare_udp("127.0.0.1", silent_port, "AF_INET")
+    local silent = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    silent:bind(rec.addr)
+
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+
+    local threads = {}
+    for i=1, num_queries do
+        threads[i] = ratchet.thread.attach(query_localhost, rc)
+    end
+    ratchet.thread.wait_all(threads)
+
+    local stats = ratchet.dns.engine_stats()
+    assert(stats.sockets == 1)
+    assert(stats.lookups == 1)
+    assert(stats.coalesced == num_queries - 1)
+    assert(stats.in_flight == 0)
+
+    silent:close()
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+
+assert(counter == num_queries)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,52 @@
+require "ratchet"
+
+-- Only the hosts file is consulted, so every answer comes from its index.
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("lookup file\n")
+f:close()
+
+hosts_file = os.tmpname()
+local f = io.open(hosts_file, "w")
+f:write("10.0.0.5    Web.Test alias.test   # comment\n")
+f:write("10.0.0.6    web.test\n")
+f:write("fe80::5     web.test\n")
+f:close()
+
+function ctx1()
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+    local hosts = ratchet.dns.hosts.new({hosts_file})
+
+    -- Portion being tested.
+    --
+    local answer, err = ratchet.dns.query("web.test.", "a", rc, hosts)
+    assert(answer, err)
+    assert(tostring(answer[1]) == "10.0.0.5" and tostring(answer[2]) == "10.0.0.6" and not answer[3])
+
+    local answer, err = ratchet.dns.query("WEB.test.", "aaaa", rc, hosts)
+    assert(answer and tostring(answer[1]) == "fe80::5", err)
+
+    local answer, err = ratchet.dns.query("alias.test.", "a", rc, hosts)
+    assert(answer and tostring(answer[1]) == "10.0.0.5", err)
+
+    local answer, err = ratchet.dns.query("10.0.0.5", "ptr", rc, hosts)
+    assert(answer and answer[1] == "Web.Test." and not answer[2], err)
+
+    local answer, err = ratchet.dns.query("missing.test.", "a", rc, hosts)
+    assert(not answer and err)
+
+    local answer, err = ratchet.dns.query("web.test.", "mx", rc, hosts)
+    assert(not answer and err)
+
+    assert(ratchet.dns.engine_stats().hosts_answers == 4)
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+os.remove(hosts_file)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
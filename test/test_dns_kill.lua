@@ -0,0 +1,90 @@
+require "ratchet"
+
+counter = 0
+done = {}
+
+-- The nameserver never answers, so lookups wait out their timeout.
+silent_port = 53544
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("nameserver [127.0.0.1]:" .. silent_port .. "\n")
+f:write("options timeout:1 attempts:1\n")
+f:write("lookup bind file\n")
+f:close()
+
+function killed_query(rc)
+    ratchet.dns.query("localhost", "a", rc, nil, 2)
+    error("killed thread was resumed")
+end
+
+function joined_query(rc)
+    local answer, err = ratchet.dns.query("localhost", "a", rc, nil, 2)
+    assert(answer and answer[1], err)
+    done[#done+1] = "joined"
+end
+
+function impatient_query(rc)
+    local answer, err = ratchet.dns.query("localhost", "a", rc, nil, 0.3)
+    assert(not answer and err == "Timed out.")
+    done[#done+1] = "impatient"
+end
+
+function ctx1()
+    -- Bound but never read, so queries go unanswered.
+    local rec = ratchet.socket.prepare_udp("127.0.0.1", silent_port, "AF_INET")
+    local silent = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    silent:bind(rec.addr)
+
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+
+    -- Portion being tested.
+    --
+    local thread = ratchet.thread.attach(killed_query, rc)
+    ratchet.thread.timer(0.1)
+    ratchet.thread.kill(thread)
+    assert(not ratchet.thread.is_alive(thread))
+    assert(not ratchet.thread.unpause(thread))
+
+    -- The engine drops the lookup once it is due, instead of waking the
+    -- killed thread, and keeps serving other threads.
+    ratchet.thread.timer(1.5)
+    local stats = ratchet.dns.engine_stats()
+    assert(stats.in_flight == 0)
+    assert(stats.abandoned == 1)
+
+    local answer, err = ratchet.dns.query("localhost", "a", rc, nil, 2)
+    assert(answer and answer[1], err)
+
+    -- A thread that joined the lookup takes it over from the killed thread.
+    thread = ratchet.thread.attach(killed_query, rc)
+    ratchet.thread.timer(0.1)
+    local joined = ratchet.thread.attach(joined_query, rc)
+    ratchet.thread.timer(0.1)
+    ratchet.thread.kill(thread)
+    ratchet.thread.wait_all({joined})
+    stats = ratchet.dns.engine_stats()
+    assert(stats.handoffs == 1)
+    assert(stats.abandoned == 1)
+
+    -- A joined lookup is only waited on until the joiner's own timeout.
+    done = {}
+    local owner = ratchet.thread.attach(joined_query, rc)
+    ratchet.thread.timer(0.1)
+    local impatient = ratchet.thread.attach(impatient_query, rc)
+    ratchet.thread.wait_all({owner, impatient})
+    assert(done[1] == "impatient" and done[2] == "joined")
+
+    silent:close()
+    counter = counter + 1
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+
+assert(counter == 1)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,33 @@
+require "ratchet"
+
+-- Only the hosts file is consulted, which has no MX records.
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("lookup file\n")
+f:close()
+
+function ctx1()
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+
+    -- Portion being tested.
+    --
+    local targets, err = ratchet.dns.resolve_mx_targets("localhost", 2525, {resolv_conf = rc})
+    assert(targets and targets[1], err)
+    for i, target in ipairs(targets) do
+        assert(target.host == "localhost")
+        assert(target.priority == 0)
+        assert(target.addr)
+    end
+
+    local socket = ratchet.socket.new(targets[1].family, targets[1].socktype, targets[1].protocol)
+    socket:close()
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
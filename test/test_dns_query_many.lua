@@ -0,0 +1,46 @@
+require "ratchet"
+
+num_queries = 10
+
+-- Nothing answers on the nameserver, so every lookup falls back to the hosts file.
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("nameserver 127.0.0.1\n")
+f:write("options timeout:1 attempts:1\n")
+f:write("lookup bind file\n")
+f:close()
+
+function ctx1()
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+
+    local queries = {}
+    for i=1, num_queries do
+        queries[i] = {"localhost", (i % 2 == 0) and "a" or "aaaa"}
+    end
+    queries[num_queries+1] = {"127.0.0.1", "a"}
+
+    -- Portion being tested.
+    --
+    local answers, errors = ratchet.dns.query_many(queries, {resolv_conf = rc, concurrency = 3, timeout = 0.5})
+    for i=1, num_queries do
+        if queries[i][2] == "a" then
+            assert(answers[i] and answers[i][1], errors[i])
+        else
+            assert(answers[i] or errors[i])
+        end
+    end
+    assert(answers[num_queries+1] and answers[num_queries+1][1])
+
+    local stats = ratchet.dns.engine_stats()
+    assert(stats.sockets == 1)
+    assert(stats.in_flight == 0)
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,102 @@
+require "ratchet"
+stub = require "ratchet.dns.stub"
+
+counter = 0
+
+host = "127.0.0.1"
+failing_port = 53541
+working_port = 53542
+
+records = {
+    ["host.test."] = {"10.0.0.1"},
+    ["Host.Test."] = {"10.0.0.1"},
+}
+
+function write_resolv_conf(...)
+    local file = os.tmpname()
+    local f = io.open(file, "w")
+    for i, port in ipairs({...}) do
+        f:write("nameserver [" .. host .. "]:" .. port .. "\n")
+    end
+    f:write("options timeout:1 attempts:1\n")
+    f:write("lookup bind\n")
+    f:close()
+    return file
+end
+
+both_file = write_resolv_conf(failing_port, working_port)
+failing_file = write_resolv_conf(failing_port)
+
+function stub_server(port, options)
+    local rec = ratchet.socket.prepare_udp(host, port, "AF_INET")
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:bind(rec.addr)
+
+    while true do
+        local query, from = socket:recvfrom()
+        socket:sendto(stub.build_answer(query, records, options), from)
+    end
+end
+
+function ctx1()
+    local failing = ratchet.thread.attach(stub_server, failing_port, {rcode = 2})
+    local working = ratchet.thread.attach(stub_server, working_port)
+    ratchet.thread.timer(0.1)
+
+    local both = ratchet.dns.resolv_conf.new({both_file})
+    local only_failing = ratchet.dns.resolv_conf.new({failing_file})
+
+    -- Portion being tested.
+    --
+    local answer, err = ratchet.dns.query("host.test.", "a", both, nil, 2)
+    assert(answer and answer[1], err)
+    local stats = ratchet.dns.engine_stats()
+    assert(stats.server_failures == 1)
+    assert(stats.timeouts == 0)
+
+    local answers, errors, reasons = ratchet.dns.query_many({{"host.test.", "a"}, {"missing.test.", "a"}, {"host.test.", "mx"}}, {resolv_conf = both})
+    assert(answers[1] and not answers[2] and not answers[3])
+    assert(errors[2] and errors[3])
+    assert(not reasons[1] and reasons[2] == "nxdomain" and reasons[3] == "nodata")
+
+    answers, errors, reasons = ratchet.dns.query_many({{"host.test.", "a"}}, {resolv_conf = only_failing})
+    assert(not answers[1] and errors[1] and reasons[1] == "servfail")
+
+    -- The implicit MX is only for a domain whose MX answer is empty.
+    local targets, err = ratchet.dns.resolve_mx_targets("host.test.", 2525, {resolv_conf = both})
+    assert(targets and targets[1], err)
+    assert(targets[1].host == "host.test.")
+
+    local reason
+    targets, err, reason = ratchet.dns.resolve_mx_targets("host.test.", 2525, {resolv_conf = only_failing})
+    assert(not targets and err and reason == "servfail")
+
+    targets, err, reason = ratchet.dns.resolve_mx_targets("missing.test.", 2525, {resolv_conf = both})
+    assert(not targets and err and reason == "nxdomain")
+
+    -- An empty MX answer cached under other casing still means no MX.
+    debug.getregistry().ratchet_dns_resolv_conf_default = both
+    ratchet.dns.flush_cache()
+    answer, err = ratchet.dns.query("Host.Test.", "mx")
+    assert(not answer and err)
+    targets, err = ratchet.dns.resolve_mx_targets("host.test.", 2525)
+    assert(targets and targets[1], err)
+    assert(ratchet.dns.cache_stats().negative_hits >= 1)
+
+    ratchet.thread.kill(failing)
+    ratchet.thread.kill(working)
+
+    counter = counter + 1
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(both_file)
+os.remove(failing_file)
+
+assert(counter == 1)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
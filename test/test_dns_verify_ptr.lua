@@ -0,0 +1,32 @@
+require "ratchet"
+
+-- Only the hosts file is consulted, where localhost leads back to itself.
+resolv_conf_file = os.tmpname()
+local f = io.open(resolv_conf_file, "w")
+f:write("lookup file\n")
+f:close()
+
+function ctx1()
+    local rc = ratchet.dns.resolv_conf.new({resolv_conf_file})
+    local rec = ratchet.socket.prepare_tcp("127.0.0.1", 25, "AF_INET")
+
+    -- Portion being tested.
+    --
+    local name, err = ratchet.dns.verify_ptr(rec.addr, {resolv_conf = rc})
+    assert(name == "localhost.", err)
+
+    local name, err = ratchet.dns.verify_ptr("127.0.0.1", {resolv_conf = rc})
+    assert(name == "localhost.", err)
+
+    local name, err = ratchet.dns.verify_ptr("192.0.2.1", {resolv_conf = rc})
+    assert(not name and err)
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(resolv_conf_file)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -37,14 +37,115 @@ function communicate_test()
     tests = tests + 4
 end
 
+function communicate_stream_test()
+    local p = ratchet.exec.new({"cat"})
+    local chunk = string.rep("x", 100000)
+    local function source()
+        local sent = 0
+        return function ()
+            if sent < 10 then
+                sent = sent + 1
+                return chunk
+            end
+        end
+    end
+    local received = 0
+    local out, err, status = p:communicate(source(), {stdout = function (data)
+        received = received + #data
+    end})
+    assert(nil == out)
+    assert("" == err)
+    assert(0 == status)
+    assert(1000000 == received)
+
+    local chunks = {}
+    local out = ratchet.exec.new({"echo", "hello"}):communicate(nil, {stdout = chunks})
+    assert(out == chunks)
+    assert("hello\n" == table.concat(chunks))
+
+    local p = ratchet.exec.new({"cat"})
+    local ok, err = pcall(p.communicate, p, source(), {max_output = 1000})
+    assert(not ok and err.code == "EFBIG")
+
+    tests = tests + 1
+end
+
+function wait_rusage_test()
+    local p = ratchet.exec.new({"sleep", "0.1"})
+    p:start()
+    p:stdin():close()
+    local status, exited, usage = p:wait()
+    assert(0 == status)
+    assert(exited)
+    assert(usage.utime >= 0 and usage.stime >= 0)
+    assert(usage.maxrss >= 0)
+
+    tests = tests + 1
+end
+
+function wait_timeout_test()
+    local p = ratchet.exec.new({"sleep", "5"})
+    p:start()
+    p:stdin():close()
+    local ok, err = pcall(p.wait, p, 0.1)
+    assert(not ok and err.code == "ETIMEDOUT")
+    p:kill()
+    local status, exited = p:wait()
+    assert(not exited)
+
+    tests = tests + 1
+end
+
+function limits_stats_test()
+    local before = ratchet.exec.stats()
+    local p = ratchet.exec.new({"sh", "-c", "ulimit -n"}, {rlimits = {nofile = 64}})
+    p:start()
+    p:stdin():close()
+    assert("64\n" == p:stdout():read())
+    local status, exited, usage = p:wait()
+    assert(0 == status and exited)
+    assert(usage.wall > 0)
+
+    local after = ratchet.exec.stats()
+    assert(after.spawned == before.spawned + 1)
+    assert(after.exited == before.exited + 1)
+    assert(after.wall >= before.wall + usage.wall)
+
+    p = ratchet.exec.new({"sh", "-c", "ulimit -f"}, {rlimits = {fsize = math.huge}})
+    p:start()
+    p:stdin():close()
+    assert("unlimited\n" == p:stdout():read())
+    assert(0 == p:wait())
+
+    -- Bad options are refused before anything is started.
+    assert(not pcall(ratchet.exec.new, {"true"}, {rlimits = {bogus = 1}}))
+    assert(not pcall(ratchet.exec.new, {"true"}, {rlimits = {nofile = -1}}))
+    assert(not pcall(ratchet.exec.new, {"true"}, {rlimits = {nofile = {64, 32}}}))
+    assert(not pcall(ratchet.exec.new, {"true"}, {cpus = {-1}}))
+    assert(ratchet.exec.stats().spawn_failures == after.spawn_failures)
+
+    -- Limits are applied in the child, which reports back a failed step.
+    local bad = ratchet.exec.new({"true"}, {cgroup = "/nonexistent"})
+    assert(not pcall(bad.start, bad))
+    bad = ratchet.exec.new({"/nonexistent"}, {rlimits = {nofile = 64}})
+    assert(not pcall(bad.start, bad))
+    assert(ratchet.exec.stats().spawn_failures == after.spawn_failures + 2)
+
+    tests = tests + 1
+end
+
 kernel = ratchet.new(function ()
     ratchet.thread.attach(hello_world)
     ratchet.thread.attach(hello_world)
     ratchet.thread.attach(cat_test)
     ratchet.thread.attach(communicate_test)
+    ratchet.thread.attach(communicate_stream_test)
+    ratchet.thread.attach(wait_rusage_test)
+    ratchet.thread.attach(wait_timeout_test)
+    ratchet.thread.attach(limits_stats_test)
 end)
 kernel:loop()
 
-assert(tests == 9)
+assert(tests == 13)
 
 -- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
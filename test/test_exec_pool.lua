@@ -0,0 +1,105 @@
+require "ratchet"
+require "ratchet.exec.pool"
+
+-- The helpers run in the same Lua interpreter as this test.
+local i = -1
+while arg[i-1] do
+    i = i - 1
+end
+lua = arg[i]
+
+helper_file = os.tmpname()
+local f = io.open(helper_file, "w")
+f:write([[
+while true do
+    local header = io.read(4)
+    if not header then
+        break
+    end
+    local a, b, c, d = header:byte(1, 4)
+    local data = io.read(((a * 256 + b) * 256 + c) * 256 + d) or ""
+    if data == "crash" then
+        os.exit(1)
+    elseif data == "hang" then
+        io.read("*a")
+        break
+    end
+    local reply = data:upper()
+    local n = #reply
+    io.write(string.char(math.floor(n / 16777216) % 256, math.floor(n / 65536) % 256, math.floor(n / 256) % 256, n % 256), reply)
+    io.flush()
+end
+]])
+f:close()
+
+tests = 0
+
+function requester(pool, n)
+    for i=1, 3 do
+        local request = "request " .. n .. " " .. i
+        assert(pool:request(request) == request:upper())
+    end
+
+    tests = tests + 1
+end
+
+function ctx1()
+    local pool = ratchet.exec.pool.new({lua, helper_file}, {size = 2, max_requests = 4})
+
+    -- Portion being tested.
+    --
+    local threads = {}
+    for n=1, 6 do
+        threads[n] = ratchet.thread.attach(requester, pool, n)
+    end
+    ratchet.thread.wait_all(threads)
+
+    local stats = pool:stats()
+    assert(stats.requests == 18)
+    assert(stats.queued > 0)
+    assert(stats.recycled > 0)
+    assert(stats.helpers <= 2)
+
+    local response, err = pool:request("crash")
+    assert(not response and err)
+    assert(pool:request("again") == "AGAIN")
+    assert(pool:stats().crashed == 1)
+
+    assert(pool:request(string.rep("x", 200000)) == string.rep("X", 200000))
+
+    pool:close()
+    assert(not pool:request("closed"))
+
+    -- Killed requests neither take a helper from the queue nor keep theirs.
+    pool = ratchet.exec.pool.new({lua, helper_file}, {size = 1})
+    local hanging = ratchet.thread.attach(killed_request, pool, "hang")
+    ratchet.thread.timer(0.1)
+    local queued = ratchet.thread.attach(killed_request, pool, "queued")
+    local after = ratchet.thread.attach(requester, pool, 7)
+    ratchet.thread.timer(0.1)
+    ratchet.thread.kill(queued)
+    ratchet.thread.kill(hanging)
+    ratchet.thread.wait_all({after})
+
+    local stats = pool:stats()
+    assert(stats.abandoned == 1)
+    assert(stats.waiting == 0)
+    assert(stats.helpers == 1)
+    pool:close()
+end
+
+function killed_request(pool, data)
+    pool:request(data)
+    error("killed request was resumed")
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+end)
+kernel:loop()
+
+os.remove(helper_file)
+
+assert(tests == 7)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,50 @@
+require "ratchet"
+
+function ctx1(host)
+    local rec_a = ratchet.socket.prepare_udp(host, 10026, "AF_INET")
+    local socket_a = ratchet.socket.new(rec_a.family, rec_a.socktype, rec_a.protocol)
+    socket_a:bind(rec_a.addr)
+
+    local rec_b = ratchet.socket.prepare_udp(host, 10027, "AF_INET")
+    local socket_b = ratchet.socket.new(rec_b.family, rec_b.socktype, rec_b.protocol)
+    socket_b:bind(rec_b.addr)
+
+    ratchet.thread.attach(ctx2, socket_b)
+
+    -- Portion being tested.
+    --
+    socket_a:sendto("ping", rec_b.addr)
+    local data, from = socket_a:recvfrom()
+    assert(data == "pong")
+    assert(tostring(from) == "127.0.0.1")
+
+    -- Each call receives one datagram, cut short at maxlen.
+    socket_a:sendto("hello world", rec_b.addr)
+    socket_a:sendto("foo", rec_b.addr)
+
+    socket_a:set_timeout(0.1)
+    local worked, err = pcall(socket_a.recvfrom, socket_a)
+    assert(not worked and ratchet.error.is(err, "ETIMEDOUT"), "recvfrom failed to timeout")
+
+    socket_a:close()
+end
+
+function ctx2(socket_b)
+    local data, from = socket_b:recvfrom()
+    assert(data == "ping")
+    socket_b:sendto("pong", from)
+
+    local data = socket_b:recvfrom(5)
+    assert(data == "hello")
+    local data = socket_b:recvfrom()
+    assert(data == "foo")
+
+    socket_b:close()
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "127.0.0.1")
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,79 @@
+require "ratchet"
+
+counter = 0
+payload = string.rep("0123456789abcdef", 262144)
+tail = string.rep("fedcba9876543210", 4096)
+
+function ctx1(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:setsockopt("SO_REUSEADDR", true)
+    socket:bind(rec.addr)
+    socket:listen()
+
+    ratchet.thread.attach(ctx2, host, port)
+
+    local client = socket:accept()
+    local enc = client:encrypt(ssl1)
+    enc:server_handshake()
+
+    -- Portion being tested.
+    --
+    enc:write_all(payload)
+    local done, total = enc:get_write_progress()
+    assert(done == #payload and total == #payload)
+
+    -- Later writes on the same session must still be written whole.
+    client:send(tail)
+
+    local data = client:recv()
+    assert(data == "done")
+
+    enc:shutdown()
+    client:close()
+
+    counter = counter + 1
+end
+
+function ctx2(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:connect(rec.addr)
+
+    local enc = socket:encrypt(ssl2)
+    enc:client_handshake()
+
+    -- Portion being tested.
+    --
+    local buffer = ratchet.ssl.new_buffer()
+    while #buffer < #payload + #tail do
+        local n = enc:read_into(buffer, 65536)
+        assert(n > 0)
+    end
+    assert(buffer:tostring() == payload .. tail)
+
+    buffer:clear()
+    assert(#buffer == 0)
+
+    socket:send("done")
+
+    enc:shutdown()
+    socket:close()
+
+    counter = counter + 1
+end
+
+ssl1 = ratchet.ssl.new(ratchet.ssl.SSLv3_server)
+ssl1:load_certs("cert.pem")
+
+ssl2 = ratchet.ssl.new(ratchet.ssl.SSLv3_client)
+ssl2:load_cas(nil, "cert.pem")
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "localhost", 10025)
+end)
+kernel:loop()
+
+assert(counter == 2)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,84 @@
+require "ratchet"
+
+counter = 0
+
+function ctx1(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:setsockopt("SO_REUSEADDR", true)
+    socket:bind(rec.addr)
+    socket:listen()
+
+    for i = 1, 3 do
+        ratchet.thread.attach(ctx2, host, port)
+    end
+    ratchet.thread.attach(ticker)
+
+    for i = 1, 3 do
+        local client = socket:accept()
+        ratchet.thread.attach(server_handler, client)
+    end
+end
+
+function server_handler(client)
+    -- Portion being tested.
+    --
+    local enc = client:encrypt(ssl1)
+    enc:server_handshake()
+
+    client:send("hello")
+    local data = client:recv()
+    assert(data == "world")
+
+    enc:shutdown()
+    client:close()
+
+    counter = counter + 1
+end
+
+function ctx2(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:connect(rec.addr)
+
+    -- Portion being tested.
+    --
+    local enc = socket:encrypt(ssl2)
+    enc:client_handshake()
+
+    local got_cert, verified, host_matched = enc:verify_certificate(rec.host)
+    assert(got_cert and verified and host_matched)
+
+    local data = socket:recv()
+    assert(data == "hello")
+    socket:send("world")
+
+    enc:shutdown()
+    socket:close()
+
+    counter = counter + 1
+end
+
+function ticker()
+    -- Other threads keep running while handshakes are offloaded.
+    while counter < 6 do
+        ratchet.thread.timer(0.01)
+    end
+end
+
+ssl1 = ratchet.ssl.new(ratchet.ssl.SSLv3_server)
+ssl1:load_certs("cert.pem")
+ssl1:set_handshake_offload(2)
+
+ssl2 = ratchet.ssl.new(ratchet.ssl.SSLv3_client)
+ssl2:load_cas(nil, "cert.pem")
+ssl2:set_handshake_offload(1)
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "localhost", 10025)
+end)
+kernel:loop()
+
+assert(counter == 6)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
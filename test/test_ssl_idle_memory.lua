@@ -0,0 +1,84 @@
+require "ratchet"
+
+counter = 0
+
+function ctx1(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:setsockopt("SO_REUSEADDR", true)
+    socket:bind(rec.addr)
+    socket:listen()
+
+    ratchet.thread.attach(ctx2, host, port)
+
+    local client = socket:accept()
+    local enc = client:encrypt(ssl1)
+    enc:server_handshake()
+
+    client:send("hello")
+
+    -- Portion being tested.
+    --
+    local buffer = ratchet.ssl.new_buffer()
+    assert(enc:read_into(buffer, 2) == 2)
+
+    -- Undelivered data keeps the read buffer allocated.
+    local before, sessions = ratchet.ssl.memory_usage()
+    assert(before and before > 0)
+    assert(sessions == 2)
+
+    assert(enc:read_into(buffer, 3) == 3)
+    assert(buffer:tostring() == "world")
+
+    -- Once drained, idle memory mode frees the read buffer.
+    local after = ratchet.ssl.memory_usage()
+    assert(before - after >= 16384)
+
+    -- Buffers are allocated again as needed.
+    client:send("again")
+    assert(client:recv() == "done")
+    assert(client:get_timeout() == -1.0)
+
+    enc:shutdown()
+    client:close()
+
+    counter = counter + 1
+end
+
+function ctx2(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:connect(rec.addr)
+
+    local enc = socket:encrypt(ssl2)
+    enc:client_handshake()
+
+    local data = socket:recv()
+    assert(data == "hello")
+    socket:send("world")
+
+    data = socket:recv()
+    assert(data == "again")
+    socket:send("done")
+
+    enc:shutdown()
+    socket:close()
+
+    counter = counter + 1
+end
+
+ssl1 = ratchet.ssl.new(ratchet.ssl.SSLv3_server)
+ssl1:load_certs("cert.pem")
+ssl1:set_idle_memory_mode(true)
+
+ssl2 = ratchet.ssl.new(ratchet.ssl.SSLv3_client)
+ssl2:load_cas(nil, "cert.pem")
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "localhost", 10025)
+end)
+kernel:loop()
+
+assert(counter == 2)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
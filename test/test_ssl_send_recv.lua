@@ -32,6 +32,12 @@ function ctx1(host, port)
     assert(data == "foo")
     client:send("bar")
 
+    local stats = enc:stats()
+    assert(stats.handshake_done and not stats.resumed)
+    assert(stats.cipher == "AES256-SHA")
+    assert(stats.bytes_read == 8 and stats.bytes_written == 8)
+    assert(stats.wire_bytes_read > stats.bytes_read)
+
     enc:shutdown()
     client:close()
 
@@ -85,4 +91,10 @@ kernel:loop()
 
 assert(counter == 3)
 
+local stats = ssl1:stats()
+assert(stats.handshakes == 1 and stats.full_handshakes == 1)
+assert(stats.failed_handshakes == 0)
+assert(stats.ciphers["AES256-SHA"] == 1)
+assert(stats.bytes_read == 8 and stats.bytes_written == 8)
+
 -- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
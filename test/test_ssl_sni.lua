@@ -0,0 +1,95 @@
+require "ratchet"
+
+counter = 0
+
+function ctx1(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:setsockopt("SO_REUSEADDR", true)
+    socket:bind(rec.addr)
+    socket:listen()
+
+    ratchet.thread.attach(ctx2, host, port, "mail.example.com")
+    ratchet.thread.attach(ctx2, host, port, "www.example.org")
+    ratchet.thread.attach(ctx2, host, port, "unknown.example.net")
+
+    for i = 1, 3 do
+        local client = socket:accept()
+        ratchet.thread.attach(server_handler, client)
+    end
+end
+
+function server_handler(client)
+    local enc = client:encrypt(ssl_default)
+    enc:server_handshake()
+
+    client:send("hello")
+    local data = client:recv()
+    assert(data == "world")
+
+    enc:shutdown()
+    client:close()
+
+    counter = counter + 1
+end
+
+function ctx2(host, port, server_name)
+    local rec = ratchet.socket.prepare_tcp(host, port)
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:connect(rec.addr)
+
+    -- Portion being tested.
+    --
+    local enc = socket:encrypt(ssl_client)
+    enc:set_server_name(server_name)
+    enc:client_handshake()
+
+    local data = socket:recv()
+    assert(data == "hello")
+    socket:send("world")
+
+    enc:shutdown()
+    socket:close()
+
+    counter = counter + 1
+end
+
+ssl_default = ratchet.ssl.new(ratchet.ssl.TLSv1_server)
+ssl_default:load_certs("cert.pem")
+
+ssl_example_com = ratchet.ssl.new(ratchet.ssl.TLSv1_server)
+ssl_example_com:load_certs("cert.pem")
+
+ssl_example_org = ratchet.ssl.new(ratchet.ssl.TLSv1_server)
+ssl_example_org:load_certs("cert.pem")
+
+ssl_default:set_sni_contexts({
+    ["MAIL.example.com"] = ssl_example_com,
+    ["*.example.org"] = ssl_example_org,
+})
+
+ssl_client = ratchet.ssl.new(ratchet.ssl.TLSv1_client)
+ssl_client:load_cas(nil, "cert.pem")
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "localhost", 10025)
+end)
+kernel:loop()
+
+assert(counter == 6)
+
+local counts, default = ssl_default:get_sni_counts()
+assert(counts["mail.example.com"] == 1)
+assert(counts["*.example.org"] == 1)
+assert(default == 1)
+
+-- Reloading keeps counts for hostnames that remain.
+ssl_default:set_sni_contexts({
+    ["mail.example.com"] = ssl_example_com,
+})
+counts, default = ssl_default:get_sni_counts()
+assert(counts["mail.example.com"] == 1)
+assert(counts["*.example.org"] == nil)
+assert(default == 1)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
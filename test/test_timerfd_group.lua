@@ -0,0 +1,78 @@
+require "ratchet"
+require "ratchet.timerfd.group"
+
+local group = ratchet.timerfd.group.new("monotonic", 0.05)
+local num_oneshot = 200
+local done = 0
+
+function oneshot(i)
+    local timer = group:new_timer()
+    timer:settime(0.1 + (i % 10) * 0.01)
+
+    -- Portion being tested.
+    --
+    local fires = timer:read()
+    assert(fires == 1)
+    timer:close()
+
+    done = done + 1
+end
+
+function periodic()
+    local timer = group:new_timer()
+    timer:settime(0.05, 0.05)
+
+    -- Portion being tested.
+    --
+    local fires = 0
+    while fires < 4 do
+        fires = fires + timer:read()
+    end
+    timer:close()
+
+    done = done + 1
+end
+
+function killed_read(timer)
+    timer:read()
+    error("killed thread was resumed")
+end
+
+function killed_reader()
+    local killed_group = ratchet.timerfd.group.new()
+    killed_group.sweep_interval = 0.1
+    local timer = killed_group:new_timer()
+    timer:settime(60)
+
+    local thread = ratchet.thread.attach(killed_read, timer)
+    ratchet.thread.timer(0.05)
+    ratchet.thread.kill(thread)
+
+    -- Portion being tested.
+    --
+    ratchet.thread.timer(0.3)
+    local stats = killed_group:stats()
+    assert(stats.waiting == 0 and stats.abandoned == 1)
+    timer:close()
+    assert(killed_group:stats().armed == 0)
+
+    done = done + 1
+end
+
+kernel = ratchet.new(function ()
+    for i = 1, num_oneshot do
+        ratchet.thread.attach(oneshot, i)
+    end
+    ratchet.thread.attach(periodic)
+    ratchet.thread.attach(killed_reader)
+end)
+kernel:loop()
+
+local stats = group:stats()
+assert(done == num_oneshot + 2)
+assert(stats.timers == 0 and stats.armed == 0 and stats.waiting == 0)
+assert(stats.fires >= num_oneshot + 4)
+-- Slack lets the one-shot timers share a handful of wakeups.
+assert(stats.wakeups < 20)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
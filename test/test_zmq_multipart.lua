@@ -0,0 +1,44 @@
+require "ratchet"
+
+local big = string.rep("x", 100000)
+
+function ctx1(where)
+    local rec = ratchet.zmqsocket.prepare_uri(where)
+    local socket = ratchet.zmqsocket.new(rec.type)
+    socket:bind(rec.endpoint)
+
+    ratchet.thread.attach(ctx2, "pull:tcp://127.0.0.1:10026")
+
+    -- Portion being tested.
+    --
+    for i = 1, 50 do
+        socket:send_multipart({"header", big, tostring(i)})
+    end
+    socket:send_multipart({"done"})
+end
+
+function ctx2(where)
+    local rec = ratchet.zmqsocket.prepare_uri(where)
+    local socket = ratchet.zmqsocket.new(rec.type)
+    socket:connect(rec.endpoint)
+
+    -- Portion being tested.
+    --
+    for i = 1, 25 do
+        local data = socket:recv_all()
+        assert(data == "header" .. big .. tostring(i))
+    end
+    for i = 26, 50 do
+        local frames = socket:recv_multipart()
+        assert(#frames == 3)
+        assert(frames[1] == "header" and frames[2] == big and frames[3] == tostring(i))
+    end
+    assert(socket:recv_all() == "done")
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "push:tcp://127.0.0.1:10026")
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,49 @@
+require "ratchet"
+
+local num_messages = 500
+
+function proxy()
+    local frontend = ratchet.zmqsocket.new("PULL")
+    frontend:bind("tcp://127.0.0.1:10027")
+    local backend = ratchet.zmqsocket.new("PUSH")
+    backend:bind("tcp://127.0.0.1:10028")
+
+    ratchet.thread.attach(producer, "tcp://127.0.0.1:10027")
+    ratchet.thread.attach(consumer, "tcp://127.0.0.1:10028")
+
+    -- Portion being tested.
+    --
+    frontend:set_timeout(1.0)
+    ratchet.zmqsocket.proxy(frontend, backend)
+
+    local in_stats, out_stats = frontend:stats(), backend:stats()
+    assert(in_stats.received_messages == num_messages)
+    assert(out_stats.sent_messages == num_messages)
+    assert(in_stats.received_bytes == out_stats.sent_bytes)
+end
+
+function producer(where)
+    local socket = ratchet.zmqsocket.new("PUSH")
+    socket:connect(where)
+
+    for i = 1, num_messages do
+        socket:send_multipart({"part", tostring(i)})
+    end
+end
+
+function consumer(where)
+    local socket = ratchet.zmqsocket.new("PULL")
+    socket:connect(where)
+
+    for i = 1, num_messages do
+        local frames = socket:recv_multipart()
+        assert(frames[1] == "part" and frames[2] == tostring(i))
+    end
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(proxy)
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
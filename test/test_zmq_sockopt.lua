@@ -0,0 +1,63 @@
+require "ratchet"
+
+local context = ratchet.zmqsocket.new_context(2, 0.5)
+local big = string.rep("x", 10000)
+local drained = false
+
+function ctx1(where)
+    local socket = ratchet.zmqsocket.new("PUSH", context)
+    assert(socket:getsockopt("ZMQ_LINGER") == 500)
+    socket:setsockopt("ZMQ_HWM", 100)
+    socket:setsockopt("ZMQ_LINGER", 0)
+
+    -- Portion being tested.
+    --
+    assert(socket:getsockopt("ZMQ_HWM") == 100)
+    assert(socket:getsockopt("ZMQ_LINGER") == 0)
+    assert(socket:getsockopt("ZMQ_NOT_AN_OPTION") == nil)
+    assert(not pcall(socket.setsockopt, socket, "ZMQ_EVENTS", 0))
+
+    -- Nothing is bound yet, so the frames wait in the connecting pipe.
+    socket:connect(where)
+    for i = 1, 10 do
+        socket:send(big)
+    end
+    local stats = socket:stats()
+    assert(stats.sent_messages == 10)
+    assert(stats.sent_bytes == 10 * #big)
+    assert(stats.pinned_frames == 10)
+    assert(stats.pinned_bytes == 10 * #big)
+
+    ratchet.thread.attach(ctx2, where)
+
+    for i = 1, 100 do
+        if drained and socket:stats().pinned_frames == 0 then
+            break
+        end
+        ratchet.thread.timer(0.01)
+    end
+    assert(drained)
+    assert(socket:stats().pinned_frames == 0)
+    assert(socket:stats().pinned_bytes == 0)
+end
+
+function ctx2(where)
+    local socket = ratchet.zmqsocket.new("PULL", context)
+    socket:bind(where)
+
+    assert(context:stats().io_threads == 2)
+    assert(context:stats().sockets == 2)
+
+    for i = 1, 10 do
+        assert(socket:recv() == big)
+    end
+    assert(socket:stats().received_messages == 10)
+    drained = true
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "tcp://127.0.0.1:10029")
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et: